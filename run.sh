@@ -11,3 +11,4 @@ CFLAGS="-lpmemobj -lpthread -march=native"
 
 g++ $CINCLUDE $CDEBUG $CWARNING -o simple_test test/simple_test.cc source/PHAST.cc $CFLAGS
 
+g++ $CINCLUDE $CDEBUG $CWARNING -o micro_bench test/micro_bench.cc source/PHAST.cc $CFLAGS
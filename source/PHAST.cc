@@ -1,37 +1,329 @@
 #include "PHAST.h"
 
-#ifdef USE_PMDK
-PMEMobjpool *pop; // global pmemobj pool
+#ifdef USE_PERSIST_STATS
+// the counters of a thread slot, written by its thread only.
+struct alignas(64) ThreadPersistStats
+{
+	PersistStats ops[PERSIST_OP_NUM];
+};
+static ThreadPersistStats persist_stats[MAX_THREAD_NUM];
+
+// the kind of operation the flushes of the pools in this thread are counted as.
+static thread_local PersistOp persist_op = PERSIST_CREATE;
+
+// BRIEF: pm_flush_hook, a flush of [addr, addr + len) ends with a fence.
+static void count_flush(const void *addr, size_t len)
+{
+	PersistStats *stats = &(persist_stats[thread_slot_id()].ops[persist_op]);
+	stats->persists++;
+	stats->lines += ((uintptr_t)addr + len + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE - (uintptr_t)addr / CACHE_LINE_SIZE;
+	stats->bytes += len;
+	stats->fences++;
+}
+
+void (*pm_flush_hook)(const void *addr, size_t len) = count_flush;
+#else
+void (*pm_flush_hook)(const void *addr, size_t len) = NULL;
+#endif
+
+// BRIEF: the flushes the pools issue in this thread from now on are counted as op.
+static inline void persist_as(PersistOp op)
+{
+#ifdef USE_PERSIST_STATS
+	persist_op = op;
+#endif
+}
+
+// BRIEF: every persist of this file goes through here, counted as op.
+static inline void persist(PMPool *pop, const void *addr, size_t len, PersistOp op)
+{
+	persist_as(op);
+	pop->Persist(addr, len);
+}
+
+// BRIEF: PMPool::TxAdd, the undo log the pool writes is counted as op.
+static inline bool tx_add(PMPool *pop, const void *addr, size_t len, PersistOp op)
+{
+	persist_as(op);
+	return pop->TxAdd(addr, len);
+}
+
+// BRIEF: PMPool::TxEnd, the ranges and the log the pool persists are counted as op.
+static inline void tx_end(PMPool *pop, PersistOp op)
+{
+	persist_as(op);
+	pop->TxEnd();
+}
+
+// BRIEF: PMPool::TxAbort, the ranges the pool restores are counted as op.
+static inline void tx_abort(PMPool *pop, PersistOp op)
+{
+	persist_as(op);
+	pop->TxAbort();
+}
+
+// BRIEF: PMPool::ZAlloc, Alloc and Free, the flushes of the allocator of the
+//        pool are counted as PERSIST_ALLOC.
+static inline void *pm_zalloc(PMPool *pop, size_t size)
+{
+	persist_as(PERSIST_ALLOC);
+	return pop->ZAlloc(size);
+}
+
+static inline void *pm_alloc(PMPool *pop, size_t size)
+{
+	persist_as(PERSIST_ALLOC);
+	return pop->Alloc(size);
+}
+
+static inline void pm_free(PMPool *pop, void *obj)
+{
+	persist_as(PERSIST_ALLOC);
+	pop->Free(obj);
+}
+
+void get_persist_stats(PersistStats stats[PERSIST_OP_NUM])
+{
+	memset(stats, 0, sizeof(PersistStats) * PERSIST_OP_NUM);
+#ifdef USE_PERSIST_STATS
+	for (int t = 0; t < MAX_THREAD_NUM; ++t)
+	{
+		for (int op = 0; op < PERSIST_OP_NUM; ++op)
+		{
+			const PersistStats &from = persist_stats[t].ops[op];
+			stats[op].persists += from.persists;
+			stats[op].lines += from.lines;
+			stats[op].bytes += from.bytes;
+			stats[op].fences += from.fences;
+		}
+	}
+#endif
+}
+
+void clear_persist_stats()
+{
+#ifdef USE_PERSIST_STATS
+	memset(persist_stats, 0, sizeof(persist_stats));
+#endif
+}
+
+void add_persist_stats(CounterSet *counters, PersistOp op)
+{
+	PersistStats stats[PERSIST_OP_NUM];
+	get_persist_stats(stats);
+	for (int i = 0; i < PERSIST_OP_NUM; ++i)
+	{
+		if (op != PERSIST_OP_NUM && op != i)
+			continue;
+		counters->Add(CFLUSH_NUM, stats[i].lines);
+		counters->Add(CFLUSH_SIZE, stats[i].bytes);
+		counters->Add(MFENCE_NUM, stats[i].fences);
+	}
+}
+
+// BRIEF: the leaf groups of a pool, reset if not recover.
+static LAL *new_leaf_allocator(PMPool *pop, bool recover)
+{
+	LAL *alloc = new LeafAllocator;
+	alloc->pop = pop;
+	alloc->root = (SHA *)pop->Root(sizeof(SHA));
+#ifdef USE_LEAF_BATCH_ALLOC
+	alloc->recycled = NULL;
+	for (int i = 0; i < MAX_THREAD_NUM; ++i)
+	{
+		alloc->cursors[i].recycled = NULL;
+		alloc->cursors[i].pos = NULL;
+		alloc->cursors[i].end = NULL;
+		alloc->cursors[i].spare = NULL;
+	}
+#endif
+	if (!recover)
+	{
+		alloc->root->free_leaves = NULL;
+		persist(pop, &(alloc->root->free_leaves), sizeof(LSG *), PERSIST_CREATE);
+#ifdef USE_LEAF_BATCH_ALLOC
+		alloc->root->leaf_chunks = NULL;
+		persist(pop, &(alloc->root->leaf_chunks), sizeof(LCK *), PERSIST_CREATE);
+#endif
+	}
+	return alloc;
+}
+
+// BRIEF: EpochManager::FreeFunc of the leaf groups, arg is the allocator. the
+//        leaf is zeroed here, so the splits reuse it without clearing it.
+#ifdef USE_LEAF_BATCH_ALLOC
+//        the free ones are kept in DRAM, the recovery finds them in the chunks.
+static void FreeLeafNode(void *arg, void *ptr)
+{
+	LAL *alloc = (LAL *)arg;
+	LSG *leaf = (LSG *)ptr;
+	memset((void *)leaf, 0, sizeof(LSG));
+	alloc->lock.Lock();
+	leaf->next = alloc->recycled;
+	alloc->recycled = leaf;
+	alloc->lock.Unlock();
+}
+#else
+//        a crash before the root is persisted leaks the leaf only.
+static void FreeLeafNode(void *arg, void *ptr)
+{
+	LAL *alloc = (LAL *)arg;
+	LSG *leaf = (LSG *)ptr;
+	memset((void *)leaf, 0, sizeof(LSG));
+	alloc->lock.Lock();
+	leaf->next = alloc->root->free_leaves;
+	persist(alloc->pop, leaf, sizeof(LSG), PERSIST_ALLOC);
+	alloc->root->free_leaves = leaf;
+	persist(alloc->pop, &(alloc->root->free_leaves), sizeof(LSG *), PERSIST_ALLOC);
+	alloc->lock.Unlock();
+}
+#endif
+
+#ifdef USE_LEAF_BATCH_ALLOC
+// BRIEF: reserve a zeroed chunk and link it to the root, the recovery frees
+//        the leaf groups of it that are never linked.
+// RETURN: NULL if the pool is full.
+static LCK *ReserveLeafChunk(LAL *alloc)
+{
+	LCK *new_chunk = (LCK *)pm_zalloc(alloc->pop, sizeof(LCK));
+	if (new_chunk == NULL)
+	{
+		fprintf(stderr, "failed to create a LCK in nvmm.\n");
+		return NULL;
+	}
+
+	alloc->lock.Lock();
+	new_chunk->next = alloc->root->leaf_chunks;
+	persist(alloc->pop, &(new_chunk->next), sizeof(LCK *), PERSIST_ALLOC);
+	alloc->root->leaf_chunks = new_chunk;
+	persist(alloc->pop, &(alloc->root->leaf_chunks), sizeof(LCK *), PERSIST_ALLOC);
+	alloc->lock.Unlock();
+	return new_chunk;
+}
+
+// REQUIRES: cursor has no leaf group left.
+// BRIEF: give cursor up to LEAF_ALLOC_BATCH recycled leaf groups, otherwise
+//        its spare chunk, otherwise a chunk reserved now.
+// RETURN: false if the pool is full.
+static bool RefillLeafCursor(LAL *alloc, LeafCursor *cursor)
+{
+	if (__atomic_load_n(&(alloc->recycled), __ATOMIC_RELAXED) != NULL)
+	{
+		alloc->lock.Lock();
+		LSG *batch = alloc->recycled, *tail = batch;
+		for (int i = 1; tail != NULL && tail->next != NULL && i < LEAF_ALLOC_BATCH; ++i)
+		{
+			tail = tail->next;
+		}
+		if (tail != NULL)
+		{
+			alloc->recycled = tail->next;
+			tail->next = NULL;
+		}
+		alloc->lock.Unlock();
+		if (batch != NULL)
+		{
+			cursor->recycled = batch;
+			return true;
+		}
+	}
+
+	LCK *chunk = __atomic_exchange_n(&(cursor->spare), (LCK *)NULL, __ATOMIC_ACQUIRE);
+	if (chunk == NULL && (chunk = ReserveLeafChunk(alloc)) == NULL)
+	{
+		return false;
+	}
+	cursor->pos = chunk->leaves;
+	cursor->end = chunk->leaves + LEAF_ALLOC_BATCH;
+	return true;
+}
+
+// BRIEF: reserve a spare chunk for each thread which has taken its own, so
+//        the splits do not wait for the pool. run by the maintenance thread.
+static void refill_leaf_spares(PHAST *list)
+{
+	for (int p = 0; p < list->n_pools; ++p)
+	{
+		LAL *alloc = list->leaf_allocs[p];
+		for (int i = 0; i < MAX_THREAD_NUM; ++i)
+		{
+			LeafCursor *cursor = &(alloc->cursors[i]);
+			// only the threads which have split in this pool get one.
+			if (__atomic_load_n(&(cursor->end), __ATOMIC_RELAXED) == NULL ||
+				__atomic_load_n(&(cursor->spare), __ATOMIC_ACQUIRE) != NULL)
+				continue;
+			LCK *chunk = ReserveLeafChunk(alloc);
+			if (chunk == NULL)
+				return;
+			__atomic_store_n(&(cursor->spare), chunk, __ATOMIC_RELEASE);
+		}
+	}
+}
 #endif
 
-inline LSG *AllocNewLeafNode()
+// RETURN: a zeroed leaf group in the pool pool_id, a free one if any, NULL if
+//         the pool is full. it is unreachable until the caller persists it
+//         and links it.
+inline LSG *AllocNewLeafNode(PHAST *list, int pool_id)
 {
-	TOID(LSG)
-	leaf = TOID_NULL(LSG);
-	POBJ_ZNEW(pop, &leaf, LSG);
-	if (TOID_IS_NULL(leaf))
+	LAL *alloc = list->leaf_allocs[pool_id];
+#ifdef USE_LEAF_BATCH_ALLOC
+	// the leaf groups of this thread, zeroed when they were freed or reserved.
+	LeafCursor *cursor = &(alloc->cursors[thread_slot_id()]);
+	if (cursor->recycled == NULL && cursor->pos == cursor->end && !RefillLeafCursor(alloc, cursor))
+	{
+		return NULL;
+	}
+	if (cursor->recycled != NULL)
+	{
+		LSG *leaf = cursor->recycled;
+		cursor->recycled = leaf->next;
+		leaf->next = NULL;
+		return leaf;
+	}
+	return cursor->pos++;
+#else
+	if (__atomic_load_n(&(alloc->root->free_leaves), __ATOMIC_RELAXED) != NULL)
+	{
+		alloc->lock.Lock();
+		LSG *reused = alloc->root->free_leaves;
+		if (reused != NULL)
+		{
+			alloc->root->free_leaves = reused->next;
+			persist(alloc->pop, &(alloc->root->free_leaves), sizeof(LSG *), PERSIST_ALLOC);
+		}
+		alloc->lock.Unlock();
+		if (reused != NULL)
+		{
+			reused->next = NULL; // zeroed when it was freed.
+			return reused;
+		}
+	}
+
+	LSG *leaf = (LSG *)pm_zalloc(alloc->pop, sizeof(LSG));
+	if (leaf == NULL)
 	{
 		fprintf(stderr, "failed to create a LSG in nvmm.\n");
-		exit(0);
+		return NULL;
 	}
 
-	return D_RW(leaf);
+	return leaf;
+#endif
 }
 
-ISN *create_inner_node(int level)
+ISN *create_inner_node(ISL *list, int level)
 {
-	ISN *p = new_node(level);
+	ISN *p = (ISN *)list->inodes.Alloc();
 	if (!p)
 		return NULL;
-	p->locker = new RWMutex;
-	p->locker->Init();
+	p->version = 0;
 	p->max_key = 0;
 	p->is_head = false;
 #ifdef USE_AGG_KEYS
 	p->agg_index = NULL;
 #endif
-	p->is_split = false;
 	p->nLevel = level;
+	p->merged_into = NULL;
 	for (int i = 0; i <= level; i++)
 	{
 		p->next[i] = NULL;
@@ -44,87 +336,401 @@ ISN *create_inner_node(int level)
 	return p;
 }
 
-static inline int file_exists(const char *filename)
+// REQUIRES: node is being built or locked.
+// BRIEF: called after node->keys[0, n) are changed, before n is published
+//        as node->nKeys for the readers without validation.
+static inline void update_key_summary(ISN *node, int n)
 {
-	struct stat buffer;
-	return stat(filename, &buffer);
+#ifdef USE_ISN_LAYOUT
+	for (int from = 0; from < n; from += ISN_SUMMARY_STRIDE)
+	{
+		node->key_summary[from / ISN_SUMMARY_STRIDE] = node->keys[std::min(from + ISN_SUMMARY_STRIDE, n) - 1];
+	}
+#endif
 }
 
-ISL *create_inner_list()
+static PMAP *new_partition_map(int n_heads)
 {
-	ISL *list = (ISL *)malloc(sizeof(ISL));
-	if (list == NULL)
+	// the bounds follow the map, aligned for KeyType.
+	const size_t bounds_off = (sizeof(PMAP) + alignof(KeyType) - 1) / alignof(KeyType) * alignof(KeyType);
+	PMAP *map = (PMAP *)malloc(bounds_off + n_heads * (sizeof(KeyType) + sizeof(ISN *)));
+	if (map == NULL)
 		return NULL;
+	map->nHeads = n_heads;
+	map->bounds = (KeyType *)((char *)map + bounds_off);
+	map->head = (ISN **)(map->bounds + n_heads);
+	return map;
+}
+
+int find_partition(const PMAP *map, KeyType key)
+{
+	// the first partition whose upper bound >= key, the last bound is MAX_KEY.
+	int low = 0, high = map->nHeads - 1, mid = 0;
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (map->bounds[mid] < key)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// BRIEF: equal ranges over the whole key space.
+static int uniform_bounds(KeyType *bounds, int n_heads)
+{
+	const KeyType range = MAX_KEY / n_heads;
+	for (int i = 0; i < n_heads - 1; ++i)
+	{
+		bounds[i] = (i + 1) * range;
+	}
+	bounds[n_heads - 1] = MAX_KEY;
+	return n_heads;
+}
+
+// BRIEF: bounds[i] is the key with rank (i + 1) * total / n_heads in the
+//        weighted keys, repeated keys are dropped to keep the bounds ascending.
+// REQUIRES: keys are sorted ascendingly.
+// RETURN: the number of bounds, the last one is always MAX_KEY.
+static int weighted_quantile_bounds(const KeyType *keys, const uint64_t *weights, size_t num,
+									int n_heads, KeyType *bounds)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < num; ++i)
+	{
+		total += weights ? weights[i] : 1;
+	}
+
+	int count = 0;
+	uint64_t acc = 0;
+	size_t pos = 0;
+	for (int i = 0; i < n_heads - 1 && total > 0; ++i)
+	{
+		const uint64_t rank = (uint64_t)(((unsigned __int128)total * (i + 1)) / n_heads);
+		while (pos < num && acc + (weights ? weights[pos] : 1) <= rank)
+		{
+			acc += weights ? weights[pos] : 1;
+			++pos;
+		}
+		const KeyType bound = (pos > 0) ? keys[pos - 1] : keys[0];
+		// 0 is reserved, and the bounds must be ascending.
+		if (bound == 0 || bound == MAX_KEY || (count > 0 && bound <= bounds[count - 1]))
+		{
+			continue;
+		}
+		bounds[count++] = bound;
+	}
+	bounds[count++] = MAX_KEY;
+	return count;
+}
+
+// BRIEF: open (or create) the pool files of opt for list.
+// RETURN: true if all pools are ready, otherwise none is kept open.
+static bool open_pools(PHAST *list, const PHASTOptions &opt, bool create)
+{
+	if (opt.n_pools < 1 || opt.n_pools > MAX_POOL_NUM)
+		return false;
+	list->n_pools = opt.n_pools;
+	list->pool_size = opt.pool_size;
+	list->paths.clear();
+	for (int i = 0; i < opt.n_pools; ++i)
+	{
+		if (opt.pool_paths != NULL)
+			list->paths.push_back(opt.pool_paths[i]);
+		else if (opt.n_pools == 1)
+			list->paths.push_back(opt.path);
+		else
+			list->paths.push_back(std::string(opt.path) + "." + std::to_string(i));
+
+		// a new pool formats its header, an opened one rolls back its transaction.
+		persist_as(create ? PERSIST_CREATE : PERSIST_RECOVERY);
+		list->pops[i] = open_pm_pool(opt.backend, list->paths[i].c_str(), opt.pool_size, create);
+		if (list->pops[i] == NULL)
+		{
+			for (int j = 0; j < i; ++j)
+				delete list->pops[j];
+			return false;
+		}
+	}
+	return true;
+}
+
+// RETURN: the position of bound in the root of a pool.
+static int root_index(const SHA *sha, KeyType bound)
+{
+	int low = 0, high = sha->n_heads - 1, mid = 0;
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (sha->bounds[mid] < bound)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	assert(sha->bounds[low] == bound);
+	return low;
+}
+
+static uint64_t thread_slot_bitmap[MAX_THREAD_NUM / 64];
+static int thread_slot_num = 0; // 1 + the largest slot id ever taken.
+
+// BRIEF: holds a slot id for the lifetime of a thread, released when the
+//        thread exits.
+struct ThreadSlot
+{
+	int id;
+
+	ThreadSlot()
+	{
+		for (id = 0; id < MAX_THREAD_NUM; ++id)
+		{
+			uint64_t *word = &thread_slot_bitmap[id / 64];
+			uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+			while (!(old & (1ULL << (id % 64))) &&
+				   !__atomic_compare_exchange_n(word, &old, old | (1ULL << (id % 64)), false,
+												__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			{
+				// another bit of the word changed, try again.
+			}
+			if (!(old & (1ULL << (id % 64))))
+			{
+				break;
+			}
+		}
+		if (id == MAX_THREAD_NUM)
+		{
+			fprintf(stderr, "more than %d threads use PHAST at the same time.\n", MAX_THREAD_NUM);
+			abort();
+		}
+		int num = __atomic_load_n(&thread_slot_num, __ATOMIC_RELAXED);
+		while (num <= id && !__atomic_compare_exchange_n(&thread_slot_num, &num, id + 1, false,
+														 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		{
+		}
+	}
+
+	~ThreadSlot()
+	{
+		__atomic_fetch_and(&thread_slot_bitmap[id / 64], ~(1ULL << (id % 64)), __ATOMIC_RELEASE);
+	}
+};
+
+int thread_slot_id()
+{
+	static thread_local ThreadSlot slot;
+	return slot.id;
+}
+
+#ifdef USE_VALUE_HEAP
+// RETURN: the smallest class holding size bytes, VALUE_CLASS_NUM if none.
+static inline int value_size_class(size_t size)
+{
+	int c = 0;
+	while (c < VALUE_CLASS_NUM && ((size_t)VALUE_MIN_BLOCK_SIZE << c) < size)
+	{
+		++c;
+	}
+	return c;
+}
+
+// BRIEF: put the free blocks of slab into the free list of its class.
+static void carve_value_slab(VHP *heap, VSB *slab)
+{
+	const size_t block_size = (size_t)VALUE_MIN_BLOCK_SIZE << slab->size_class;
+	const size_t n_blocks = (VALUE_SLAB_SIZE - sizeof(VSB)) / block_size;
+	std::vector<VBK *> &free_blocks = heap->free_blocks[slab->size_class];
+	for (size_t i = n_blocks; i > 0; --i)
+	{
+		VBK *block = (VBK *)(slab->blocks + (i - 1) * block_size);
+		if (block->state != VALUE_BLOCK_USED)
+		{
+			free_blocks.push_back(block);
+		}
+	}
+}
+
+// BRIEF: the value heap of a pool, rebuilt from the slabs if recover.
+//        a block is used iff its state is VALUE_BLOCK_USED.
+static VHP *new_value_heap(PMPool *pop, bool recover)
+{
+	VHP *heap = new ValueHeap;
+	heap->pop = pop;
+	heap->root = (SHA *)pop->Root(sizeof(SHA));
+	if (recover)
+	{
+		for (VSB *slab = heap->root->value_slabs; slab != NULL; slab = slab->next)
+		{
+			carve_value_slab(heap, slab);
+		}
+	}
+	else
+	{
+		heap->root->value_slabs = NULL;
+		persist(pop, &(heap->root->value_slabs), sizeof(VSB *), PERSIST_CREATE);
+	}
+	return heap;
+}
 
-	/* force-disable SDS feature during pool creation*/
-	int sds_write_value = 0;
-	pmemobj_ctl_set(NULL, "sds.at_create", &sds_write_value);
+// REQUIRES: hold heap->class_lock[size_class].
+static bool AddValueSlab(VHP *heap, int size_class)
+{
+	VSB *new_slab = (VSB *)pm_zalloc(heap->pop, VALUE_SLAB_SIZE);
+	if (new_slab == NULL)
+	{
+		fprintf(stderr, "failed to create a VSB in nvmm.\n");
+		return false;
+	}
 
-	// create pmemobj pool and create the root
+	// link the slab to the root, its blocks are all free.
+	new_slab->size_class = size_class;
+	heap->slab_lock.Lock();
+	new_slab->next = heap->root->value_slabs;
+	persist(heap->pop, new_slab, sizeof(VSB), PERSIST_ALLOC);
+	heap->root->value_slabs = new_slab;
+	persist(heap->pop, &(heap->root->value_slabs), sizeof(VSB *), PERSIST_ALLOC);
+	heap->slab_lock.Unlock();
+
+	carve_value_slab(heap, new_slab);
+	return true;
+}
 
-	if (file_exists(PMEM_PATH) != 0)
+static VBK *AllocValueBlock(VHP *heap, const void *value, size_t len)
+{
+	const size_t size = sizeof(VBK) + len;
+	const int c = value_size_class(size);
+	VBK *block = NULL;
+	if (c == VALUE_CLASS_NUM)
 	{
-		printf("create new one.\n");
-		if ((pop = pmemobj_create(PMEM_PATH, "PHAST", POOL_SIZE, 0666)) == NULL)
+		block = (VBK *)pm_alloc(heap->pop, size);
+		if (block == NULL)
 		{
-			perror("failed to create pool.\n");
+			fprintf(stderr, "failed to create a VBK in nvmm.\n");
 			return NULL;
 		}
 	}
 	else
 	{
-		printf("open existing one.\n");
-		if ((pop = pmemobj_open(PMEM_PATH, POBJ_LAYOUT_NAME(PHAST))) == NULL)
+		heap->class_lock[c].Lock();
+		if (heap->free_blocks[c].empty() && !AddValueSlab(heap, c))
 		{
-			perror("failed to open pool.\n");
+			heap->class_lock[c].Unlock();
 			return NULL;
 		}
+		block = heap->free_blocks[c].back();
+		heap->free_blocks[c].pop_back();
+		heap->class_lock[c].Unlock();
 	}
 
-	TOID(SHA)
-	root = POBJ_ROOT(pop, SHA);
-	assert(!TOID_IS_NULL(root));
+	block->len = len;
+	memcpy(block->data, value, len);
+	block->state = VALUE_BLOCK_USED;
+	persist(heap->pop, block, size, PERSIST_VALUE);
+	return block;
+}
 
-	// init multiple header.
+// BRIEF: EpochManager::FreeFunc of the value blocks, arg is the heap.
+static void FreeValueBlock(void *arg, void *ptr)
+{
+	VHP *heap = (VHP *)arg;
+	VBK *block = (VBK *)ptr;
+	const int c = value_size_class(sizeof(VBK) + block->len);
+	if (c == VALUE_CLASS_NUM)
+	{
+		pm_free(heap->pop, block);
+		return;
+	}
+
+	block->state = 0;
+	persist(heap->pop, &(block->state), sizeof(uint32_t), PERSIST_VALUE);
+	heap->class_lock[c].Lock();
+	heap->free_blocks[c].push_back(block);
+	heap->class_lock[c].Unlock();
+}
+#endif
+
+ISL *create_inner_list(PHAST *phast, const KeyType *bounds, int n_heads)
+{
+	ISL *list = new InnerSkipList;
+	if (list == NULL)
+		return NULL;
+	list->epoch = phast->epoch;
+	list->map = new_partition_map(n_heads);
+	if (list->map == NULL)
+	{
+		delete list;
+		return NULL;
+	}
+
+	// create the root of each pool.
+	SHA *roots[MAX_POOL_NUM];
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		roots[p] = (SHA *)phast->pops[p]->Root(sizeof(SHA));
+		assert(roots[p] != NULL);
+		roots[p]->pool_id = p;
+		roots[p]->n_pools = phast->n_pools;
+		roots[p]->n_heads = 0;
+	}
+
+	// init multiple header, striped over the pools.
+	PMAP *map = list->map;
 	ISN *head = NULL;
-	for (int i = 0; i < HEAD_COUNT; i++)
+	for (int i = 0; i < n_heads; i++)
 	{
-		head = create_inner_node(0);
+		head = create_inner_node(list, 0);
 		if (head == NULL)
 		{
 			fprintf(stderr, "Memory allocation failed for head!");
-			free(list);
+			free(list->map);
+			delete list;
 			return NULL;
 		}
 		head->is_head = true;
-		list->head[i] = head;
-		list->level[i] = 0;
+		head->pool_id = i % phast->n_pools;
+		for (int j = 1; j < MAX_L; j++)
+		{
+			head->next[j] = NULL;
+		}
+#ifdef USE_ADAPTIVE_PARTITION
+		head->n_inodes = 1;
+#endif
+		map->head[i] = head;
 
 		// create the first inner node for this head.
-		ISN *node = create_inner_node(0);
+		ISN *node = create_inner_node(list, 0);
 		assert(node);
+		node->pool_id = head->pool_id;
 		head->next[0] = node;
 
 		// set the max key as the upper bound of this head.
-		if (UNLIKELY(i == HEAD_COUNT - 1))
-		{
-			node->max_key = MAX_U64_KEY;
-		}
-		else
-		{
-			node->max_key = (i + 1) * HASH_KEY;
-		}
+		node->max_key = bounds[i];
+		map->bounds[i] = node->max_key;
 
 		// create the first leaf node for this inner node.
-		LSG *slot = AllocNewLeafNode();
+		LSG *slot = AllocNewLeafNode(phast, head->pool_id);
+		if (slot == NULL)
+		{
+			free(list->map);
+			delete list;
+			return NULL;
+		}
 		slot->is_head = true; // is the first slot in this inner node.
 		slot->max_key = node->max_key;
 		node->nKeys = 1;
 		node->keys[0] = node->max_key;
 		node->leaves[0] = slot;
+		update_key_summary(node, node->nKeys);
 
 		// link the root and the first leaf node.
-		D_RW(root)->slot_head_array[i] = slot;
+		SHA *sha = roots[head->pool_id];
+		sha->bounds[sha->n_heads] = node->max_key;
+		sha->slot_head_array[sha->n_heads] = slot;
+		sha->n_heads++;
 
 		// L1: head[2]    ->    head[3] -> ... -> head[X]    ->    NULL
 		// L0: head[2] -> IN -> head[3] -> ... -> head[X] -> IN -> NULL
@@ -133,19 +739,12 @@ ISL *create_inner_list()
 		{
 			for (int j = 1; j < MAX_L; j++)
 			{
-				list->head[i - 1]->next[j] = list->head[i];
+				map->head[i - 1]->next[j] = map->head[i];
 			}
-			list->head[i - 1]->next[0]->next[0] = head;
-			list->head[i - 1]->next[0]->leaves[0]->next = slot;
-		}
-		else if (i == HEAD_COUNT - 1)
-		{
-			for (int j = 1; j < MAX_L; j++)
-			{
-				list->head[i]->next[j] = NULL;
-			}
-			list->head[i]->next[0]->next[0] = NULL;
-			list->head[i]->next[0]->leaves[0]->next = NULL;
+			map->head[i - 1]->next[0]->next[0] = head;
+			map->head[i - 1]->next[0]->leaves[0]->next = slot;
+			persist(phast->pops[map->head[i - 1]->pool_id], &(map->head[i - 1]->next[0]->leaves[0]->next),
+					sizeof(LSG *), PERSIST_CREATE);
 		}
 
 #ifdef USE_AGG_KEYS
@@ -153,21 +752,92 @@ ISL *create_inner_list()
 #endif
 	}
 	// the last head's max key is +INF;
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		persist(phast->pops[p], roots[p], sizeof(SHA), PERSIST_CREATE);
+	}
 
 	return list;
 }
 
-PHAST *init_list()
+static PHAST *init_list(const PHASTOptions &opt, const KeyType *bounds, int n_heads)
 {
-	PHAST *list = (PHAST *)malloc(sizeof(PHAST));
+	PHAST *list = new PHAST;
 	if (list == NULL)
 		return NULL;
 	list->size = 0;
-	list->inner_list = create_inner_list();
+#ifdef USE_TOWER_REBALANCE
+	list->maintainer = NULL;
+#endif
+	if (!open_pools(list, opt, true))
+	{
+		delete list;
+		return NULL;
+	}
+	list->epoch = new EpochManager;
+	for (int i = 0; i < list->n_pools; ++i)
+	{
+		list->leaf_allocs[i] = new_leaf_allocator(list->pops[i], false);
+	}
+	list->inner_list = create_inner_list(list, bounds, n_heads);
 	if (list->inner_list == NULL)
+	{
+		for (int i = 0; i < list->n_pools; ++i)
+		{
+			delete list->leaf_allocs[i];
+			delete list->pops[i];
+		}
+		delete list->epoch;
+		delete list;
+		return NULL;
+	}
+#ifdef USE_VALUE_HEAP
+	for (int i = 0; i < list->n_pools; ++i)
+	{
+		list->heaps[i] = new_value_heap(list->pops[i], false);
+	}
+#endif
+	return list;
+}
+
+PHAST *init_list(const PHASTOptions &opt)
+{
+	if (opt.n_heads < 1 || opt.n_heads > MAX_HEAD_COUNT)
+		return NULL;
+	std::vector<KeyType> bounds(opt.n_heads);
+	return init_list(opt, bounds.data(), uniform_bounds(bounds.data(), opt.n_heads));
+}
+
+PHAST *init_list_by_sample(const KeyType *sample, size_t sample_num, const PHASTOptions &opt)
+{
+	if (sample_num == 0 || opt.n_heads < 1 || opt.n_heads > MAX_HEAD_COUNT)
+		return NULL;
+	std::vector<KeyType> sorted(sample, sample + sample_num);
+	std::sort(sorted.begin(), sorted.end());
+	std::vector<KeyType> bounds(opt.n_heads);
+	return init_list(opt, bounds.data(), weighted_quantile_bounds(sorted.data(), NULL, sample_num,
+																   opt.n_heads, bounds.data()));
+}
+
+PHAST *init_list_by_histogram(const KeyType *hist_keys, const uint64_t *hist_counts,
+							  size_t bucket_num, const PHASTOptions &opt)
+{
+	if (bucket_num == 0 || opt.n_heads < 1 || opt.n_heads > MAX_HEAD_COUNT)
 		return NULL;
-	srand(time(0));
+	std::vector<KeyType> bounds(opt.n_heads);
+	return init_list(opt, bounds.data(), weighted_quantile_bounds(hist_keys, hist_counts, bucket_num,
+																   opt.n_heads, bounds.data()));
+}
 
+PHAST *bulk_load(const KeyType *keys, const ValueType *values, size_t num, const PHASTOptions &opt)
+{
+	PHAST *list = init_list_by_sample(keys, num, opt);
+	if (list == NULL)
+		return NULL;
+	for (size_t i = 0; i < num; ++i)
+	{
+		Insert(list, keys[i], values[i]);
+	}
 	return list;
 }
 
@@ -205,9 +875,31 @@ static inline uint8_t hashcode_v1(uint64_t x)
 	return (uint8_t)(x & 0x0ffULL);
 }
 
-uint8_t f_hash(uint64_t key)
+// BRIEF: the bits of key folded into 64 bits.
+template <typename K>
+static inline uint64_t fold_key(K key)
+{
+	if constexpr (sizeof(K) == 16)
+		return (uint64_t)key ^ (uint64_t)(key >> 64);
+	else
+		return key;
+}
+
+// BRIEF: read a key changed by concurrent splits, atomic up to 64 bits.
+//        a torn 128-bit key is caught by the re-check of the callers.
+template <typename K>
+static inline K load_key(const K *key)
+{
+	if constexpr (sizeof(K) == 16)
+		return *(volatile const K *)key;
+	else
+		return __atomic_load_n(key, __ATOMIC_CONSUME);
+}
+
+template <typename K>
+uint8_t f_hash(K key)
 {
-	uint8_t hash_key = sl_hash(key) % 256;
+	uint8_t hash_key = sl_hash(fold_key(key)) % 256;
 	return hash_key;
 }
 
@@ -298,77 +990,515 @@ void quick_select_index(const Entry *entries, int *index, int k, int s, int e)
 		quick_select_index(entries, index, k, i + 1, e);
 }
 
-static inline int binary_search(ISN *node, uint64_t key)
+#ifdef USE_LEAF_ORDER
+// BRIEF: called after commit bits of lfnode are cleared, before their slots can
+//        be reused, so an order built before is never taken for the new keys.
+static inline void invalidate_leaf_order(LSG *lfnode)
 {
-	int low = 0, mid = 0;
-	int high = node->nKeys;
-	if (high == 0)
-		return 0;
-	while (low < high)
+	uint64_t stamp = __atomic_load_n(&(lfnode->order_stamp), __ATOMIC_ACQUIRE);
+	while (true)
 	{
-		if (key <= node->keys[low])
-			return low;
-		mid = (low + high) / 2;
-		if (node->keys[mid] > key)
+		if (stamp & LEAF_ORDER_LOCK)
 		{
-			high = mid;
+			_mm_pause(); // a scan is publishing an order.
+			stamp = __atomic_load_n(&(lfnode->order_stamp), __ATOMIC_ACQUIRE);
+			continue;
 		}
-		else if (node->keys[mid] < key)
+		const uint64_t next = ((stamp & LEAF_ORDER_GEN_MASK) + LEAF_ORDER_GEN) & LEAF_ORDER_GEN_MASK;
+		if (__atomic_compare_exchange_n(&(lfnode->order_stamp), &stamp, next, false,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 		{
-			low = mid + 1;
+			return;
 		}
+	}
+}
+
+// BRIEF: put the just committed slot into the order of lfnode if the order
+//        holds all the other committed slots, otherwise the next scan sorts.
+static inline void add_to_leaf_order(LSG *lfnode, int slot, uint64_t cbitmap)
+{
+	const uint64_t stamp = __atomic_load_n(&(lfnode->order_stamp), __ATOMIC_ACQUIRE);
+	if ((stamp & LEAF_ORDER_LOCK) || (stamp & GROUP_BITMAP_FULL) != (cbitmap & ~(1ULL << slot)) ||
+		!__sync_bool_compare_and_swap(&(lfnode->order_stamp), stamp, stamp | LEAF_ORDER_LOCK))
+	{
+		return;
+	}
+	const int n = __builtin_popcountll(stamp & GROUP_BITMAP_FULL);
+	const KeyType key = lfnode->entries[slot].key;
+	int low = 0, high = n;
+	while (low < high)
+	{
+		int mid = (low + high) / 2;
+		if (lfnode->entries[lfnode->order[mid]].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	memmove(&(lfnode->order[low + 1]), &(lfnode->order[low]), n - low);
+	lfnode->order[low] = slot;
+	__atomic_store_n(&(lfnode->order_stamp), stamp | (1ULL << slot), __ATOMIC_RELEASE);
+}
+#endif
+
+template <typename K>
+int lower_bound_scalar(const K *keys, int n, K key)
+{
+	int low = 0, high = n;
+	while (low < high)
+	{
+		int mid = (low + high) / 2;
+		if (keys[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+#ifdef USE_SIMD_SEARCH
+// BRIEF: narrow [low, high) by binary search until it holds at most
+//        SIMD_SEARCH_BLOCK keys, the answer stays in [low, high].
+template <typename K>
+static inline void narrow_range(const K *keys, K key, int &low, int &high)
+{
+	while (high - low > SIMD_SEARCH_BLOCK)
+	{
+		int mid = (low + high) / 2;
+		if (keys[mid] < key)
+			low = mid + 1;
 		else
+			high = mid;
+	}
+}
+
+template <typename K>
+__attribute__((target("avx2")))
+int lower_bound_avx2(const K *keys, int n, K key)
+{
+	static_assert(sizeof(K) <= 8, "no vector kernel over 128-bit keys");
+	int low = 0, high = n;
+	narrow_range(keys, key, low, high);
+	int i = low;
+	if constexpr (sizeof(K) == 8)
+	{
+		// no unsigned compare in AVX2, flip the sign bits and compare signed.
+		const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+		const __m256i vkey = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+		for (; i + 4 <= high; i += 4)
 		{
-			break;
+			__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), sign);
+			__m256i lt = _mm256_cmpgt_epi64(vkey, v);
+			low += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+		}
+	}
+	else
+	{
+		const __m256i sign = _mm256_set1_epi32((int)0x80000000U);
+		const __m256i vkey = _mm256_xor_si256(_mm256_set1_epi32((int)key), sign);
+		for (; i + 8 <= high; i += 8)
+		{
+			__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), sign);
+			__m256i lt = _mm256_cmpgt_epi32(vkey, v);
+			low += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
 		}
 	}
-	if (low > mid)
-		mid = low;
-	return mid;
+	for (; i < high; ++i)
+		low += (keys[i] < key);
+	return low;
 }
 
-static inline int seq_search(ISN *node, uint64_t key)
+template <typename K>
+__attribute__((target("avx512f")))
+int lower_bound_avx512(const K *keys, int n, K key)
 {
-	int pos = 0, high = node->nKeys;
-	for (pos = 0; pos < high; ++pos)
+	static_assert(sizeof(K) <= 8, "no vector kernel over 128-bit keys");
+	int low = 0, high = n;
+	narrow_range(keys, key, low, high);
+	int i = low;
+	if constexpr (sizeof(K) == 8)
+	{
+		const __m512i vkey = _mm512_set1_epi64((long long)key);
+		for (; i < high; i += 8)
+		{
+			__mmask8 valid = (high - i >= 8) ? (__mmask8)0xff : (__mmask8)((1U << (high - i)) - 1);
+			__m512i v = _mm512_maskz_loadu_epi64(valid, keys + i);
+			low += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(valid, v, vkey));
+		}
+	}
+	else
 	{
-		if (key <= node->keys[pos])
+		const __m512i vkey = _mm512_set1_epi32((int)key);
+		for (; i < high; i += 16)
 		{
-			return pos;
+			__mmask16 valid = (high - i >= 16) ? (__mmask16)0xffff : (__mmask16)((1U << (high - i)) - 1);
+			__m512i v = _mm512_maskz_loadu_epi32(valid, keys + i);
+			low += __builtin_popcount(_mm512_mask_cmplt_epu32_mask(valid, v, vkey));
 		}
 	}
-	return pos - 1;
+	return low;
 }
+#endif
 
-bool TryToGetWriteLock(ISN *inode, const bool is_split)
+template <typename K>
+KeyLowerBound<K> pick_lower_bound()
 {
-	if (__sync_bool_compare_and_swap(&(inode->is_split),
-									 false, true))
+#ifdef USE_SIMD_SEARCH
+	if constexpr (sizeof(K) <= 8) // the kernels compare 32 or 64-bit lanes.
 	{
-		inode->locker->ReadUnlock();
-		inode->locker->WriteLock();
-		return true;
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return lower_bound_avx512<K>;
+		if (__builtin_cpu_supports("avx2"))
+			return lower_bound_avx2<K>;
 	}
-	inode->locker->ReadUnlock();
-	return false;
+#endif
+	return lower_bound_scalar<K>;
+}
+
+LowerBoundFunc &key_lower_bound = key_lower_bound_of<KeyType>;
+
+template <typename K, typename V>
+uint64_t probe_scalar(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap)
+{
+	uint64_t match = 0;
+	for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+	{
+		match |= (uint64_t)(lfnode->fingerprints[i] == fp) << i;
+	}
+	return match & bitmap;
+}
+
+#ifdef USE_SIMD_PROBE
+// the commit bitmap and the fingerprints fill the first cache line of a leaf
+// group of every layout, the kernels compare the whole line and drop the
+// bitmap bytes.
+static_assert(sizeof(uint64_t) + MAX_ENTRY_NUM == CACHE_LINE_SIZE,
+			  "the fingerprints must fill the first cache line after the bitmap");
+
+template <typename K, typename V>
+__attribute__((target("avx2")))
+uint64_t probe_avx2(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap)
+{
+	typedef LeafSkipGroupT<K, V> Leaf;
+	static_assert(offsetof(Leaf, fingerprints) == sizeof(uint64_t), "the bitmap must come first");
+	const __m256i vfp = _mm256_set1_epi8((char)fp);
+	const __m256i lo = _mm256_loadu_si256((const __m256i *)lfnode);
+	const __m256i hi = _mm256_loadu_si256((const __m256i *)lfnode + 1);
+	const uint64_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vfp)) |
+						((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vfp)) << 32);
+	return (eq >> 8) & bitmap;
+}
+
+template <typename K, typename V>
+__attribute__((target("avx512bw")))
+uint64_t probe_avx512(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap)
+{
+	typedef LeafSkipGroupT<K, V> Leaf;
+	static_assert(offsetof(Leaf, fingerprints) == sizeof(uint64_t), "the bitmap must come first");
+	const __m512i line = _mm512_loadu_si512((const void *)lfnode);
+	const uint64_t eq = _mm512_cmpeq_epi8_mask(line, _mm512_set1_epi8((char)fp));
+	return (eq >> 8) & bitmap;
+}
+#endif
+
+template <typename K, typename V>
+LeafProbe<K, V> pick_probe()
+{
+#ifdef USE_SIMD_PROBE
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return probe_avx512<K, V>;
+	if (__builtin_cpu_supports("avx2"))
+		return probe_avx2<K, V>;
+#endif
+	return probe_scalar<K, V>;
+}
+
+ProbeFunc &fp_probe = fp_probe_of<KeyType, ValueType>;
+
+// the kernels of each supported key and value type.
+#ifdef USE_SIMD_SEARCH
+#define INSTANTIATE_SIMD_KEY_KERNELS(K)                     \
+	template int lower_bound_avx2<K>(const K *, int, K); \
+	template int lower_bound_avx512<K>(const K *, int, K);
+INSTANTIATE_SIMD_KEY_KERNELS(uint32_t)
+INSTANTIATE_SIMD_KEY_KERNELS(uint64_t)
+#endif
+#define INSTANTIATE_KEY_KERNELS(K)                        \
+	template uint8_t f_hash<K>(K);                        \
+	template int lower_bound_scalar<K>(const K *, int, K); \
+	template KeyLowerBound<K> pick_lower_bound<K>();
+INSTANTIATE_KEY_KERNELS(uint32_t)
+INSTANTIATE_KEY_KERNELS(uint64_t)
+INSTANTIATE_KEY_KERNELS(unsigned __int128)
+#ifdef USE_SIMD_PROBE
+#define INSTANTIATE_SIMD_PROBE_KERNELS(K, V)                                               \
+	template uint64_t probe_avx2<K, V>(const LeafSkipGroupT<K, V> *, uint8_t, uint64_t); \
+	template uint64_t probe_avx512<K, V>(const LeafSkipGroupT<K, V> *, uint8_t, uint64_t);
+#else
+#define INSTANTIATE_SIMD_PROBE_KERNELS(K, V)
+#endif
+#define INSTANTIATE_PROBE_KERNELS(K, V)                                                    \
+	template uint64_t probe_scalar<K, V>(const LeafSkipGroupT<K, V> *, uint8_t, uint64_t); \
+	template LeafProbe<K, V> pick_probe<K, V>();                                           \
+	INSTANTIATE_SIMD_PROBE_KERNELS(K, V)
+INSTANTIATE_PROBE_KERNELS(uint32_t, uint32_t)
+INSTANTIATE_PROBE_KERNELS(uint32_t, uint64_t)
+INSTANTIATE_PROBE_KERNELS(uint64_t, uint32_t)
+INSTANTIATE_PROBE_KERNELS(uint64_t, uint64_t)
+INSTANTIATE_PROBE_KERNELS(unsigned __int128, uint32_t)
+INSTANTIATE_PROBE_KERNELS(unsigned __int128, uint64_t)
+
+// RETURN: the number of node->keys[0, n) less than key.
+template <typename K, typename V>
+static inline int inode_lower_bound(const InnerSkipNodeT<K, V> *node, int n, K key)
+{
+	const KeyLowerBound<K> lower_bound = key_lower_bound_of<K>;
+#ifdef USE_ISN_LAYOUT
+	// the summary picks a block, then the keys in the block are searched.
+	const int n_blocks = (n + ISN_SUMMARY_STRIDE - 1) / ISN_SUMMARY_STRIDE;
+	const int block = lower_bound(node->key_summary, n_blocks, key);
+	if (block == n_blocks)
+		return n;
+	const int from = block * ISN_SUMMARY_STRIDE;
+	return from + lower_bound(node->keys + from, std::min(ISN_SUMMARY_STRIDE, n - from), key);
+#else
+	return lower_bound(node->keys, n, key);
+#endif
 }
 
-ISN *SearchList(ISL *inner_list, uint64_t key,
+// RETURN: the first position whose key >= key, nKeys if none.
+template <typename K, typename V>
+static inline int binary_search(const InnerSkipNodeT<K, V> *node, K key)
+{
+	return inode_lower_bound(node, node->nKeys, key);
+}
+
+// RETURN: the first position whose key >= key, the last position if none.
+template <typename K, typename V>
+static inline int seq_search(const InnerSkipNodeT<K, V> *node, K key)
+{
+	int high = node->nKeys;
+	int pos = inode_lower_bound(node, high, key);
+	return (pos < high) ? pos : pos - 1;
+}
+
+// the inner node each thread is modifying the leaf nodes of, NULL if none.
+// a thread writes its own slot only, so inserters do not share a cache line.
+static struct alignas(64)
+{
+	ISN *inode;
+} inserter_slots[MAX_THREAD_NUM];
+
+// RETURN: a version of inode that is not being split, or the version with
+//         ISN_DEAD if inode has been merged into inode->merged_into.
+static inline uint64_t StableVersion(ISN *inode)
+{
+	uint64_t version;
+	while ((version = __atomic_load_n(&(inode->version), __ATOMIC_ACQUIRE)) & 1)
+	{
+		if (version & ISN_DEAD)
+		{
+			return version;
+		}
+		_mm_pause();
+	}
+	return version;
+}
+
+// RETURN: true if inode has not been split since StableVersion returned version.
+static inline bool ValidateVersion(ISN *inode, uint64_t version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(inode->version), __ATOMIC_RELAXED) == version;
+}
+
+// BRIEF: announce that this thread modifies the leaf nodes of inode, which
+//        is not split until LeaveInnerNode. a thread holds one inner node, the
+//        one held before is left.
+// RETURN: the node held, the one inode has been merged into if it is dead.
+static inline ISN *EnterInnerNode(ISN *inode)
+{
+	ISN **slot = &inserter_slots[thread_slot_id()].inode;
+	while (true)
+	{
+		// seq_cst pairs with the version lock and the scan in TryToGetWriteLock.
+		__atomic_store_n(slot, inode, __ATOMIC_SEQ_CST);
+		if (!(__atomic_load_n(&(inode->version), __ATOMIC_SEQ_CST) & 1))
+		{
+			return inode;
+		}
+		__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+		if (StableVersion(inode) & ISN_DEAD)
+		{
+			inode = inode->merged_into;
+		}
+	}
+}
+
+static inline void LeaveInnerNode(ISN *inode)
+{
+	assert(inserter_slots[thread_slot_id()].inode == inode);
+	__atomic_store_n(&inserter_slots[thread_slot_id()].inode, NULL, __ATOMIC_RELEASE);
+}
+
+static inline bool HoldsInnerNode(ISN *inode)
+{
+	return inserter_slots[thread_slot_id()].inode == inode;
+}
+
+// BRIEF: lock inode if its version is still version, then wait for the
+//        other threads in it to leave.
+static bool TryToLockVersion(ISN *inode, uint64_t version)
+{
+	if ((version & 1) || !__atomic_compare_exchange_n(&(inode->version), &version, version + 1, false,
+													  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	{
+		return false;
+	}
+	const int self = thread_slot_id();
+	const int num = __atomic_load_n(&thread_slot_num, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < num; ++i)
+	{
+		while (i != self && __atomic_load_n(&inserter_slots[i].inode, __ATOMIC_SEQ_CST) == inode)
+		{
+			_mm_pause();
+		}
+	}
+	return true;
+}
+
+static inline bool TryToLockVersion(ISN *inode)
+{
+	return TryToLockVersion(inode, __atomic_load_n(&(inode->version), __ATOMIC_RELAXED));
+}
+
+// REQUIRES: this thread holds inode by EnterInnerNode.
+// BRIEF: leave inode and lock it for a split.
+// RETURN: false if another thread has locked inode since this thread left,
+//         what this thread read from inode may be stale then.
+bool TryToGetWriteLock(ISN *inode)
+{
+	const uint64_t version = __atomic_load_n(&(inode->version), __ATOMIC_ACQUIRE);
+	LeaveInnerNode(inode);
+	return TryToLockVersion(inode, version);
+}
+
+// BRIEF: block the split of inode, used by partition split/merge.
+static void LockInnerNode(ISN *inode)
+{
+	while (!TryToLockVersion(inode))
+	{
+		usleep(1);
+	}
+}
+
+static void UnlockInnerNode(ISN *inode)
+{
+	assert(inode->version & 1);
+	__atomic_add_fetch(&(inode->version), 1, __ATOMIC_RELEASE);
+}
+
+#ifdef USE_SEARCH_TRACE
+void (*search_trace)(const void *addr) = NULL;
+#endif
+
+// BRIEF: report the lines of pre and next the walk reads in level.
+static inline void trace_walk(ISN *pre, ISN *next, int level)
+{
+#ifdef USE_SEARCH_TRACE
+	if (search_trace != NULL)
+	{
+		search_trace(&(pre->next[level]));
+		if (next != NULL)
+			search_trace(next); // max_key and is_head.
+	}
+#else
+	(void)pre;
+	(void)next;
+	(void)level;
+#endif
+}
+
+// BRIEF: prefetch the next nodes of pre in the levels below level, the walk
+//        meets them after it leaves this level. their addresses are in the
+//        header of pre, which the walk has read.
+static inline void prefetch_next_levels(ISN *pre, int level)
+{
+#if SEARCH_PREFETCH_DISTANCE > 0
+	for (int l = level - 1; l >= 0 && l >= level - SEARCH_PREFETCH_DISTANCE; --l)
+	{
+		__builtin_prefetch(pre->next[l], 0, 3);
+	}
+#else
+	(void)pre;
+	(void)level;
+#endif
+}
+
+// BRIEF: prefetch the keys of the target, searched once it is held.
+static inline void prefetch_inner_node(ISN *target)
+{
+#if SEARCH_PREFETCH_DISTANCE > 0
+#ifdef USE_ISN_LAYOUT
+	__builtin_prefetch(target->key_summary, 0, 3);
+#else
+	__builtin_prefetch(target->keys, 0, 3);
+#endif
+#else
+	(void)target;
+#endif
+}
+
+// BRIEF: prefetch the max key and the commit bitmap with the fingerprints of
+//        a leaf node in PM, for write if the caller installs an entry.
+static inline void prefetch_leaf_node(LSG *lfnode, bool write)
+{
+#if SEARCH_PREFETCH_DISTANCE > 0
+	if (write)
+	{
+		__builtin_prefetch(&(lfnode->commit_bitmap), 1, 3);
+	}
+	else
+	{
+		__builtin_prefetch(&(lfnode->commit_bitmap), 0, 3);
+	}
+	__builtin_prefetch(&(lfnode->max_key), 0, 3);
+#else
+	(void)lfnode;
+	(void)write;
+#endif
+}
+
+// BRIEF: the next node in level 0, skip the partition heads.
+static inline ISN *next_inner_node(ISN *inode)
+{
+	ISN *next = __atomic_load_n(&(inode->next[0]), __ATOMIC_CONSUME);
+	while (next != NULL && next->is_head)
+	{
+		next = __atomic_load_n(&(next->next[0]), __ATOMIC_CONSUME);
+	}
+	return next;
+}
+
+ISN *SearchList(ISL *inner_list, KeyType key,
 				ISN *pre_nodes[], ISN *next_nodes[])
 {
 
 	// pre->max_key < key <= next->max_key if it is not head.
-	int head_idx = key / HASH_KEY;
-	ISN *pre = inner_list->head[head_idx], *next = NULL, *target = NULL;
+	PMAP *map = __atomic_load_n(&(inner_list->map), __ATOMIC_ACQUIRE);
+	int head_idx = find_partition(map, key);
+	ISN *head = map->head[head_idx];
+	ISN *pre = head, *next = NULL, *target = NULL;
 	assert(pre != NULL);
-	if (head_idx < HEAD_COUNT - 1)
+	if (head_idx < map->nHeads - 1)
 	{
-		next = inner_list->head[head_idx + 1];
+		next = map->head[head_idx + 1];
 	}
 
 	int height = pre->nLevel;
 	assert(height >= 0 && height < MAX_L);
-	uint64_t pre_maxkey, next_maxkey;
+	KeyType next_maxkey;
 	ISN *starter = NULL;
 	ISN *starter_next = NULL;
 	int span = 0;
@@ -385,11 +1515,10 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 		span = 0;
 		starter = pre;
 		next = pre->next[level];
-		pre_maxkey = pre->max_key;
+		prefetch_next_levels(pre, level);
 		next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		// next_maxkey == 0 means we reached the next head or the tail.
 
-	level_retry:
 		while (next_maxkey && next_maxkey < key)
 		{
 // pre->max_key < next->max_key < key <= ...
@@ -401,7 +1530,8 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 				// do something,now we have the read lock of next_node;
 				if (level < MAX_L - 1)
 				{ // fail a: level >=MAX_L-1 ,pass
-					if (__sync_bool_compare_and_swap(&next->nLevel, level, level + 1))
+					// the busy bit keeps a merge from unlinking next while it is being linked.
+					if (__sync_bool_compare_and_swap(&next->nLevel, level, (level + 1) | ISN_LEVEL_BUSY))
 					{ // fail b:other thread increase the level,pass
 						// update the the link;
 						starter_next = starter->next[level + 1];
@@ -413,21 +1543,23 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 							{
 								// update the head's level;if fail,other increase the head's level,pass
 								if (level + 1 > height && level + 1 < MAX_L)
-									__sync_bool_compare_and_swap(&inner_list->head[head_idx]->nLevel, height, level + 1);
+									__sync_bool_compare_and_swap(&head->nLevel, height, level + 1);
 								success_flag = true;
 								break; // success,deterministic design finished!;
 							}
 							starter_next = starter->next[level + 1];
 							next->next[level + 1] = starter_next;
 						}
-						if (success_flag == false)
-							__sync_bool_compare_and_swap(&next->nLevel, level + 1, level); // reset the level;
+						// publish the new level, or reset the level.
+						const int new_level = success_flag ? level + 1 : level;
 #ifdef USE_AGG_KEYS
-						if (next->nLevel == AGG_UPDATE_LEVEL)
+						if (success_flag && new_level == AGG_UPDATE_LEVEL)
 						{
-							update_agg_keys(inner_list->head[head_idx], head_idx);
+							// before the busy bit is cleared, so a merge of next removes it after.
+							insert_agg_key(inner_list, head, next);
 						}
 #endif
+						__atomic_store_n(&next->nLevel, new_level, __ATOMIC_RELEASE);
 					}
 				}
 				span = 0;
@@ -436,7 +1568,7 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 #endif
 			pre = next;
 			next = pre->next[level];
-			pre_maxkey = pre->max_key;
+			prefetch_next_levels(pre, level);
 			next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		}
 
@@ -465,21 +1597,21 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 		next_nodes[0] = next->next[0];
 	}
 
-	// obtain the read lock of the target node.
-	target->locker->ReadLock();
+	// hold the target node, its leaf nodes are not split from now on.
+	prefetch_inner_node(target);
+	ISN *held = EnterInnerNode(target);
 
-	// check again in case target was splitting before get the read lock.
-	if (next_maxkey != target->max_key || target->max_key < key)
+	// check again in case target was splitting or merged before we held it.
+	if (held != target || next_maxkey != held->max_key || held->max_key < key)
 	{
+		target = held;
 		while (target->max_key < key)
 		{
-			ISN *tmp = target;
-			target = target->next[0];
+			target = next_inner_node(target);
 
 			assert(target && !target->is_head);
 
-			target->locker->ReadLock();
-			tmp->locker->ReadUnlock();
+			target = EnterInnerNode(target);
 		}
 		// got the right bottom level node.
 		assert(target != NULL && !target->is_head);
@@ -490,16 +1622,16 @@ ISN *SearchList(ISL *inner_list, uint64_t key,
 	return target;
 }
 
-ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool lock)
+ISN *SearchList(ISL *inner_list, KeyType key, KeyType *target_maxkey, bool lock)
 {
 
 	// pre->max_key < key <= next->max_key if it is not head.
-	int head_idx = key / HASH_KEY;
-	ISN *pre = inner_list->head[head_idx], *next = NULL, *target = NULL;
+	PMAP *map = __atomic_load_n(&(inner_list->map), __ATOMIC_ACQUIRE);
+	ISN *pre = map->head[find_partition(map, key)], *next = NULL, *target = NULL;
 	assert(pre != NULL);
 
 #ifdef USE_AGG_KEYS
-	uint64_t next_maxkey;
+	KeyType next_maxkey;
 	int height = pre->nLevel;
 	target = find_in_agg_keys(pre, key, target_maxkey);
 	if (target)
@@ -512,6 +1644,8 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 	for (int level = height; level >= 0; --level)
 	{
 		next = pre->next[level];
+		prefetch_next_levels(pre, level);
+		trace_walk(pre, next, level);
 		next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		// next_maxkey == 0 means we reached the next head or the tail.
 
@@ -521,6 +1655,8 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 			// move to the next node in the same level.
 			pre = next;
 			next = pre->next[level];
+			prefetch_next_levels(pre, level);
+			trace_walk(pre, next, level);
 			next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		}
 		// pre->max_key < key < next->max_key.
@@ -543,7 +1679,7 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 	}
 	*target_maxkey = target->max_key;
 #else
-	uint64_t next_maxkey;
+	KeyType next_maxkey;
 	int height = pre->nLevel;
 	assert(height >= 0 && height < MAX_L);
 
@@ -551,6 +1687,8 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 	for (int level = height; level >= 0; --level)
 	{
 		next = pre->next[level];
+		prefetch_next_levels(pre, level);
+		trace_walk(pre, next, level);
 		next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		// next_maxkey == 0 means we reached the next head or the tail.
 
@@ -560,6 +1698,8 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 			// move to the next node in the same level.
 			pre = next;
 			next = pre->next[level];
+			prefetch_next_levels(pre, level);
+			trace_walk(pre, next, level);
 			next_maxkey = (next && !next->is_head) ? next->max_key : 0;
 		}
 		// pre->max_key < key < next->max_key.
@@ -582,28 +1722,29 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 	}
 	*target_maxkey = target->max_key;
 #endif
+	prefetch_inner_node(target);
 
-	// obtain the read lock of the target node.
+	// hold the target node, its leaf nodes are not split from now on.
 	if (lock)
 	{
-		target->locker->ReadLock();
+		target = EnterInnerNode(target);
+		*target_maxkey = target->max_key;
 	}
 
-	// check again in case target was splitting before get the read lock.
+	// check again in case target was splitting before we held it.
 	if (target->max_key < key)
 	{
 		while (target->max_key < key)
 		{
-			ISN *tmp = target;
-			target = target->next[0];
+			target = next_inner_node(target);
 			*target_maxkey = target->max_key;
 
 			assert(target && !target->is_head);
 
 			if (lock)
 			{
-				target->locker->ReadLock();
-				tmp->locker->ReadUnlock();
+				target = EnterInnerNode(target);
+				*target_maxkey = target->max_key;
 			}
 		}
 		// got the right bottom level node.
@@ -613,15 +1754,18 @@ ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool loc
 	return target;
 }
 
-int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
+int InsertIntoINode(PHAST *list, ISN *inode, KeyType key, ValueType value,
 					ISN *pre_nodes[], ISN *next_nodes[])
 {
-	// we have got the read lock which means thread safe to access inode's meta.
-	inode->locker->AssertReadHeld();
+	PMPool *pop = list->pops[inode->pool_id];
+
+	// we hold inode which means thread safe to access inode's meta.
+	assert(HoldsInnerNode(inode));
 
 	// search the target leaf node.
 	int loc = binary_search(inode, key);
 	LSG *lfnode = inode->leaves[loc];
+	prefetch_leaf_node(lfnode, true);
 
 	uint64_t wbitmap;
 	// probe the empty slot of working bitmap.
@@ -648,7 +1792,7 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			lfnode->fingerprints[slot] = fp;
 
 			// flush the KVpairs.
-			pmemobj_persist(pop, &lfnode->entries[slot], sizeof(Entry));
+			persist(pop, &lfnode->entries[slot], sizeof(Entry), PERSIST_INSERT);
 
 			uint64_t cbitmap = __atomic_load_n(&(lfnode->commit_bitmap),
 											   __ATOMIC_CONSUME);
@@ -667,7 +1811,7 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 					// by other thread; b. this slot is changed.
 					if (ret_cbitmap & (0x1ULL << slot))
 					{
-						inode->locker->ReadUnlock();
+						LeaveInnerNode(inode);
 						return -1; // case b.
 					}
 					else
@@ -679,10 +1823,13 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 				}
 
 				// flush the commitbitmap and the fingerprints;
-				pmemobj_persist(pop, &lfnode->commit_bitmap, 64);
+				persist(pop, &lfnode->commit_bitmap, 64, PERSIST_INSERT);
+#ifdef USE_LEAF_ORDER
+				add_to_leaf_order(lfnode, slot, new_cbitmap);
+#endif
 
 				// insert has done.
-				inode->locker->ReadUnlock();
+				LeaveInnerNode(inode);
 
 				return 0;
 			}
@@ -692,14 +1839,29 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 	assert(wbitmap == GROUP_BITMAP_FULL);
 	assert(inode->nKeys <= MAX_LEAF_CAPACITY);
 
+#ifdef USE_TRUE_DELETE
+	if (popcount1(__atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_ACQUIRE)) <= DELETE_RECLAIM_TH)
+	{
+		// reuse the deleted slots of this leaf node instead of a split, the
+		// threads that may still write them have left once inode is locked.
+		if (!TryToGetWriteLock(inode))
+		{
+			return +2; // other thread got the write lock.
+		}
+		inode->mem_bitmap[loc] = lfnode->commit_bitmap;
+		UnlockInnerNode(inode);
+		return +3;
+	}
+#endif
+
 	if (inode->nKeys == MAX_LEAF_CAPACITY)
 	{
 		// this leaf block is full.
-		if (!TryToGetWriteLock(inode, inode->is_split))
+		if (!TryToGetWriteLock(inode))
 		{
 			return +1; // other thread got the write lock.
 		}
-		inode->locker->AssertWriteHeld();
+		assert(inode->version & 1);
 
 		// got write lock, split this inner node.
 		{
@@ -709,13 +1871,14 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 1 : create new inner node, set the next pointer and the max key and the slot pointer.
 			////////////////////////////////////////////////////////////////////////////////////////////////
-			ISN *new_in = create_inner_node(0);
+			ISN *new_in = create_inner_node(list->inner_list, 0);
+			new_in->pool_id = inode->pool_id;
 
 			new_in->max_key = inode->max_key;
 			new_in->next[0] = inode->next[0];
 			new_in->nKeys = MAX_LEAF_CAPACITY - MIN_LEAF_CAPACITY;
 			memcpy(&new_in->keys, &(inode->keys[MIN_LEAF_CAPACITY]),
-				   sizeof(uint64_t) * new_in->nKeys);
+				   sizeof(KeyType) * new_in->nKeys);
 			memcpy(&new_in->leaves, &(inode->leaves[MIN_LEAF_CAPACITY]),
 				   sizeof(LSG *) * new_in->nKeys);
 			memcpy(&new_in->mem_bitmap, &(inode->mem_bitmap[MIN_LEAF_CAPACITY]),
@@ -723,19 +1886,25 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			// memset(&(inode->mem_bitmap[MIN_LEAF_CAPACITY]), 0, sizeof(uint64_t) * new_in->nKeys);
 			// set the boundary
 			new_in->leaves[0]->is_head = true;
-			pmemobj_persist(pop, &new_in->leaves[0]->is_head, sizeof(bool));
+			persist(pop, &new_in->leaves[0]->is_head, sizeof(bool), PERSIST_INODE_SPLIT);
+			update_key_summary(new_in, new_in->nKeys);
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 2 : reset the old inner node's nKey and maxKey and next[0].
 			////////////////////////////////////////////////////////////////////////////////////////////////
+			update_key_summary(inode, MIN_LEAF_CAPACITY);
 			inode->nKeys = MIN_LEAF_CAPACITY;
 			inode->max_key = inode->keys[inode->nKeys - 1];
-			inode->next[0] = new_in;
+			// new_in is complete before the threads reach it.
+			__atomic_store_n(&(inode->next[0]), new_in, __ATOMIC_RELEASE);
 		}
+#ifdef USE_ADAPTIVE_PARTITION
+		// pre_nodes[MAX_L] is the head, the counters are hints for rebalance.
+		__atomic_add_fetch(&(pre_nodes[MAX_L]->n_inodes), 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(pre_nodes[MAX_L]->n_splits), 1, __ATOMIC_RELAXED);
+#endif
 		// leaf block split is done, release write lock.
-		inode->is_split = false;
-		inode->locker->WriteUnlock();
-		// __atomic_store_n(&(inode->is_split), false, __ATOMIC_RELEASE);
+		UnlockInnerNode(inode);
 		// #ifdef USE_AGG_KEYS
 		// 		update_agg_keys(pre_nodes[MAX_L]);
 		// #endif
@@ -746,27 +1915,41 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 	else
 	{
 		// this leaf node is full.
-		if (!TryToGetWriteLock(inode, inode->is_split))
+		if (!TryToGetWriteLock(inode))
 		{
 			return +2; // other thread got the write lock.
 		}
-		inode->locker->AssertWriteHeld();
+		assert(inode->version & 1);
+
+#ifdef USE_TRUE_DELETE
+		if (popcount1(lfnode->commit_bitmap) <= DELETE_RECLAIM_TH)
+		{
+			// deleted before the lock, reuse the slots as above.
+			inode->mem_bitmap[loc] = lfnode->commit_bitmap;
+			UnlockInnerNode(inode);
+			return +3;
+		}
+#endif
 
 		// got write lock, split this leaf node.
 		{
+#ifndef USE_TRUE_DELETE
 			assert(lfnode->commit_bitmap == GROUP_BITMAP_FULL);
-			int group_idx[MAX_ENTRY_NUM], mid_idx = (MAX_ENTRY_NUM / 2);
-			for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+#endif
+			// the committed slots, the deleted ones are left behind.
+			int group_idx[MAX_ENTRY_NUM], n_entries = 0;
+			for (uint64_t rest = lfnode->commit_bitmap; rest; rest &= rest - 1)
 			{
-				group_idx[i] = i;
+				group_idx[n_entries++] = __builtin_ctzll(rest);
 			}
+			int mid_idx = n_entries / 2;
 
 			// partition sort the index of entries.
 			quick_select_index(lfnode->entries, group_idx, mid_idx,
-							   0, MAX_ENTRY_NUM - 1);
+							   0, n_entries - 1);
 
 			// find the largest key in the left part.
-			uint64_t left_largest = lfnode->entries[group_idx[0]].key;
+			KeyType left_largest = lfnode->entries[group_idx[0]].key;
 			for (int i = 1; i < mid_idx; ++i)
 			{
 				if (lfnode->entries[group_idx[i]].key > left_largest)
@@ -774,16 +1957,32 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 					left_largest = lfnode->entries[group_idx[i]].key;
 				}
 			}
+			// keep the entries equal to left_largest in the left part, the
+			// search stops at the first leaf node whose max key >= key.
+			for (int i = mid_idx; i < n_entries && mid_idx < n_entries - 1; ++i)
+			{
+				if (lfnode->entries[group_idx[i]].key == left_largest)
+				{
+					std::swap(group_idx[i], group_idx[mid_idx]);
+					++mid_idx;
+				}
+			}
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 1 : create a new leaf node, and set the flag , the next , the bitmap and fingerprints.
 			////////////////////////////////////////////////////////////////////////////////////////////////
-			LSG *new_slot = AllocNewLeafNode();
+			LSG *new_slot = AllocNewLeafNode(list, inode->pool_id);
+			if (new_slot == NULL)
+			{
+				// the pool is full, nothing has been changed.
+				UnlockInnerNode(inode);
+				return -1;
+			}
 			new_slot->next = lfnode->next;
 			// insert the last half entries to the new leaf node.
 			int new_child_loc_slot = 0;
 			uint64_t new_slot_bitmap = 0;
-			for (int i = mid_idx; i < MAX_ENTRY_NUM; ++i, ++new_child_loc_slot)
+			for (int i = mid_idx; i < n_entries; ++i, ++new_child_loc_slot)
 			{
 				new_slot->entries[new_child_loc_slot].key =
 					lfnode->entries[group_idx[i]].key;
@@ -798,13 +1997,14 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			// new_slot->working_bitmap = new_slot_bitmap;
 			new_slot->max_key = lfnode->max_key;
 			// flush the new leaf node.
-			pmemobj_persist(pop, &new_slot, 128 + 16 * new_child_loc_slot); // 2 cache line size + key-value size
+			// 2 cache line size + key-value size
+			persist(pop, new_slot, offsetof(LSG, entries) + sizeof(Entry) * new_child_loc_slot, PERSIST_LEAF_SPLIT);
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 2 : change the slot's next pointer to new slot.
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			lfnode->next = new_slot;
-			pmemobj_persist(pop, &lfnode->next, sizeof(LSG *));
+			persist(pop, &lfnode->next, sizeof(LSG *), PERSIST_LEAF_SPLIT);
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 3 : reset the slot's bitmap.
@@ -817,13 +2017,17 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			lfnode->commit_bitmap = new_slot_bitmap;
 			// lfnode->working_bitmap = new_slot_bitmap;
 			// flush the old slot's commit bitmap.
-			pmemobj_persist(pop, &lfnode->commit_bitmap, 8);
+			persist(pop, &lfnode->commit_bitmap, 8, PERSIST_LEAF_SPLIT);
+#ifdef USE_LEAF_ORDER
+			// the moved slots are reused once inode is unlocked.
+			invalidate_leaf_order(lfnode);
+#endif
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 4 : change the old slot's max_key.
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			lfnode->max_key = left_largest;
-			pmemobj_persist(pop, &lfnode->max_key, 8);
+			persist(pop, &lfnode->max_key, sizeof(KeyType), PERSIST_LEAF_SPLIT);
 
 			////////////////////////////////////////////////////////////////////////////////////////////////
 			// step 5 : move inner node's max key and slot pointer to keep order.
@@ -846,12 +2050,11 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 			inode->mem_bitmap[loc + 1] = new_slot->commit_bitmap;
 			inode->keys[loc] = left_largest;
 			inode->mem_bitmap[loc] = lfnode->commit_bitmap;
+			update_key_summary(inode, inode->nKeys + 1);
 			__atomic_add_fetch(&(inode->nKeys), 1, __ATOMIC_RELEASE);
 		}
 		// leaf node split is done, release write lock.
-		inode->is_split = false;
-		inode->locker->WriteUnlock();
-		// __atomic_store_n(&(inode->is_split), false, __ATOMIC_RELEASE);
+		UnlockInnerNode(inode);
 
 #ifdef PERF_PROFILING_W
 		hist_set->Add(DO_SPLIT_LAEF, ElapsedNanos(t1));
@@ -861,25 +2064,39 @@ int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
 	}
 }
 
-uint64_t SearchINode(ISN *inode, uint64_t key)
+ValueType SearchINode(ISN *inode, KeyType key)
 {
 
 	const uint8_t fp = f_hash(key);
 
+retry:
+	// readers never write inode, a split in between changes the version.
+	const uint64_t version = StableVersion(inode);
+	if (UNLIKELY(version & ISN_DEAD))
+	{
+		inode = inode->merged_into;
+		goto retry;
+	}
+
 	// May the leaf node we get is not the target leaf node, but the target leaf node must behind this leaf node.
 	int child_loc = seq_search(inode, key);
+#ifdef USE_SEARCH_TRACE
+	if (search_trace != NULL)
+		search_trace(&(inode->leaves[child_loc]));
+#endif
 	LSG *lfnode = inode->leaves[child_loc];
 	if (lfnode == NULL)
 	{
 		printf("something wrong 1!\n");
 		return 0;
 	}
-	uint64_t mLKey;
-	uint64_t result = 0;
+	prefetch_leaf_node(lfnode, false);
+	KeyType mLKey;
+	ValueType result = 0;
 	while (true)
 	{
 		// mLKey = lfnode->max_key;
-		mLKey = __atomic_load_n(&lfnode->max_key, __ATOMIC_CONSUME);
+		mLKey = load_key(&lfnode->max_key);
 		while (mLKey < key)
 		{
 			// lfnode = lfnode->next;
@@ -890,22 +2107,28 @@ uint64_t SearchINode(ISN *inode, uint64_t key)
 				return 0;
 			}
 			// mLKey = lfnode->max_key;
-			mLKey = __atomic_load_n(&lfnode->max_key, __ATOMIC_CONSUME);
+			mLKey = load_key(&lfnode->max_key);
 		}
 		// At this moment, this maxkey and this lfnode is right.
 
-		// probe bitmap one by one.
+		// probe the fingerprints of the committed slots at once.
 		const uint64_t bitmap = lfnode->commit_bitmap;
-		for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+		result = 0;
+		for (uint64_t match = fp_probe(lfnode, fp, bitmap); match; match &= match - 1)
 		{
-			if ((bitmap & (0x1ULL << i)) && (lfnode->fingerprints[i] == fp) && (lfnode->entries[i].key == key))
+			const int i = __builtin_ctzll(match);
+			if (lfnode->entries[i].key == key)
 			{
 				result = lfnode->entries[i].value;
 				break;
 			}
 		}
 
-		if (inode->is_split || mLKey != lfnode->max_key)
+		if (!ValidateVersion(inode, version))
+		{
+			goto retry;
+		}
+		if (mLKey != lfnode->max_key)
 		{
 			continue;
 		}
@@ -914,8 +2137,10 @@ uint64_t SearchINode(ISN *inode, uint64_t key)
 	return result;
 }
 
-bool Insert(PHAST *list, uint64_t key, uint64_t value)
+bool Insert(PHAST *list, KeyType key, ValueType value)
 {
+	// the nodes and indexes read below are not freed until the guard ends.
+	EpochGuard guard(list->epoch);
 	int ret = 0;
 	// [MAX_L] is assigned for the head.
 	ISN *pre_nodes[MAX_L + 1], *next_nodes[MAX_L + 1], *target = NULL;
@@ -927,9 +2152,9 @@ whole_retry:
 	// we have assigned a inner node for each head.
 	assert(target != NULL && !target->is_head && (target == pre_nodes[0]));
 
-	target->locker->AssertReadHeld();
+	assert(HoldsInnerNode(target));
 
-	ret = InsertIntoINode(target, key, value, pre_nodes, next_nodes);
+	ret = InsertIntoINode(list, target, key, value, pre_nodes, next_nodes);
 	if (ret == 0)
 	{
 		return true;
@@ -940,6 +2165,22 @@ whole_retry:
 	}
 	else
 	{
+#ifdef USE_ADAPTIVE_PARTITION
+		if (ret == 99 && UNLIKELY(pre_nodes[MAX_L]->n_inodes > PARTITION_SPLIT_TH))
+		{
+			// split the oversized partition if no one else is resizing.
+			ISL *inner_list = list->inner_list;
+			if (inner_list->resize_lock.TryLock())
+			{
+				int idx = find_partition(inner_list->map, key);
+				if (inner_list->map->head[idx]->n_inodes > PARTITION_SPLIT_TH)
+				{
+					split_partition(list, idx);
+				}
+				inner_list->resize_lock.Unlock();
+			}
+		}
+#endif
 		if (ret == 1)
 		{
 			usleep(5); // sleep 5us if is splitting leaf block.
@@ -952,10 +2193,11 @@ whole_retry:
 	}
 }
 
-uint64_t Search(PHAST *list, uint64_t key)
+ValueType Search(PHAST *list, KeyType key)
 {
+	EpochGuard guard(list->epoch);
 	ISN *target = NULL;
-	uint64_t ret = 0, target_maxkey;
+	KeyType target_maxkey;
 
 	// search the target inner node first.
 	target = SearchList(list->inner_list, key, &target_maxkey);
@@ -963,450 +2205,2219 @@ uint64_t Search(PHAST *list, uint64_t key)
 	// we have assigned a inner node for each head, so the target
 	// cannot be a head.
 	assert(target != NULL && !target->is_head);
-	// target->locker->AssertReadHeld();
 
+#ifdef USE_TRUE_DELETE
+	// a deleter takes the value before it clears the commit bit.
+	const ValueType value = SearchINode(target, key);
+	return (value == MAX_VALUE) ? 0 : value;
+#else
 	return SearchINode(target, key);
+#endif
 }
 
-int randomLevel()
+int tower_level(uint64_t rank)
 {
 	int level = 0;
-	float f = 0.5 * 0xFFFF;
-	while ((rand() & 0xFFFF) < f)
+	for (; rank % (SPAN_TH + 1) == 0 && level < MAX_L - 1; rank /= SPAN_TH + 1)
 		level++;
-	return (level < MAX_L) ? level : MAX_L - 1;
+	return level;
+}
+
+// BRIEF: EpochManager::FreeFunc of the replaced partition maps.
+static void FreePartitionMap(void *, void *ptr)
+{
+	free(ptr);
+}
+
+// BRIEF: EpochManager::FreeFunc of the merged inner nodes and the removed
+//        heads, arg is the inner list.
+static void FreeInnerNode(void *arg, void *ptr)
+{
+	ISN *node = (ISN *)ptr;
+#ifdef USE_AGG_KEYS
+	if (node->is_head)
+	{
+		delete node->agg_index;
+	}
+#endif
+	((ISL *)arg)->inodes.Free(node);
+}
+
+#ifdef USE_ADAPTIVE_PARTITION
+// BRIEF: EpochManager::FreeFunc of the heads removed by merge_partitions,
+//        arg is the inner list. no insert holds the head any more, its
+//        counters are final and go to the head it was merged into. that
+//        head is retired later, so it is freed later too.
+static void FreeMergedHead(void *arg, void *ptr)
+{
+	ISN *victim = (ISN *)ptr;
+	ISN *head = victim->merged_into;
+	__atomic_add_fetch(&(head->n_inodes), victim->n_inodes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(head->n_splits), victim->n_splits, __ATOMIC_RELAXED);
+	FreeInnerNode(arg, ptr);
 }
+#endif
 
 #ifdef USE_AGG_KEYS
-void update_agg_keys(ISN *head, const int head_idx)
+// BRIEF: EpochManager::FreeFunc of the replaced AGG indexes.
+static void FreeAGGIndex(void *, void *ptr)
+{
+	delete (AGGIndex *)ptr;
+}
+
+// RETURN: the index of head, locked and still published.
+static AGGIndex *lock_agg_index(ISN *head)
+{
+	while (true)
+	{
+		AGGIndex *idx = __atomic_load_n(&(head->agg_index), __ATOMIC_ACQUIRE);
+		idx->lock.Lock();
+		if (__atomic_load_n(&(head->agg_index), __ATOMIC_ACQUIRE) == idx)
+		{
+			return idx;
+		}
+		idx->lock.Unlock(); // it has been replaced by a rebuild.
+	}
+}
+
+// BRIEF: rebuild the index of head from its level AGG_UPDATE_LEVEL, used
+//        when the index is full and when the partitions change.
+void update_agg_keys(ISL *inner_list, ISN *head)
 {
 	assert(head->is_head);
 	assert(head->agg_index != NULL);
 
-	AGGIndex *new_idx = new AGGIndex(head, head->agg_index->NewSize());
+	AGGIndex *old_idx = lock_agg_index(head);
+	AGGIndex *new_idx = new AGGIndex(head, old_idx->NewSize());
 	__atomic_store_n(&(head->agg_index), new_idx, __ATOMIC_RELEASE);
+	old_idx->lock.Unlock();
+	// the readers may still search the old one.
+	inner_list->epoch->Retire(old_idx, FreeAGGIndex, NULL);
+}
+
+// REQUIRES: node has been linked in level AGG_UPDATE_LEVEL of head.
+// BRIEF: put node into the index of head, rebuild it if it is full.
+void insert_agg_key(ISL *inner_list, ISN *head, ISN *node)
+{
+	AGGIndex *idx = lock_agg_index(head);
+	const bool inserted = idx->Insert(node);
+	idx->lock.Unlock();
+	if (!inserted)
+	{
+		update_agg_keys(inner_list, head); // the new one holds node.
+	}
+}
+
+// REQUIRES: node has been unlinked from level AGG_UPDATE_LEVEL of head.
+void remove_agg_key(ISN *head, ISN *node)
+{
+	AGGIndex *idx = lock_agg_index(head);
+	idx->Remove(node);
+	idx->lock.Unlock();
+}
+
+ISN *find_in_agg_keys(ISN *head, const KeyType key, KeyType *target_maxkey)
+{
+	assert(head->is_head);
+	// update_agg_keys replaces it concurrently, the old one is retired.
+	AGGIndex *old_idx = __atomic_load_n(&(head->agg_index), __ATOMIC_ACQUIRE);
+	assert(old_idx != NULL);
+
+#ifdef USE_AGG_MODEL
+	return old_idx->ModelFind(key, target_maxkey);
+#else
+	return old_idx->Find(key, target_maxkey);
+#endif
+}
+#endif
+
+#ifdef USE_INODE_MERGE
+// REQUIRES: hold list's resize_lock, pre is head or an inner node of head.
+// BRIEF: move the leaf nodes of node = pre->next[0] to the front of the next
+//        node, and unlink node from every level. no max key is changed, so a
+//        reader passing a node by its max key is still right.
+// RETURN: true if merged.
+static bool merge_inner_node(PHAST *list, ISN *head, ISN *pre)
+{
+	ISN *node = pre->next[0];
+	if (node == NULL || node->is_head)
+		return false;
+	ISN *right = node->next[0];
+	if (right == NULL || right->is_head || node->nKeys + right->nKeys > ISN_MERGE_TH)
+		return false;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 1 : lock pre, node and right from left to right, the inserters in them have left.
+	//          the next[0] of a head is changed under resize_lock only.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	if (!pre->is_head && !TryToLockVersion(pre))
+		return false;
+	if (pre->next[0] != node || !TryToLockVersion(node))
+	{
+		if (!pre->is_head)
+			UnlockInnerNode(pre);
+		return false;
+	}
+	bool locked = node->next[0] == right && TryToLockVersion(right);
+	if (!locked || node->nKeys + right->nKeys > ISN_MERGE_TH)
+	{
+		if (locked)
+			UnlockInnerNode(right);
+		UnlockInnerNode(node);
+		if (!pre->is_head)
+			UnlockInnerNode(pre);
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 2 : stop the promotion of node, then unlink it from the levels above 0 and the index.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	int level;
+	while (true)
+	{
+		level = __atomic_load_n(&(node->nLevel), __ATOMIC_ACQUIRE);
+		if (!(level & ISN_LEVEL_BUSY) &&
+			__sync_bool_compare_and_swap(&(node->nLevel), level, level | ISN_LEVEL_BUSY))
+		{
+			break;
+		}
+		_mm_pause(); // a promotion is linking node.
+	}
+	ISN *cur = head;
+	for (int l = MAX_L - 1; l >= 1; --l)
+	{
+		while (true)
+		{
+			ISN *next = __atomic_load_n(&(cur->next[l]), __ATOMIC_ACQUIRE);
+			if (next == node)
+			{
+				if (__sync_bool_compare_and_swap(&(cur->next[l]), node, node->next[l]))
+				{
+					break;
+				}
+				continue; // a node has been linked before node.
+			}
+			if (next == NULL || next->is_head || next->max_key >= node->max_key)
+			{
+				break; // node is not in this level.
+			}
+			cur = next;
+		}
+	}
+#ifdef USE_AGG_KEYS
+	if (level >= AGG_UPDATE_LEVEL)
+	{
+		remove_agg_key(head, node);
+	}
+#endif
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 3 : put the leaf nodes of node in front of right's. the first leaf node of right is
+	//          not the first of an inner node any more, the recovery rebuilds the merged node.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	const int n = node->nKeys, m = right->nKeys;
+	memmove(&(right->keys[n]), right->keys, sizeof(KeyType) * m);
+	memmove(&(right->leaves[n]), right->leaves, sizeof(LSG *) * m);
+	memmove(&(right->mem_bitmap[n]), right->mem_bitmap, sizeof(uint64_t) * m);
+	memcpy(right->keys, node->keys, sizeof(KeyType) * n);
+	memcpy(right->leaves, node->leaves, sizeof(LSG *) * n);
+	memcpy(right->mem_bitmap, node->mem_bitmap, sizeof(uint64_t) * n);
+	right->leaves[n]->is_head = false;
+	persist(list->pops[right->pool_id], &(right->leaves[n]->is_head), sizeof(bool), PERSIST_MERGE);
+	update_key_summary(right, n + m);
+	__atomic_store_n(&(right->nKeys), n + m, __ATOMIC_RELEASE);
+	__atomic_store_n(&(pre->next[0]), right, __ATOMIC_RELEASE);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 4 : node is dead, its version stays locked and the threads reaching it go to right.
+	//          it is freed after the threads that may hold it have left.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	node->merged_into = right;
+	__atomic_or_fetch(&(node->version), ISN_DEAD, __ATOMIC_RELEASE);
+	UnlockInnerNode(right);
+	if (!pre->is_head)
+		UnlockInnerNode(pre);
+	list->epoch->Retire(node, FreeInnerNode, list->inner_list);
+#ifdef USE_ADAPTIVE_PARTITION
+	__atomic_sub_fetch(&(head->n_inodes), 1, __ATOMIC_RELAXED);
+#endif
+	return true;
+}
+
+// REQUIRES: hold list's resize_lock.
+static int merge_sparse_inner_nodes(PHAST *list)
+{
+	PMAP *map = list->inner_list->map;
+	int merged = 0;
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+		ISN *head = map->head[i];
+		ISN *pre = head;
+		while (pre->next[0] != NULL && !pre->next[0]->is_head)
+		{
+			if (merge_inner_node(list, head, pre))
+			{
+				++merged;
+				continue; // try to merge the merged one with its next.
+			}
+			pre = pre->next[0];
+		}
+	}
+	return merged;
+}
+
+int merge_inner_nodes(PHAST *list)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	inner_list->resize_lock.Lock();
+	int merged = merge_sparse_inner_nodes(list);
+	inner_list->resize_lock.Unlock();
+	return merged;
+}
+#endif
+
+#ifdef USE_LEAF_MERGE
+// REQUIRES: hold inode's write lock, loc + 1 < inode->nKeys and the two leaf
+//           nodes hold at most MAX_ENTRY_NUM entries in total.
+// BRIEF: move the entries of the leaf node next to loc into the free slots of
+//        leaf node loc, then unlink it. after a crash the recovery ignores the
+//        moved entries, or drops the next leaf node, see recover_partition.
+static void merge_leaf_node(PHAST *list, ISN *inode, int loc)
+{
+	PMPool *pop = list->pops[inode->pool_id];
+	LSG *left = inode->leaves[loc], *right = inode->leaves[loc + 1];
+	assert(left->next == right);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 1 : copy the entries of right to the free slots of left, not committed yet.
+	//          the slots claimed but not committed are free, their inserters have left.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t free_slots = ~left->commit_bitmap & GROUP_BITMAP_FULL;
+	uint64_t moved = 0;
+	for (uint64_t rest = right->commit_bitmap; rest; rest &= rest - 1)
+	{
+		const int from = __builtin_ctzll(rest), to = __builtin_ctzll(free_slots);
+		free_slots &= free_slots - 1;
+		left->entries[to] = right->entries[from];
+		left->fingerprints[to] = right->fingerprints[from];
+		persist(pop, &left->entries[to], sizeof(Entry), PERSIST_MERGE);
+		moved |= (1ULL << to);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 2 : commit them in left, they are above the max key of left until step 3. no commit
+	//          bit is cleared, the order of left is rebuilt by the next scan.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	__atomic_store_n(&(left->commit_bitmap), left->commit_bitmap | moved, __ATOMIC_RELEASE);
+	persist(pop, &left->commit_bitmap, 64, PERSIST_MERGE);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 3 : left covers the range of right, a scan reaching right skips the keys got from left.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	left->max_key = right->max_key;
+	persist(pop, &left->max_key, sizeof(KeyType), PERSIST_MERGE);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 4 : unlink right, it is reused after the threads that may hold it have left.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	__atomic_store_n(&(left->next), right->next, __ATOMIC_RELEASE);
+	persist(pop, &left->next, sizeof(LSG *), PERSIST_MERGE);
+	list->epoch->Retire(right, FreeLeafNode, list->leaf_allocs[inode->pool_id]);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 5 : remove right from inode.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	const int n = inode->nKeys;
+	inode->keys[loc] = inode->keys[loc + 1];
+	inode->mem_bitmap[loc] = left->commit_bitmap;
+	memmove(&(inode->keys[loc + 1]), &(inode->keys[loc + 2]), sizeof(KeyType) * (n - loc - 2));
+	memmove(&(inode->leaves[loc + 1]), &(inode->leaves[loc + 2]), sizeof(LSG *) * (n - loc - 2));
+	memmove(&(inode->mem_bitmap[loc + 1]), &(inode->mem_bitmap[loc + 2]), sizeof(uint64_t) * (n - loc - 2));
+	update_key_summary(inode, n - 1);
+	__atomic_store_n(&(inode->nKeys), n - 1, __ATOMIC_RELEASE);
+}
+
+// REQUIRES: hold list's resize_lock.
+// RETURN: the number of merges in inode.
+static int merge_sparse_leaf_nodes(PHAST *list, ISN *inode)
+{
+	// a hint read without the lock, the deletes do not clear the working bitmaps.
+	bool sparse = false;
+	const int n = __atomic_load_n(&(inode->nKeys), __ATOMIC_ACQUIRE);
+	int pre_count = MAX_ENTRY_NUM;
+	for (int loc = 0; loc < n && !sparse; ++loc)
+	{
+		LSG *lfnode = __atomic_load_n(&(inode->leaves[loc]), __ATOMIC_ACQUIRE);
+		const int count = popcount1(__atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_RELAXED));
+		sparse = pre_count + count <= LEAF_MERGE_TH;
+		pre_count = count;
+	}
+	if (!sparse || !TryToLockVersion(inode))
+	{
+		return 0; // a split is going on, try it next time.
+	}
+
+	int merged = 0;
+	for (int loc = 0; loc + 1 < inode->nKeys;)
+	{
+		if (popcount1(inode->leaves[loc]->commit_bitmap) +
+				popcount1(inode->leaves[loc + 1]->commit_bitmap) <= LEAF_MERGE_TH)
+		{
+			merge_leaf_node(list, inode, loc);
+			++merged;
+			continue; // try to merge the merged one with its next.
+		}
+		++loc;
+	}
+	UnlockInnerNode(inode);
+	return merged;
+}
+
+int merge_leaf_nodes(PHAST *list)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	inner_list->resize_lock.Lock();
+	PMAP *map = inner_list->map;
+	int merged = 0;
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+		for (ISN *inode = map->head[i]->next[0]; inode != NULL && !inode->is_head; inode = inode->next[0])
+		{
+			merged += merge_sparse_leaf_nodes(list, inode);
+		}
+	}
+	inner_list->resize_lock.Unlock();
+	return merged;
+}
+#endif
+
+#ifdef USE_TOWER_REBALANCE
+// BRIEF: count the nodes of each level of the partition of head, head excluded.
+static void tower_histogram(ISN *head, size_t *level_nodes)
+{
+	for (int level = 0; level < MAX_L; ++level)
+	{
+		level_nodes[level] = 0;
+		for (ISN *node = head->next[level]; node != NULL && !node->is_head; node = node->next[level])
+		{
+			++level_nodes[level];
+		}
+	}
+}
+
+// RETURN: true if a level holds TOWER_SKEW_TH times more or fewer nodes than
+//         level 0 does over (SPAN_TH + 1) ^ level, the ratio SearchList aims at.
+static bool towers_skewed(const size_t *level_nodes)
+{
+	size_t ideal = level_nodes[0];
+	for (int level = 1; level < MAX_L; ++level)
+	{
+		ideal /= SPAN_TH + 1;
+		if (level_nodes[level] > ideal * TOWER_SKEW_TH + 1 || level_nodes[level] * TOWER_SKEW_TH + 1 < ideal)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// REQUIRES: the level of node is frozen, pre is before node in level.
+// BRIEF: link node in level, or unlink it. a node lost from a level by a racing
+//        promotion is linked again.
+static void set_tower_level(ISN *pre, ISN *node, int level, bool linked)
+{
+	while (true)
+	{
+		ISN *next = __atomic_load_n(&(pre->next[level]), __ATOMIC_ACQUIRE);
+		if (next != NULL && next != node && !next->is_head && next->max_key < node->max_key)
+		{
+			pre = next;
+			continue;
+		}
+		if (linked == (next == node))
+		{
+			return;
+		}
+		if (linked)
+		{
+			node->next[level] = next;
+		}
+		if (__sync_bool_compare_and_swap(&(pre->next[level]), next, linked ? node : node->next[level]))
+		{
+			return;
+		}
+	}
+}
+
+// REQUIRES: hold list's resize_lock.
+// BRIEF: give the i-th inner node of head tower_level(i), the shape SearchList
+//        aims at. the readers are never
+//        blocked, a node is linked or unlinked by one CAS per level while
+//        ISN_LEVEL_BUSY freezes its level, the nodes being promoted are left.
+static void rebuild_towers(ISL *inner_list, ISN *head)
+{
+	ISN *pre_nodes[MAX_L]; // the last node rebuilt in each level.
+	for (int level = 0; level < MAX_L; ++level)
+	{
+		pre_nodes[level] = head;
+	}
+	bool agg_changed = false;
+	uint64_t i = 0;
+	for (ISN *node = head->next[0]; node != NULL && !node->is_head; node = node->next[0])
+	{
+		const int target = tower_level(++i);
+		const int cur = __atomic_load_n(&(node->nLevel), __ATOMIC_ACQUIRE);
+		if ((cur & ISN_LEVEL_BUSY) ||
+			!__sync_bool_compare_and_swap(&(node->nLevel), cur, cur | ISN_LEVEL_BUSY))
+		{
+			continue; // a promotion is linking node.
+		}
+		const int top = cur > target ? cur : target;
+		for (int level = 1; level <= top; ++level)
+		{
+			set_tower_level(pre_nodes[level], node, level, level <= target);
+		}
+		for (int level = 1; level <= target; ++level)
+		{
+			pre_nodes[level] = node;
+		}
+#ifdef USE_AGG_KEYS
+		agg_changed |= (cur >= AGG_UPDATE_LEVEL) != (target >= AGG_UPDATE_LEVEL);
+#endif
+		__atomic_store_n(&(node->nLevel), target, __ATOMIC_RELEASE);
+	}
+#ifdef USE_AGG_KEYS
+	if (agg_changed)
+	{
+		update_agg_keys(inner_list, head); // once for all the changed nodes.
+	}
+#endif
+
+	// the searches start from the new top, a lost CAS only costs a level.
+	int top = MAX_L - 1;
+	while (top > 0 && (head->next[top] == NULL || head->next[top]->is_head))
+	{
+		--top;
+	}
+	const int height = __atomic_load_n(&(head->nLevel), __ATOMIC_ACQUIRE);
+	__sync_bool_compare_and_swap(&(head->nLevel), height, top);
+}
+
+int rebalance_towers(PHAST *list)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	inner_list->resize_lock.Lock();
+	PMAP *map = inner_list->map;
+	int rebuilt = 0;
+	size_t level_nodes[MAX_L];
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+		tower_histogram(map->head[i], level_nodes);
+		if (towers_skewed(level_nodes))
+		{
+			rebuild_towers(inner_list, map->head[i]);
+			++rebuilt;
+		}
+	}
+	inner_list->resize_lock.Unlock();
+	return rebuilt;
+}
+
+static void maintain(PHAST *list)
+{
+#ifdef USE_ADAPTIVE_PARTITION
+	uint64_t last_rebalance = NowMicros();
+#endif
+	while (!list->stop_maintainer)
+	{
+#ifdef USE_ADAPTIVE_PARTITION
+		// the split counters of the heads cover one window.
+		if (NowMicros() - last_rebalance >= PARTITION_REBALANCE_MS * 1000ULL)
+		{
+			rebalance_partitions(list);
+			last_rebalance = NowMicros();
+		}
+#endif
+		rebalance_towers(list);
+#ifdef USE_LEAF_MERGE
+		merge_leaf_nodes(list);
+#endif
+#ifdef USE_INODE_MERGE
+		// the leaf merges above leave sparse inner nodes behind.
+		merge_inner_nodes(list);
+#endif
+#ifdef USE_LEAF_BATCH_ALLOC
+		refill_leaf_spares(list);
+#endif
+		// the objects retired above may be the last ones for a while.
+		list->epoch->TryReclaim();
+		for (int ms = 0; ms < MAINTAIN_INTERVAL_MS && !list->stop_maintainer; ++ms)
+		{
+			usleep(1000);
+		}
+	}
+}
+
+void start_maintenance(PHAST *list)
+{
+	if (list->maintainer != NULL)
+		return;
+	list->stop_maintainer = false;
+	list->maintainer = new std::thread(maintain, list);
+}
+
+void stop_maintenance(PHAST *list)
+{
+	if (list->maintainer == NULL)
+		return;
+	list->stop_maintainer = true;
+	list->maintainer->join();
+	delete list->maintainer;
+	list->maintainer = NULL;
+}
+#endif
+
+#ifdef USE_ADAPTIVE_PARTITION
+bool split_partition(PHAST *list, int idx)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	PMAP *map = inner_list->map;
+	if (map->nHeads >= MAX_HEAD_COUNT)
+		return false;
+	ISN *head = map->head[idx];
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 1 : pick the middle inner node as the last one of the left part.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	uint32_t n_inodes = 0;
+	for (ISN *node = head->next[0]; node != NULL && !node->is_head; node = node->next[0])
+	{
+		++n_inodes;
+	}
+	if (n_inodes < 2)
+		return false;
+	ISN *left_tail = head->next[0];
+	for (uint32_t i = 1; i < n_inodes / 2; ++i)
+	{
+		left_tail = left_tail->next[0];
+	}
+
+	// block the split of left_tail, so its max key and next[0] are stable.
+	LockInnerNode(left_tail);
+	ISN *right_first = left_tail->next[0];
+	if (right_first == NULL || right_first->is_head)
+	{
+		UnlockInnerNode(left_tail);
+		return false;
+	}
+	const KeyType split_key = left_tail->max_key;
+
+	// log the ranges of the root changed in step 4 before anything else is,
+	// a transaction too large for the pool leaves the partition as it is.
+	const int n_heads = map->nHeads;
+	PMPool *pop = list->pops[head->pool_id];
+	SHA *sha = (SHA *)pop->Root(sizeof(SHA));
+	const int n_local = sha->n_heads;
+	const int pos = root_index(sha, map->bounds[idx]);
+	pop->TxBegin();
+	if (!tx_add(pop, &(sha->n_heads), sizeof(uint64_t), PERSIST_PARTITION) ||
+		!tx_add(pop, &(sha->bounds[pos]), sizeof(KeyType) * (n_local + 1 - pos), PERSIST_PARTITION) ||
+		!tx_add(pop, &(sha->slot_head_array[pos + 1]), sizeof(LSG *) * (n_local - pos), PERSIST_PARTITION))
+	{
+		tx_abort(pop, PERSIST_PARTITION);
+		UnlockInnerNode(left_tail);
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 2 : create the new head and link it in every level above 0 after the last node whose
+	//          max key <= split_key. readers meet it as the end of the old partition.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	ISN *new_head = create_inner_node(list->inner_list, 0);
+	new_head->is_head = true;
+	new_head->pool_id = head->pool_id;
+	new_head->nLevel = head->nLevel;
+	new_head->next[0] = right_first;
+	for (int level = 1; level < MAX_L; ++level)
+	{
+		ISN *pre = head;
+		while (true)
+		{
+			ISN *next = pre->next[level];
+			if (next != NULL && !next->is_head && next->max_key <= split_key)
+			{
+				pre = next;
+				continue;
+			}
+			new_head->next[level] = next;
+			if (__sync_bool_compare_and_swap(&(pre->next[level]), next, new_head))
+			{
+				break;
+			}
+		}
+	}
+	// the inserts still count on head, move the share of the right part.
+	new_head->n_inodes = n_inodes - n_inodes / 2;
+	new_head->n_splits = head->n_splits / 2;
+	__atomic_sub_fetch(&(head->n_inodes), new_head->n_inodes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&(head->n_splits), new_head->n_splits, __ATOMIC_RELAXED);
+#ifdef USE_AGG_KEYS
+	new_head->agg_index = new AGGIndex(new_head, head->agg_index->Cap());
+#endif
+
+	// step 3 : link the new head in level 0.
+	__atomic_store_n(&(left_tail->next[0]), new_head, __ATOMIC_RELEASE);
+	UnlockInnerNode(left_tail);
+#ifdef USE_AGG_KEYS
+	update_agg_keys(list->inner_list, head);
+#endif
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 4 : persist the new layout in the root atomically.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// only the root of the pool holding this partition is changed, its ranges are logged in step 1.
+	memmove(&(sha->bounds[pos + 1]), &(sha->bounds[pos]), sizeof(KeyType) * (n_local - pos));
+	memmove(&(sha->slot_head_array[pos + 2]), &(sha->slot_head_array[pos + 1]),
+			sizeof(LSG *) * (n_local - pos - 1));
+	sha->bounds[pos] = split_key;
+	sha->slot_head_array[pos + 1] = right_first->leaves[0];
+	sha->n_heads = n_local + 1;
+	tx_end(pop, PERSIST_PARTITION);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 5 : publish the new map.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	PMAP *new_map = new_partition_map(n_heads + 1);
+	memcpy(new_map->bounds, map->bounds, sizeof(KeyType) * idx);
+	memcpy(new_map->head, map->head, sizeof(ISN *) * (idx + 1));
+	new_map->bounds[idx] = split_key;
+	new_map->bounds[idx + 1] = map->bounds[idx];
+	new_map->head[idx + 1] = new_head;
+	memcpy(&(new_map->bounds[idx + 2]), &(map->bounds[idx + 1]), sizeof(KeyType) * (n_heads - idx - 1));
+	memcpy(&(new_map->head[idx + 2]), &(map->head[idx + 1]), sizeof(ISN *) * (n_heads - idx - 1));
+	__atomic_store_n(&(inner_list->map), new_map, __ATOMIC_RELEASE);
+	inner_list->epoch->Retire(map, FreePartitionMap, NULL);
+
+	return true;
+}
+
+bool merge_partitions(PHAST *list, int idx)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	PMAP *map = inner_list->map;
+	if (idx < 0 || idx + 1 >= map->nHeads)
+		return false;
+	ISN *head = map->head[idx];
+	ISN *victim = map->head[idx + 1];
+	if (head->pool_id != victim->pool_id)
+		return false; // the leaves cannot move between pools.
+
+	// log the ranges of the root changed in step 3 before anything else is,
+	// a transaction too large for the pool leaves the partitions as they are.
+	// both partitions are in the same pool, so they are neighbours in its root.
+	const int n_heads = map->nHeads;
+	PMPool *pop = list->pops[head->pool_id];
+	SHA *sha = (SHA *)pop->Root(sizeof(SHA));
+	const int n_local = sha->n_heads;
+	const int pos = root_index(sha, map->bounds[idx]);
+	assert(pos + 1 < n_local && sha->bounds[pos + 1] == map->bounds[idx + 1]);
+	pop->TxBegin();
+	if (!tx_add(pop, &(sha->n_heads), sizeof(uint64_t), PERSIST_PARTITION) ||
+		!tx_add(pop, &(sha->bounds[pos]), sizeof(KeyType) * (n_local - pos), PERSIST_PARTITION) ||
+		!tx_add(pop, &(sha->slot_head_array[pos + 1]), sizeof(LSG *) * (n_local - pos - 1), PERSIST_PARTITION))
+	{
+		tx_abort(pop, PERSIST_PARTITION);
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 1 : find the last inner node of the left partition and block its split.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	ISN *left_tail = head->next[0];
+	while (true)
+	{
+		while (left_tail->next[0] != victim)
+		{
+			left_tail = left_tail->next[0];
+		}
+		LockInnerNode(left_tail);
+		if (left_tail->next[0] == victim)
+		{
+			break;
+		}
+		// split before we got the lock, go on.
+		UnlockInnerNode(left_tail);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 2 : unlink the victim head from the levels above 0, then level 0.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	for (int level = 1; level < MAX_L; ++level)
+	{
+		ISN *pre = head;
+		while (true)
+		{
+			ISN *next = pre->next[level];
+			if (next == victim)
+			{
+				if (__sync_bool_compare_and_swap(&(pre->next[level]), victim, victim->next[level]))
+				{
+					break;
+				}
+				continue;
+			}
+			if (next == NULL || next->is_head)
+			{
+				break; // victim is not in this level.
+			}
+			pre = next;
+		}
+	}
+	__atomic_store_n(&(left_tail->next[0]), victim->next[0], __ATOMIC_RELEASE);
+	UnlockInnerNode(left_tail);
+
+	if (victim->nLevel > head->nLevel)
+	{
+		// the searches read it without the resize lock.
+		__atomic_store_n(&(head->nLevel), victim->nLevel, __ATOMIC_RELEASE);
+	}
+	// the inserts holding the victim still count on it, its counters move
+	// to head after they have left.
+	victim->merged_into = head;
+#ifdef USE_AGG_KEYS
+	update_agg_keys(inner_list, head);
+#endif
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 3 : persist the new layout in the root atomically.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// its ranges are logged before step 1.
+	memmove(&(sha->bounds[pos]), &(sha->bounds[pos + 1]), sizeof(KeyType) * (n_local - pos - 1));
+	memmove(&(sha->slot_head_array[pos + 1]), &(sha->slot_head_array[pos + 2]),
+			sizeof(LSG *) * (n_local - pos - 2));
+	sha->n_heads = n_local - 1;
+	tx_end(pop, PERSIST_PARTITION);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	// step 4 : publish the new map. readers may still hold the victim, it is freed after they leave.
+	////////////////////////////////////////////////////////////////////////////////////////////////
+	PMAP *new_map = new_partition_map(n_heads - 1);
+	memcpy(new_map->bounds, map->bounds, sizeof(KeyType) * idx);
+	memcpy(new_map->head, map->head, sizeof(ISN *) * (idx + 1));
+	memcpy(&(new_map->bounds[idx]), &(map->bounds[idx + 1]), sizeof(KeyType) * (n_heads - idx - 1));
+	memcpy(&(new_map->head[idx + 1]), &(map->head[idx + 2]), sizeof(ISN *) * (n_heads - idx - 2));
+	__atomic_store_n(&(inner_list->map), new_map, __ATOMIC_RELEASE);
+	inner_list->epoch->Retire(map, FreePartitionMap, NULL);
+	inner_list->epoch->Retire(victim, FreeMergedHead, inner_list);
+
+	return true;
+}
+
+int rebalance_partitions(PHAST *list)
+{
+	EpochGuard guard(list->epoch);
+	ISL *inner_list = list->inner_list;
+	inner_list->resize_lock.Lock();
+
+	// split the hot or oversized partitions.
+	for (int i = 0; i < inner_list->map->nHeads; ++i)
+	{
+		ISN *head = inner_list->map->head[i];
+		if (head->n_inodes > PARTITION_SPLIT_TH || head->n_splits > PARTITION_HOT_TH)
+		{
+			if (split_partition(list, i))
+			{
+				++i; // the right part is checked in the next round.
+			}
+		}
+	}
+
+	// merge the cold neighbours which are small against the mean partition,
+	// so the partitions of an even layout stay as they are.
+	uint32_t total_inodes = 0; // a counter may be below 0 for a while, the total is not.
+	for (int i = 0; i < inner_list->map->nHeads; ++i)
+	{
+		total_inodes += inner_list->map->head[i]->n_inodes;
+	}
+	const uint64_t merge_th = (uint64_t)total_inodes / inner_list->map->nHeads / PARTITION_MERGE_RATIO;
+	uint32_t left_inodes = 0; // the counters of a merged head reach the left one later.
+	for (int i = 0; i + 1 < inner_list->map->nHeads;)
+	{
+		ISN *left = inner_list->map->head[i], *right = inner_list->map->head[i + 1];
+		left_inodes = std::max(left_inodes, left->n_inodes);
+		if (left->n_splits == 0 && right->n_splits == 0 &&
+			(uint64_t)left_inodes + right->n_inodes < merge_th &&
+			merge_partitions(list, i))
+		{
+			left_inodes += right->n_inodes;
+			continue; // try to merge the next one into i.
+		}
+		left_inodes = 0;
+		++i;
+	}
+
+#ifdef USE_INODE_MERGE
+	merge_sparse_inner_nodes(list);
+#endif
+
+	PMAP *map = inner_list->map;
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+		map->head[i]->n_splits = 0;
+	}
+	inner_list->resize_lock.Unlock();
+	return map->nHeads;
+}
+#endif
+
+// REQUIRES: the objects retired to list->epoch have been freed.
+// BRIEF: free the DRAM index of list, the pools are untouched.
+void free_inner_list(PHAST *list)
+{
+	ISL *inner_list = list->inner_list;
+
+#ifdef USE_AGG_KEYS
+	// only the heads own memory outside the arena.
+	for (int i = 0; i < inner_list->map->nHeads; ++i)
+	{
+		delete inner_list->map->head[i]->agg_index;
+	}
+#endif
+	free(inner_list->map);
+	// release all inner nodes at once.
+	delete inner_list;
+	list->inner_list = NULL;
+}
+
+void dram_free(PHAST *list)
+{
+	if (!list)
+		return;
+#ifdef USE_TOWER_REBALANCE
+	stop_maintenance(list);
+#endif
+	// the retired nodes go back to the arena, the retired values and leaves into the pools.
+	delete list->epoch;
+	free_inner_list(list);
+	for (int i = 0; i < list->n_pools; ++i)
+	{
+#ifdef USE_VALUE_HEAP
+		delete list->heaps[i];
+#endif
+		delete list->leaf_allocs[i];
+		delete list->pops[i];
+	}
+	delete list;
+}
+
+// BRIEF: rebuild the inner nodes of partition i from its leaf groups, packed
+//        RECOVERY_FILL per inner node, with the towers of a balanced list.
+static void recover_partition(PHAST *phast, PMAP *map, int i, LSG *head_slot)
+{
+	ISN *head = map->head[i];
+	PMPool *pop = phast->pops[head->pool_id];
+
+	////////////////////////////////////////////////////////////////////////////
+	// step 1: collect the leaf groups of this partition, recalculate the fp and
+	//         finish the interrupted slot splits, merges and deletes.
+	////////////////////////////////////////////////////////////////////////////
+	std::vector<LSG *> slots;
+	LSG *pre_slot = NULL;
+	KeyType key_boundary = map->bounds[i];
+	for (LSG *cur_slot = head_slot, *next_slot; cur_slot && cur_slot->max_key <= key_boundary; cur_slot = next_slot)
+	{ // loop:slot
+		next_slot = cur_slot->next;
+#ifdef USE_LEAF_ORDER
+		cur_slot->order_stamp = 0;
+#endif
+		uint64_t bitmap = cur_slot->commit_bitmap;
+		uint64_t stale = 0;
+		for (int j = 0; j < MAX_ENTRY_NUM; j++)
+			if ((bitmap & (0x1ULL << j)))
+			{
+				uint8_t fp = f_hash(cur_slot->entries[j].key);
+				if (cur_slot->fingerprints[j] != fp)
+					cur_slot->fingerprints[j] = fp;
+				// copied from the next slot by a merge which has not raised the max key.
+				if (cur_slot->entries[j].key > cur_slot->max_key)
+					stale |= (0x1ULL << j);
+#ifdef USE_TRUE_DELETE
+				// taken by a delete which has not cleared the commit bit.
+				if (cur_slot->entries[j].value == MAX_VALUE)
+					stale |= (0x1ULL << j);
+#endif
+			}
+		if (stale)
+		{
+			cur_slot->commit_bitmap = bitmap & ~stale;
+			persist(pop, &cur_slot->commit_bitmap, 8, PERSIST_RECOVERY);
+		}
+
+		// two identical max_keys: a slot split before or after the old slot's
+		// bitmap is reset, or a slot merge before the next slot is unlinked.
+		if (pre_slot != NULL && cur_slot->max_key == pre_slot->max_key)
+		{
+			bool covered = true; // the keys of cur_slot are all in pre_slot.
+			const uint64_t pre_bitmap = pre_slot->commit_bitmap;
+			for (uint64_t rest = cur_slot->commit_bitmap; rest && covered; rest &= rest - 1)
+			{
+				const KeyType key = cur_slot->entries[__builtin_ctzll(rest)].key;
+				covered = false;
+				for (uint64_t pre_rest = pre_bitmap; pre_rest && !covered; pre_rest &= pre_rest - 1)
+					covered = (pre_slot->entries[__builtin_ctzll(pre_rest)].key == key);
+			}
+			if (covered)
+			{
+				// drop cur_slot, pre_slot holds all.
+				pre_slot->next = next_slot;
+				persist(pop, &pre_slot->next, sizeof(LSG *), PERSIST_RECOVERY);
+#ifndef USE_LEAF_BATCH_ALLOC
+				// with USE_LEAF_BATCH_ALLOC recover_free_leaves finds it in its chunk.
+				FreeLeafNode(phast->leaf_allocs[head->pool_id], cur_slot);
+#endif
+				continue;
+			}
+
+			// the split has moved the entries, reset pre_slot's max key.
+			KeyType maxkey = 0;
+			for (uint64_t pre_rest = pre_bitmap; pre_rest; pre_rest &= pre_rest - 1)
+				if (pre_slot->entries[__builtin_ctzll(pre_rest)].key > maxkey)
+					maxkey = pre_slot->entries[__builtin_ctzll(pre_rest)].key;
+
+			assert(maxkey != 0);
+			pre_slot->max_key = maxkey;
+			persist(pop, &pre_slot->max_key, sizeof(KeyType), PERSIST_RECOVERY);
+		}
+		slots.push_back(cur_slot);
+		pre_slot = cur_slot;
+	}
+
+	////////////////////////////////////////////////////////////////////////////
+	// step 2: persist the first leaf group of each new inner node. the new
+	//         firsts are set before the old ones are cleared, so after a crash
+	//         in between no inner node is rebuilt with too many leaf nodes.
+	////////////////////////////////////////////////////////////////////////////
+	const size_t n_slots = slots.size();
+	const size_t n_inodes = (n_slots + RECOVERY_FILL - 1) / RECOVERY_FILL;
+	std::vector<bool> firsts(n_slots, false);
+	for (size_t k = 0; k < n_inodes; ++k)
+	{
+		firsts[k * n_slots / n_inodes] = true;
+	}
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		const bool value = (pass == 0);
+		for (size_t j = 0; j < n_slots; ++j)
+		{
+			if (firsts[j] == value && slots[j]->is_head != value)
+			{
+				slots[j]->is_head = value;
+				persist(pop, &(slots[j]->is_head), sizeof(bool), PERSIST_RECOVERY);
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////
+	// step 3: build the inner nodes, every (SPAN_TH + 1) ^ k-th one reaches
+	//         level k, and link them.
+	////////////////////////////////////////////////////////////////////////////
+	ISN *pre_inode[MAX_L];
+	for (int j = 0; j < MAX_L; j++)
+		pre_inode[j] = head;
+
+	ISN *cur_inode = NULL;
+	uint64_t count_pnode = 0;
+	for (size_t j = 0; j < n_slots; ++j)
+	{
+		if (firsts[j])
+		{
+			int level = tower_level(++count_pnode);
+			if (level > head->nLevel)
+				head->nLevel = level;
+			ISN *innode = create_inner_node(phast->inner_list, level);
+			innode->pool_id = head->pool_id;
+			for (int l = 0; l <= level; l++)
+			{
+				pre_inode[l]->next[l] = innode;
+				pre_inode[l] = innode;
+			}
+			cur_inode = innode;
+		}
+		LSG *slot = slots[j];
+		cur_inode->keys[cur_inode->nKeys] = slot->max_key;
+		cur_inode->mem_bitmap[cur_inode->nKeys] = slot->commit_bitmap;
+		cur_inode->leaves[cur_inode->nKeys] = slot;
+		cur_inode->max_key = slot->max_key;
+		cur_inode->nKeys++;
+		if (j + 1 == n_slots || firsts[j + 1])
+			update_key_summary(cur_inode, cur_inode->nKeys);
+	}
+
+	// link the last nodes to the next head.
+	ISN *next_head = (i + 1 < map->nHeads) ? map->head[i + 1] : NULL;
+	for (int j = 0; j < MAX_L; j++)
+		pre_inode[j]->next[j] = next_head;
+
+#ifdef USE_ADAPTIVE_PARTITION
+	head->n_inodes = count_pnode;
+	head->n_splits = 0;
+#endif
+// build the aggindex once, from the final level AGG_UPDATE_LEVEL.
+#ifdef USE_AGG_KEYS
+	head->agg_index = new AGGIndex(head, count_pnode + AGG_REDUNDANT_SPACE);
+#endif
+}
+
+#ifdef USE_LEAF_BATCH_ALLOC
+// BRIEF: zero the leaf groups of the chunks that no inner node holds and
+//        recycle them: the ones reserved by a thread but never taken, and the
+//        ones freed or dropped before the crash.
+static void recover_free_leaves(PHAST *phast)
+{
+	std::vector<std::vector<LCK *>> chunks(phast->n_pools);
+	std::vector<std::vector<uint64_t>> linked(phast->n_pools); // a bit per leaf group of each chunk.
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		for (LCK *chunk = phast->leaf_allocs[p]->root->leaf_chunks; chunk != NULL; chunk = chunk->next)
+		{
+			chunks[p].push_back(chunk);
+		}
+		std::sort(chunks[p].begin(), chunks[p].end());
+		linked[p].assign(chunks[p].size(), 0);
+	}
+
+	PMAP *map = phast->inner_list->map;
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+		const int p = map->head[i]->pool_id;
+		for (ISN *inode = map->head[i]->next[0]; inode != NULL && !inode->is_head; inode = inode->next[0])
+		{
+			for (int j = 0; j < inode->nKeys; ++j)
+			{
+				const uintptr_t leaf = (uintptr_t)inode->leaves[j];
+				auto it = std::upper_bound(chunks[p].begin(), chunks[p].end(), leaf,
+										   [](uintptr_t x, LCK *chunk) { return x < (uintptr_t)chunk; });
+				if (it == chunks[p].begin())
+					continue;
+				const uintptr_t offset = leaf - (uintptr_t)(*(it - 1))->leaves;
+				if (offset < sizeof(LSG) * LEAF_ALLOC_BATCH)
+					linked[p][it - 1 - chunks[p].begin()] |= 1ULL << (offset / sizeof(LSG));
+			}
+		}
+	}
+
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		LAL *alloc = phast->leaf_allocs[p];
+		LSG *free_leaves = NULL;
+		for (size_t c = 0; c < chunks[p].size(); ++c)
+		{
+			for (int k = 0; k < LEAF_ALLOC_BATCH; ++k)
+			{
+				if (linked[p][c] & (1ULL << k))
+					continue;
+				// the split taking it persists what it has written.
+				LSG *leaf = &(chunks[p][c]->leaves[k]);
+				memset((void *)leaf, 0, sizeof(LSG));
+				leaf->next = free_leaves;
+				free_leaves = leaf;
+			}
+		}
+		alloc->recycled = free_leaves;
+	}
+}
+#endif
+
+PHAST *recovery(int n_threads, const PHASTOptions &opt)
+{
+	///////////////////////////
+	// create new PHAST.
+	///////////////////////////
+	PHAST *phast = new PHAST;
+	phast->size = 0;
+#ifdef USE_TOWER_REBALANCE
+	phast->maintainer = NULL;
+#endif
+	if (!open_pools(phast, opt, false))
+	{
+		delete phast;
+		return NULL;
+	}
+	phast->epoch = new EpochManager;
+	phast->inner_list = new InnerSkipList;
+	InnerSkipList *list = phast->inner_list;
+	list->epoch = phast->epoch;
+
+	// the partition layout persisted in the root of each pool.
+	struct PartitionRecord
+	{
+		KeyType bound;
+		LSG *head_slot;
+		int pool_id;
+	};
+	std::vector<PartitionRecord> parts;
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		const SHA *sha = (const SHA *)phast->pops[p]->Root(sizeof(SHA));
+		if (sha->pool_id != (uint64_t)p || sha->n_pools != (uint64_t)phast->n_pools)
+		{
+			fprintf(stderr, "pool %s is not the #%d of %d pools!\n", phast->paths[p].c_str(), p, phast->n_pools);
+			for (int j = 0; j < phast->n_pools; ++j)
+				delete phast->pops[j];
+			delete list;
+			delete phast->epoch;
+			delete phast;
+			return NULL;
+		}
+		for (uint64_t j = 0; j < sha->n_heads; ++j)
+		{
+			parts.push_back({sha->bounds[j], sha->slot_head_array[j], p});
+		}
+	}
+	std::sort(parts.begin(), parts.end(),
+			  [](const PartitionRecord &a, const PartitionRecord &b)
+			  { return a.bound < b.bound; });
+	const int n_heads = parts.size();
+	list->map = new_partition_map(n_heads);
+	PMAP *map = list->map;
+
+	///////////////////////////
+	// init multiple header.
+	///////////////////////////
+	ISN *head = NULL;
+	std::vector<std::vector<int>> pool_parts(phast->n_pools);
+	for (int i = 0; i < n_heads; i++)
+	{
+		head = create_inner_node(list, 0);
+		if (head == NULL)
+		{
+			fprintf(stderr, "Memory allocation failed for head!");
+			// the heads created so far are in the arena of list.
+			for (int j = 0; j < phast->n_pools; ++j)
+				delete phast->pops[j];
+			free(list->map);
+			delete list;
+			delete phast->epoch;
+			delete phast;
+			return NULL;
+		}
+		head->is_head = true;
+		head->pool_id = parts[i].pool_id;
+		for (int j = 0; j < MAX_L; j++)
+			head->next[j] = NULL;
+		map->head[i] = head;
+		map->bounds[i] = parts[i].bound;
+		pool_parts[head->pool_id].push_back(i);
+		// head1 [0] -> head2 [0] -> ...headx[0]-> NULL ;
+		if (i > 0)
+			for (int j = 0; j < MAX_L; j++)
+				map->head[i - 1]->next[j] = map->head[i];
+	}
+
+	///////////////////////////
+	// Multithreading, the pools are recovered in parallel.
+	//////////////////////////
+	std::vector<std::future<void>> futures;
+	const int thread_per_pool = (n_threads > phast->n_pools) ? (n_threads / phast->n_pools) : 1;
+
+	// the recovery of a partition may free a leaf group.
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		phast->leaf_allocs[p] = new_leaf_allocator(phast->pops[p], true);
+	}
+
+#ifdef USE_VALUE_HEAP
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		auto f = std::async(
+			std::launch::async,
+			[phast](int p)
+			{ phast->heaps[p] = new_value_heap(phast->pops[p], true); },
+			p);
+		futures.push_back(move(f));
+	}
+#endif
+
+	for (int p = 0; p < phast->n_pools; ++p)
+	{
+		const std::vector<int> &indexes = pool_parts[p];
+		uint64_t head_per_thread = indexes.size() / thread_per_pool;
+		for (int tid = 0; tid < thread_per_pool; tid++)
+		{
+			int from = head_per_thread * tid;
+			int to = (tid == thread_per_pool - 1) ? indexes.size() : from + head_per_thread;
+
+			auto f = std::async(
+				std::launch::async,
+				[phast, map, &indexes, &parts](int from, int to)
+				{
+					for (int k = from; k < to; ++k)
+					{ // loop:head
+						recover_partition(phast, map, indexes[k], parts[indexes[k]].head_slot);
+					}
+				},
+				from, to);
+			futures.push_back(move(f));
+		}
+	}
+
+	for (auto &&f : futures)
+		if (f.valid())
+			f.get();
+#ifdef USE_LEAF_BATCH_ALLOC
+	recover_free_leaves(phast);
+#endif
+
+	return phast;
+}
+
+ValueType UpdateINode(PHAST *list, ISN *inode, KeyType key, ValueType new_value)
+{
+	assert(HoldsInnerNode(inode));
+
+	ValueType old_value = 0;
+	int threshold = 0;
+
+	const uint8_t fp = f_hash(key);
+	// search the target leaf node.
+	const int child_loc = binary_search(inode, key);
+	LSG *lfnode = inode->leaves[child_loc];
+	if (UNLIKELY(lfnode == NULL))
+	{
+		return 0;
+	}
+
+	// probe the fingerprints of the committed slots at once.
+	const uint64_t bitmap = __atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_CONSUME);
+	for (uint64_t match = fp_probe(lfnode, fp, bitmap); match; match &= match - 1)
+	{
+		const int i = __builtin_ctzll(match);
+		if (lfnode->entries[i].key == key)
+		{
+			// update the old value, the old one is owned by this thread.
+#ifdef USE_TRUE_DELETE
+			old_value = __atomic_load_n(&(lfnode->entries[i].value), __ATOMIC_ACQUIRE);
+			while (old_value != MAX_VALUE &&
+				   !__atomic_compare_exchange_n(&(lfnode->entries[i].value), &old_value, new_value, false,
+												__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				;
+			if (old_value == MAX_VALUE)
+			{
+				old_value = 0;
+				continue; // a deleter has taken the value, this entry is gone.
+			}
+#else
+			old_value = __atomic_exchange_n(&(lfnode->entries[i].value), new_value, __ATOMIC_ACQ_REL);
+#endif
+			persist(list->pops[inode->pool_id], &(lfnode->entries[i].value), sizeof(ValueType), PERSIST_UPDATE);
+			return old_value;
+		}
+	}
+
+	return old_value;
+}
+
+#ifdef USE_TRUE_DELETE
+// REQUIRES: hold inode by EnterInnerNode.
+// BRIEF: take the value of key, then clear its commit bit. the slot is reused
+//        by the inserts once the leaf node is full, under inode's write lock,
+//        so a thread still holding the slot never sees another key in it.
+//        the recovery drops a committed entry whose value is MAX_VALUE.
+// RETURN: the old value, 0 if not found.
+static ValueType DeleteINode(PHAST *list, ISN *inode, KeyType key)
+{
+	assert(HoldsInnerNode(inode));
+
+	const uint8_t fp = f_hash(key);
+	const int child_loc = binary_search(inode, key);
+	LSG *lfnode = inode->leaves[child_loc];
+	if (UNLIKELY(lfnode == NULL))
+	{
+		return 0;
+	}
+
+	ValueType old_value = 0;
+	int slot = -1;
+	const uint64_t bitmap = __atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_CONSUME);
+	for (uint64_t match = fp_probe(lfnode, fp, bitmap); match; match &= match - 1)
+	{
+		const int i = __builtin_ctzll(match);
+		if (lfnode->entries[i].key == key)
+		{
+			// the updaters and the other deleters of key fail from now on.
+			old_value = __atomic_exchange_n(&(lfnode->entries[i].value), MAX_VALUE, __ATOMIC_ACQ_REL);
+			if (old_value != MAX_VALUE)
+			{
+				slot = i;
+				break;
+			}
+		}
+	}
+	if (slot < 0)
+	{
+		return 0;
+	}
+
+	__atomic_and_fetch(&(lfnode->commit_bitmap), ~(1ULL << slot), __ATOMIC_ACQ_REL);
+	persist(list->pops[inode->pool_id], &lfnode->commit_bitmap, 8, PERSIST_DELETE);
+#ifdef USE_LEAF_ORDER
+	invalidate_leaf_order(lfnode);
+#endif
+	return old_value;
+}
+#endif
+
+ValueType Update(PHAST *list, KeyType key, ValueType newValue)
+{
+	EpochGuard guard(list->epoch);
+	ISN *target = NULL;
+	ValueType ret = 0;
+	KeyType target_maxkey;
+
+	// search the target inner node first.
+	target = SearchList(list->inner_list, key, &target_maxkey, true);
+
+	// we have assigned a inner node for each head, so the target
+	// cannot be a head.
+	assert(target != NULL && !target->is_head);
+	assert(HoldsInnerNode(target));
+
+	ret = UpdateINode(list, target, key, newValue);
+	LeaveInnerNode(target);
+
+	return ret;
+}
+
+#ifdef USE_LEAF_ORDER
+// RETURN: the number of the live entries of slot not less than start_key, put into
+//         candidate sorted by key.
+int GetRangeFromSlot(LSG *slot, KeyType start_key, Entry *candidate)
+{
+	// the stamp is read before the bitmap, a split in between bumps it.
+	const uint64_t stamp = __atomic_load_n(&(slot->order_stamp), __ATOMIC_ACQUIRE);
+	const uint64_t bitmap = __atomic_load_n(&(slot->commit_bitmap), __ATOMIC_ACQUIRE);
+	int count = 0;
+	if (!(stamp & LEAF_ORDER_LOCK) && (stamp & GROUP_BITMAP_FULL) == bitmap)
+	{
+		const int n = __builtin_popcountll(bitmap);
+		for (int k = 0; k < n; ++k)
+		{
+			const Entry &entry = slot->entries[slot->order[k]];
+			if (entry.key >= start_key && entry.value != MAX_VALUE)
+			{
+				candidate[count++] = entry;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(slot->order_stamp), __ATOMIC_RELAXED) == stamp)
+		{
+			return count;
+		}
+		count = 0;
+	}
+
+	// sort the committed slots, and keep the order for the next scans.
+	uint8_t order[MAX_ENTRY_NUM];
+	int n = 0;
+	for (uint64_t rest = bitmap; rest; rest &= rest - 1, ++n)
+	{
+		const int i = __builtin_ctzll(rest);
+		const KeyType key = slot->entries[i].key;
+		int j = n;
+		for (; j > 0 && slot->entries[order[j - 1]].key > key; --j)
+		{
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	for (int k = 0; k < n; ++k)
+	{
+		if (slot->entries[order[k]].key >= start_key && slot->entries[order[k]].value != MAX_VALUE)
+		{
+			candidate[count++] = slot->entries[order[k]];
+		}
+	}
+	if (!(stamp & LEAF_ORDER_LOCK) &&
+		__sync_bool_compare_and_swap(&(slot->order_stamp), stamp, stamp | LEAF_ORDER_LOCK))
+	{
+		memcpy(slot->order, order, n);
+		__atomic_store_n(&(slot->order_stamp), (stamp & LEAF_ORDER_GEN_MASK) | bitmap, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+#else
+int GetRangeFromSlot(LSG *slot, KeyType start_key, Entry *candidate)
+{
+	// probe bitmap one by one.
+	const uint64_t bitmap = __atomic_load_n(&(slot->commit_bitmap), __ATOMIC_CONSUME);
+	int count = 0;
+	if (start_key == 0)
+	{
+		for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+		{
+			if (bitmap & (0x1ULL << i) && slot->entries[i].value != MAX_VALUE)
+			{
+				candidate[count++] = slot->entries[i];
+			}
+		}
+	}
+	else
+	{
+		for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+		{
+			if (bitmap & (0x1ULL << i) &&
+				slot->entries[i].key >= start_key && slot->entries[i].value != MAX_VALUE)
+			{
+				candidate[count++] = slot->entries[i];
+			}
+		}
+	}
+	return count;
+}
+#endif
+
+// BRIEF: the first num entries not less than key, sorted by key.
+// REQUIRES: candidate has room for num + MAX_ENTRY_NUM entries.
+// RETURN: the number of entries.
+static int GetRangeEntries(PHAST *list, KeyType key, int num, Entry *candidate)
+{
+	ISN *target = NULL;
+	KeyType target_maxkey;
+
+	// search the target inner node first.
+	target = SearchList(list->inner_list, key, &target_maxkey);
+
+	// we have assigned a inner node for each head, so the target
+	// cannot be a head.
+	assert(target != NULL && !target->is_head);
+
+	////////////////////////////////////////
+	// 1. get the right slot.
+	//    Because slot is never free, it must be the one even moved to another node.
+	////////////////////////////////////////
+	int child_loc;
+	LSG *lfnode;
+retry:
+	{
+		const uint64_t version = StableVersion(target);
+		if (UNLIKELY(version & ISN_DEAD))
+		{
+			// target has been merged into the next one.
+			target = target->merged_into;
+			goto retry;
+		}
+		if (UNLIKELY(load_key(&(target->max_key)) < key))
+		{
+			// target has split and the range has changed.
+			target = next_inner_node(target);
+			if (UNLIKELY(target == NULL))
+			{
+				// reach the tail of the skiplist || abort.
+				return 0;
+			}
+			goto retry;
+		}
+		child_loc = binary_search(target, key);
+		lfnode = target->leaves[child_loc];
+		if (!ValidateVersion(target, version))
+			goto retry;
+	}
+
+	if (lfnode == NULL)
+	{
+		// abort!
+		for_debug();
+		assert(false);
+		return 0;
+	}
+
+	////////////////////////////////////////
+	// 2. get values from the slot.
+	////////////////////////////////////////
+	int got_count = 0; // no. elements in candidate.
+	int xnum = 0;	   // no. entries got from one slot.
+	KeyType low_key = key;
+	while (lfnode != NULL && got_count < num)
+	{
+		LSG *lf_next = lfnode->next;
+		xnum = GetRangeFromSlot(lfnode, low_key, &(candidate[got_count]));
+		if (lf_next != __atomic_load_n(&(lfnode->next), __ATOMIC_CONSUME))
+		{
+			// this lfnode has been split, re-scan this slot to avoid double refs.
+			continue;
+		}
+		else
+		{
+			lfnode = lf_next;
+		}
+
+		// lfnode has been reset as the next, if the scanned one is splitting,
+		// it doesnot matter due to we has skipped it.
+		got_count += xnum;
+		if (got_count > num)
+		{
+			// we have got the full keys, just break from the while loop.
+			break;
+		}
+
+		// the next slot may still hold the keys got here, before a split of
+		// this slot resets its bitmap or a merge into it unlinks the next.
+		if (xnum > 0)
+		{
+			KeyType largest = candidate[got_count - xnum].key;
+			for (int i = got_count - xnum + 1; i < got_count; ++i)
+			{
+				if (candidate[i].key > largest)
+					largest = candidate[i].key;
+			}
+			if (largest == MAX_KEY)
+				lfnode = NULL; // no key after it.
+			else
+				low_key = largest + 1;
+		}
+#ifndef USE_LEAF_ORDER
+		// sort the got keys.
+		insertion_sort_entry(&(candidate[got_count - xnum]), xnum);
+#endif
+	}
+
+	////////////////////////////////////////
+	// 3. check sort status and keys got from the last scan.
+	////////////////////////////////////////
+	int ret_count = (got_count > num) ? num : got_count;
+#ifndef USE_LEAF_ORDER
+	if (got_count > num)
+	{
+		// partition the keys got from the last scan to avoid
+		// sort all keys.
+		quick_select(candidate, num, got_count - xnum, got_count - 1);
+
+		// sort the first part of the keys.
+		insertion_sort_entry(&(candidate[got_count - xnum]), num - (got_count - xnum));
+	}
+#endif
+	return ret_count;
+}
+
+int Range_Search(PHAST *list, KeyType key, int num, ValueType *buf)
+{
+	EpochGuard guard(list->epoch);
+	Entry candidate[num + MAX_ENTRY_NUM];
+	int ret_count = GetRangeEntries(list, key, num, candidate);
+
+	// copy value.
+	for (int i = 0; i < ret_count; ++i)
+	{
+		buf[i] = candidate[i].value;
+	}
+	return ret_count;
+}
+
+ValueType Delete(PHAST *list, KeyType key)
+{
+#ifdef USE_TRUE_DELETE
+	EpochGuard guard(list->epoch);
+	KeyType target_maxkey;
+	ISN *target = SearchList(list->inner_list, key, &target_maxkey, true);
+	assert(target != NULL && !target->is_head);
+	assert(HoldsInnerNode(target));
+
+	ValueType ret = DeleteINode(list, target, key);
+	LeaveInnerNode(target);
+	return ret;
+#else
+	return Update(list, key, MAX_VALUE);
+#endif
+}
+
+#ifdef USE_VALUE_HEAP
+// RETURN: the value heap of the partition covering key.
+static inline VHP *value_heap(PHAST *list, KeyType key)
+{
+	PMAP *map = __atomic_load_n(&(list->inner_list->map), __ATOMIC_ACQUIRE);
+	return list->heaps[map->head[find_partition(map, key)]->pool_id];
+}
+
+bool Insert_Value(PHAST *list, KeyType key, const void *value, size_t len)
+{
+	VHP *heap = value_heap(list, key);
+	VBK *block = AllocValueBlock(heap, value, len);
+	if (block == NULL)
+	{
+		return false;
+	}
+	if (!Insert(list, key, (uint64_t)block))
+	{
+		// never published.
+		FreeValueBlock(heap, block);
+		return false;
+	}
+	return true;
+}
+
+bool Search_Value(PHAST *list, KeyType key, ValueView *view)
+{
+	const uint64_t ret = Search(list, key);
+	if (ret == 0 || ret == MAX_VALUE)
+	{
+		return false;
+	}
+	const VBK *block = (const VBK *)ret;
+	view->data = block->data;
+	view->len = block->len;
+	return true;
+}
+
+bool Update_Value(PHAST *list, KeyType key, const void *value, size_t len)
+{
+	VHP *heap = value_heap(list, key);
+	VBK *block = AllocValueBlock(heap, value, len);
+	if (block == NULL)
+	{
+		return false;
+	}
+	const uint64_t old_value = Update(list, key, (uint64_t)block);
+	if (old_value == 0)
+	{
+		FreeValueBlock(heap, block);
+		return false;
+	}
+	if (old_value != MAX_VALUE)
+	{
+		// the readers may still hold the old one.
+		list->epoch->Retire((void *)old_value, FreeValueBlock, heap);
+	}
+	return true;
+}
+
+bool Delete_Value(PHAST *list, KeyType key)
+{
+	const uint64_t old_value = Delete(list, key);
+	if (old_value == 0 || old_value == MAX_VALUE)
+	{
+		return false;
+	}
+	list->epoch->Retire((void *)old_value, FreeValueBlock, value_heap(list, key));
+	return true;
+}
+#endif
+
+#ifdef USE_VAR_KEY
+uint64_t var_key_prefix(const char *key, size_t len)
+{
+	uint64_t prefix = 0;
+	memcpy(&prefix, key, (len < VAR_KEY_PREFIX_LEN) ? len : VAR_KEY_PREFIX_LEN);
+	prefix = __builtin_bswap64(prefix);
+	// 0 is reserved, such keys share the chain of prefix 1.
+	return (prefix == 0) ? 1 : prefix;
+}
+
+static inline int var_key_compare(const VKR *rec, const char *key, size_t len)
+{
+	const size_t min_len = (rec->len < len) ? rec->len : len;
+	int ret = memcmp(rec->key, key, min_len);
+	if (ret != 0)
+		return ret;
+	return (rec->len < len) ? -1 : (rec->len > len);
+}
+
+static inline bool var_key_less(const VKR *a, const VKR *b)
+{
+	return var_key_compare(a, b->key, b->len) < 0;
+}
+
+static VKR *AllocVarKeyRecord(PMPool *pop, const char *key, size_t len, uint64_t value)
+{
+	VKR *record = (VKR *)pm_alloc(pop, sizeof(VKR) + len);
+	if (record == NULL)
+	{
+		fprintf(stderr, "failed to create a VKR in nvmm.\n");
+		return NULL;
+	}
+
+	record->next = NULL;
+	record->value = value;
+	record->len = len;
+	memcpy(record->key, key, len);
+	persist(pop, record, sizeof(VKR) + len, PERSIST_INSERT);
+	return record;
+}
+
+static void FreeVarKeyRecord(PMPool *pop, VKR *record)
+{
+	pm_free(pop, record);
+}
+
+// RETURN: the next record of rec in its chain.
+static inline VKR *next_var_key(const VKR *rec)
+{
+	return (VKR *)((uint64_t)__atomic_load_n(&(rec->next), __ATOMIC_CONSUME) & ~VKR_DEAD);
+}
+
+// BRIEF: same as SearchINode, but collect the values of all entries matching
+//        key, concurrent inserts of a new prefix may add it twice.
+//        locked is true if the caller holds inode by EnterInnerNode.
+// RETURN: the number of values, at most MAX_ENTRY_NUM.
+static int SearchINodeAll(ISN *inode, uint64_t key, uint64_t *values, bool locked)
+{
+	const uint8_t fp = f_hash(key);
+
+retry:
+	// a held inode is not split, a splitter may have locked it and wait for us.
+	const uint64_t version = locked ? 0 : StableVersion(inode);
+	if (UNLIKELY(version & ISN_DEAD))
+	{
+		inode = inode->merged_into;
+		goto retry;
+	}
+	int child_loc = seq_search(inode, key);
+	LSG *lfnode = inode->leaves[child_loc];
+	if (lfnode == NULL)
+	{
+		return 0;
+	}
+	uint64_t mLKey;
+	int count = 0;
+	while (true)
+	{
+		mLKey = __atomic_load_n(&lfnode->max_key, __ATOMIC_CONSUME);
+		while (mLKey < key)
+		{
+			lfnode = __atomic_load_n(&lfnode->next, __ATOMIC_CONSUME);
+			if (lfnode == NULL)
+			{
+				return 0;
+			}
+			mLKey = __atomic_load_n(&lfnode->max_key, __ATOMIC_CONSUME);
+		}
+
+		// compare the prefix only, the records are read by the caller.
+		count = 0;
+		const uint64_t bitmap = lfnode->commit_bitmap;
+		for (uint64_t match = fp_probe(lfnode, fp, bitmap); match; match &= match - 1)
+		{
+			const int i = __builtin_ctzll(match);
+			const uint64_t value = __atomic_load_n(&(lfnode->entries[i].value), __ATOMIC_ACQUIRE);
+			if (lfnode->entries[i].key == key && value != MAX_VALUE)
+			{
+				values[count++] = value; // a deleter may have taken the entry.
+			}
+		}
+
+		if (!locked && !ValidateVersion(inode, version))
+		{
+			goto retry;
+		}
+		if (mLKey != lfnode->max_key)
+		{
+			continue;
+		}
+		break;
+	}
+	return count;
 }
 
-ISN *find_in_agg_keys(ISN *head, const uint64_t key, uint64_t *target_maxkey)
+// RETURN: the record of key in the chains of records, NULL if not found. a
+//         record taken by a delete is skipped, it is about to be unlinked.
+static VKR *find_var_key(const uint64_t *records, int num, const char *key, size_t len)
 {
-	assert(head->is_head);
-	assert(head->agg_index != NULL);
-
-	AGGIndex *old_idx = head->agg_index;
-
-	return old_idx->Find(key, target_maxkey);
-}
+	for (int i = 0; i < num; ++i)
+	{
+		VKR *rec = (VKR *)records[i];
+		while (rec != NULL)
+		{
+			if (var_key_compare(rec, key, len) == 0)
+			{
+#ifdef USE_TRUE_DELETE
+				if (__atomic_load_n(&(rec->value), __ATOMIC_ACQUIRE) != MAX_VALUE)
 #endif
+					return rec;
+			}
+			rec = next_var_key(rec);
+		}
+	}
+	return NULL;
+}
 
-void free_inner_list(PHAST *list)
+// BRIEF: replace the value of rec by value, unless a delete has taken it.
+// RETURN: false if taken, otherwise the old value is in old_value.
+static inline bool set_var_key_value(VKR *rec, uint64_t value, uint64_t *old_value)
 {
-	ISL *inner_list = list->inner_list;
-
-	ISN *q = inner_list->head[0];
-	ISN *next = NULL;
-	while (q)
+#ifdef USE_TRUE_DELETE
+	uint64_t old = __atomic_load_n(&(rec->value), __ATOMIC_ACQUIRE);
+	while (old != MAX_VALUE &&
+		   !__atomic_compare_exchange_n(&(rec->value), &old, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+	if (old == MAX_VALUE)
 	{
-		next = q->next[0];
-		free(q);
-		q = next;
+		return false;
 	}
-	free(inner_list);
+	*old_value = old;
+#else
+	*old_value = __atomic_exchange_n(&(rec->value), value, __ATOMIC_ACQ_REL);
+#endif
+	return true;
 }
 
-void ISN_free(ISN *innernode)
+#ifdef USE_TRUE_DELETE
+static inline EXMutex *var_key_lock(PHAST *list, uint64_t prefix)
 {
-#ifdef USE_AGG_KEYS
-	free(innernode->agg_index);
-#endif
-	free(innernode->locker);
-	free(innernode);
+	return &(list->var_key_locks[((prefix * 0x9E3779B97F4A7C15ULL) >> 32) % VAR_KEY_LOCK_NUM]);
 }
 
-void dram_free(PHAST *list)
+// BRIEF: EpochManager::FreeFunc of the deleted records, arg is their pool.
+static void FreeDeletedVarKey(void *arg, void *ptr)
 {
-	if (!list)
-		return;
-	ISL *inner_list = list->inner_list;
-	ISN *q, *next;
+	FreeVarKeyRecord((PMPool *)arg, (VKR *)ptr);
+}
 
-	// free the inner node
-	q = inner_list->head[0];
-	while (q)
+// REQUIRES: hold the lock of the prefix of the records, which head their chains.
+// BRIEF: clear the VKR_DEAD marks left by a crashed delete.
+static void settle_var_key_heads(PMPool *pop, const uint64_t *records, int num)
+{
+	for (int i = 0; i < num; ++i)
 	{
-		next = q->next[0];
-		ISN_free(q);
-		q = next;
+		VKR *first = (VKR *)records[i];
+		if ((uint64_t)first->next & VKR_DEAD)
+		{
+			__atomic_store_n(&(first->next), next_var_key(first), __ATOMIC_RELEASE);
+			persist(pop, &(first->next), sizeof(VKR *), PERSIST_DELETE);
+		}
 	}
-	free(inner_list);
-	free(list);
 }
 
-PHAST *recovery(int n_threads)
+// REQUIRES: hold inode by EnterInnerNode, first is marked VKR_DEAD.
+// BRIEF: point the entry of prefix holding first to next. if next is NULL,
+//        take the entry and free its slot like DeleteINode.
+static void replace_var_key_head(PHAST *list, ISN *inode, uint64_t prefix, VKR *first, VKR *next)
 {
-	///////////////////////////
-	// create new PHAST.
-	///////////////////////////
-	PHAST *phast = new PHAST;
-	phast->inner_list = new InnerSkipList;
-	InnerSkipList *list = phast->inner_list;
+	assert(HoldsInnerNode(inode));
 
-	///////////////////////////
-	// init multiple header.
-	///////////////////////////
-	ISN *head = NULL;
-	for (int i = 0; i < HEAD_COUNT; i++)
+	const uint8_t fp = f_hash(prefix);
+	const int child_loc = binary_search(inode, prefix);
+	LSG *lfnode = inode->leaves[child_loc];
+	PMPool *pop = list->pops[inode->pool_id];
+	const uint64_t bitmap = __atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_CONSUME);
+	for (uint64_t match = fp_probe(lfnode, fp, bitmap); match; match &= match - 1)
 	{
-		head = create_inner_node(0);
-		if (head == NULL)
+		const int i = __builtin_ctzll(match);
+		uint64_t expected = (uint64_t)first;
+		if (lfnode->entries[i].key != prefix ||
+			!__atomic_compare_exchange_n(&(lfnode->entries[i].value), &expected,
+										 (next != NULL) ? (uint64_t)next : MAX_VALUE, false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 		{
-			fprintf(stderr, "Memory allocation failed for head!");
-			free(list);
-			return NULL;
+			continue;
 		}
-		head->is_head = true;
-		list->head[i] = head;
-		list->level[i] = 0;
-		// head1 [0] -> head2 [0] -> ...headx[0]-> NULL ;
-		if (i > 0)
-			for (int j = 0; j < MAX_L; j++)
-				list->head[i - 1]->next[j] = list->head[i];
+		if (next != NULL)
+		{
+			persist(pop, &(lfnode->entries[i].value), sizeof(ValueType), PERSIST_DELETE);
+			return;
+		}
+		__atomic_and_fetch(&(lfnode->commit_bitmap), ~(1ULL << i), __ATOMIC_ACQ_REL);
+		persist(pop, &lfnode->commit_bitmap, 8, PERSIST_DELETE);
+#ifdef USE_LEAF_ORDER
+		invalidate_leaf_order(lfnode);
+#endif
+		return;
 	}
+	assert(false); // the entry of a chain head cannot move while inode is held.
+}
+#endif
 
-	TOID(SHA)
-	root = POBJ_ROOT(pop, SHA);
-	LSG **head_slot_array = D_RW(root)->slot_head_array;
-
-	///////////////////////////
-	// Multithreading
-	//////////////////////////
-	std::vector<std::future<void>> futures(n_threads);
-	uint64_t head_per_thread = HEAD_COUNT / n_threads;
+bool Insert(PHAST *list, const char *key, size_t len, uint64_t value)
+{
+	EpochGuard guard(list->epoch);
+	const uint64_t prefix = var_key_prefix(key, len);
+	ISN *pre_nodes[MAX_L + 1], *next_nodes[MAX_L + 1];
+	uint64_t records[MAX_ENTRY_NUM];
+	VKR *rec = NULL;
+
+	// the read lock keeps the leaf nodes of target from splitting.
+	ISN *target = SearchList(list->inner_list, prefix, pre_nodes, next_nodes);
+	assert(target != NULL && !target->is_head);
+	PMPool *pop = list->pops[target->pool_id];
 
-	for (int tid = 0; tid < n_threads; tid++)
+	int n = SearchINodeAll(target, prefix, records, true);
+	while (n > 0)
 	{
-		int from = head_per_thread * tid;
-		int to = (tid == n_threads - 1) ? HEAD_COUNT : from + head_per_thread;
-
-		auto f = std::async(
-			std::launch::async,
-			[&list, &head_slot_array](int from, int to)
-			{
-				for (int i = from; i < to; ++i)
-				{ // loop:head
-					ISN *head = list->head[i];
-					ISN *cur_inode = head;
-
-					LSG *head_slot = head_slot_array[i];
-					LSG *pre_slot = NULL;
-					LSG *cur_slot = head_slot;
-
-					ISN *pre_inode[MAX_L];
-					for (int i = 0; i < MAX_L; i++)
-						pre_inode[i] = head;
-
-					uint64_t pre_maxkey = 0;
-					uint64_t count_pnode = 0;
-					uint64_t key_boundary = (i == HEAD_COUNT - 1) ? MAX_U64_KEY : (i + 1) * HASH_KEY;
-					while (cur_slot && cur_slot->max_key <= key_boundary)
-					{ // loop:slot
-						////////////////////////////////////////////////////////////////////////////
-						// step 1: recalculate the fp;
-						////////////////////////////////////////////////////////////////////////////
-						uint64_t bitmap = cur_slot->commit_bitmap;
-						// if (cur_slot->working_bitmap != bitmap)
-						// 	cur_slot->working_bitmap = bitmap;
-						for (int j = 0; j < MAX_ENTRY_NUM; j++)
-							if ((bitmap & (0x1ULL << j)))
-							{
-								uint8_t fp = f_hash(cur_slot->entries[j].key);
-								if (cur_slot->fingerprints[j] != fp)
-									cur_slot->fingerprints[j] = fp;
-							}
-
-						////////////////////////////////////////////////////////////////////////////
-						// step 2: determine if there are two identical max_keys
-						////////////////////////////////////////////////////////////////////////////
-						if (cur_slot->max_key == pre_maxkey)
-						{
-							// redo the slot split process. (1)reset the commit_bitmap.(2)update the maxkey(3)update innernode
-							// assert(pre_slot->commit_bitmap == GROUP_BITMAP_FULL);
-							pre_slot->commit_bitmap = ~cur_slot->commit_bitmap;
-							// pre_slot->working_bitmap = pre_slot->commit_bitmap;
-							pmemobj_persist(pop, &pre_slot->commit_bitmap, 8);
-
-							uint64_t bitmap = pre_slot->commit_bitmap;
-							uint64_t maxkey = 0;
-							for (int j = 0; j < MAX_ENTRY_NUM; j++)
-								if ((bitmap & (0x1ULL << j)) && pre_slot->entries[j].key > maxkey)
-									maxkey = pre_slot->entries[j].key;
-
-							assert(maxkey != 0);
-							pre_slot->max_key = maxkey;
-							pmemobj_persist(pop, &pre_slot->max_key, 8);
-
-							cur_inode->keys[cur_inode->nKeys - 1] = maxkey;
-							cur_inode->mem_bitmap[cur_inode->nKeys - 1] = pre_slot->commit_bitmap;
-							cur_inode->max_key = maxkey;
-						}
-
-						////////////////////////////////////////////////////////////////////////////
-						// step 3: add this slot to cur_inode;
-						////////////////////////////////////////////////////////////////////////////
-						if (cur_slot->is_head == true)
-						{
-							// create a new innernode and update the link.
-							int level = randomLevel();
-							if (level > list->level[i])
-								list->level[i] = level;
-							ISN *innode = create_inner_node(level);
-							for (int j = 0; j <= level; j++)
-							{
-								pre_inode[j]->next[j] = innode;
-								pre_inode[j] = innode;
-							}
-							count_pnode++;
-							cur_inode = innode;
-						}
-
-						cur_inode->keys[cur_inode->nKeys] = cur_slot->max_key;
-						cur_inode->mem_bitmap[cur_inode->nKeys] = cur_slot->commit_bitmap;
-						cur_inode->leaves[cur_inode->nKeys] = cur_slot;
-						cur_inode->max_key = cur_slot->max_key;
-						cur_inode->nKeys++;
-
-						////////////////////////////////////////////////////////////////////////////
-						// step 4: update variables for the next loop;
-						////////////////////////////////////////////////////////////////////////////
-						pre_maxkey = cur_slot->max_key;
-						pre_slot = cur_slot;
-						cur_slot = cur_slot->next;
-					}
+		VKR *old = find_var_key(records, n, key, len);
+		uint64_t old_value;
+		if (old != NULL && set_var_key_value(old, value, &old_value))
+		{
+			// key exists, replace the value.
+			persist(pop, &(old->value), 8, PERSIST_INSERT);
+			LeaveInnerNode(target);
+			if (rec != NULL)
+				FreeVarKeyRecord(pop, rec);
+			return true;
+		}
 
-// update the aggindex;
-#ifdef USE_AGG_KEYS
-					head->agg_index = new AGGIndex(head, count_pnode + AGG_REDUNDANT_SPACE);
+		// link a new record behind the first one of this prefix, also if a
+		// delete has just taken the old record of key.
+		if (rec == NULL && (rec = AllocVarKeyRecord(pop, key, len, value)) == NULL)
+		{
+			LeaveInnerNode(target);
+			return false;
+		}
+		VKR *first = (VKR *)records[0];
+		VKR *first_next = __atomic_load_n(&(first->next), __ATOMIC_CONSUME);
+#ifdef USE_TRUE_DELETE
+		if (UNLIKELY((uint64_t)first_next & VKR_DEAD))
+		{
+			// first is being deleted, wait for the new head. a mark left by
+			// a crash is cleared here.
+			EXMutex *lock = var_key_lock(list, prefix);
+			lock->Lock();
+			n = SearchINodeAll(target, prefix, records, true);
+			settle_var_key_heads(pop, records, n);
+			lock->Unlock();
+			continue;
+		}
 #endif
-				}
-			},
-			from, to);
-		futures.push_back(move(f));
+		rec->next = first_next;
+		persist(pop, &(rec->next), sizeof(VKR *), PERSIST_INSERT);
+		if (__sync_bool_compare_and_swap(&(first->next), first_next, rec))
+		{
+			persist(pop, &(first->next), sizeof(VKR *), PERSIST_INSERT);
+			LeaveInnerNode(target);
+			return true;
+		}
+		// another key of this prefix has been linked, check again.
 	}
+	LeaveInnerNode(target);
 
-	for (auto &&f : futures)
-		if (f.valid())
-			f.get();
-
-	return phast;
+	// a new prefix, the record goes to a leaf entry.
+	if (rec == NULL && (rec = AllocVarKeyRecord(pop, key, len, value)) == NULL)
+	{
+		return false;
+	}
+	return Insert(list, prefix, (uint64_t)rec);
 }
 
-uint64_t UpdateINode(ISN *inode, uint64_t key, uint64_t new_value)
+uint64_t Search(PHAST *list, const char *key, size_t len)
 {
-	assert(inode->locker->AssertReadHeld());
+	EpochGuard guard(list->epoch);
+	const uint64_t prefix = var_key_prefix(key, len);
+	uint64_t records[MAX_ENTRY_NUM], target_maxkey;
 
-	uint64_t old_value = 0;
-	int threshold = 0;
+	ISN *target = SearchList(list->inner_list, prefix, &target_maxkey);
+	assert(target != NULL && !target->is_head);
 
-	const uint8_t fp = f_hash(key);
-	// search the target leaf node.
-	const int child_loc = binary_search(inode, key);
-	LSG *lfnode = inode->leaves[child_loc];
-	if (UNLIKELY(lfnode == NULL))
-	{
-		return 0;
-	}
+	// the full keys are read only if the prefix matches.
+	int n = SearchINodeAll(target, prefix, records, false);
+	VKR *rec = find_var_key(records, n, key, len);
+	const uint64_t value = (rec != NULL) ? __atomic_load_n(&(rec->value), __ATOMIC_ACQUIRE) : 0;
+	return (value == MAX_VALUE) ? 0 : value;
+}
 
-	// probe bitmap one by one.
-	const uint64_t bitmap = __atomic_load_n(&(lfnode->commit_bitmap), __ATOMIC_CONSUME);
-	for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+uint64_t Update(PHAST *list, const char *key, size_t len, uint64_t newValue)
+{
+	EpochGuard guard(list->epoch);
+	const uint64_t prefix = var_key_prefix(key, len);
+	uint64_t records[MAX_ENTRY_NUM], target_maxkey, old_value = 0;
+
+	ISN *target = SearchList(list->inner_list, prefix, &target_maxkey, true);
+	assert(target != NULL && !target->is_head);
+	assert(HoldsInnerNode(target));
+
+	int n = SearchINodeAll(target, prefix, records, true);
+	for (int i = 0; i < n; ++i)
 	{
-		if ((bitmap & (0x1ULL << i)) &&
-			(lfnode->fingerprints[i] == fp) &&
-			(lfnode->entries[i].key) == key)
+		// a key inserted twice under a duplicated prefix entry is updated in both.
+		VKR *rec = find_var_key(&records[i], 1, key, len);
+		uint64_t value;
+		if (rec != NULL && set_var_key_value(rec, newValue, &value))
 		{
-			old_value = lfnode->entries[i].value;
-			// update the old value.
-			lfnode->entries[i].value = new_value;
-			pmemobj_persist(pop, &(lfnode->entries[i].value), 8);
-			return old_value;
+			old_value = value;
+			persist(list->pops[target->pool_id], &(rec->value), 8, PERSIST_UPDATE);
 		}
 	}
+	LeaveInnerNode(target);
 
 	return old_value;
 }
 
-uint64_t Update(PHAST *list, uint64_t key, uint64_t newValue)
+uint64_t Delete(PHAST *list, const char *key, size_t len)
 {
-	ISN *target = NULL;
-	uint64_t ret = 0, target_maxkey;
-
-	// search the target inner node first.
-	target = SearchList(list->inner_list, key, &target_maxkey, true);
+#ifdef USE_TRUE_DELETE
+	EpochGuard guard(list->epoch);
+	const uint64_t prefix = var_key_prefix(key, len);
+	uint64_t records[MAX_ENTRY_NUM], target_maxkey, old_value = 0;
 
-	// we have assigned a inner node for each head, so the target
-	// cannot be a head.
+	ISN *target = SearchList(list->inner_list, prefix, &target_maxkey, true);
 	assert(target != NULL && !target->is_head);
-	assert(target->locker->AssertReadHeld());
-
-	ret = UpdateINode(target, key, newValue);
-	target->locker->ReadUnlock();
-
-	return ret;
-}
-
-int GetRangeFromSlot(LSG *slot, uint64_t start_key, Entry *candidate)
-{
-	// probe bitmap one by one.
-	const uint64_t bitmap = __atomic_load_n(&(slot->commit_bitmap), __ATOMIC_CONSUME);
-	int count = 0;
-	if (start_key == 0)
+	assert(HoldsInnerNode(target));
+	PMPool *pop = list->pops[target->pool_id];
+
+	// the deletes of a prefix take turns, the inserts only change the next of a head.
+	EXMutex *lock = var_key_lock(list, prefix);
+	lock->Lock();
+	int n = SearchINodeAll(target, prefix, records, true);
+	settle_var_key_heads(pop, records, n);
+	VKR *taken = NULL; // the record whose value this delete has taken.
+	for (int i = 0; i < n; ++i)
 	{
-		for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+		// a key inserted twice under a duplicated prefix entry is deleted from both.
+		VKR *first = (VKR *)records[i];
+		VKR *pre = NULL, *rec = first;
+		while (rec != NULL && var_key_compare(rec, key, len) != 0)
+		{
+			pre = rec;
+			rec = next_var_key(rec);
+		}
+		if (rec == NULL)
 		{
-			if (bitmap & (0x1ULL << i))
+			continue;
+		}
+		if (rec != taken)
+		{
+			// the inserts and the updates of key fail on rec from now on, as in
+			// DeleteINode. a record taken already is left by a crashed delete.
+			const uint64_t value = __atomic_exchange_n(&(rec->value), MAX_VALUE, __ATOMIC_ACQ_REL);
+			if (value != MAX_VALUE)
 			{
-				candidate[count++] = slot->entries[i];
+				old_value = value;
+				taken = rec;
 			}
 		}
-	}
-	else
-	{
-		for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+
+		VKR *next;
+		if (pre == NULL)
 		{
-			if (bitmap & (0x1ULL << i) &&
-				slot->entries[i].key >= start_key)
+			// the inserts stop linking behind rec, then the entry moves to next.
+			next = (VKR *)__atomic_fetch_or((uint64_t *)&(rec->next), VKR_DEAD, __ATOMIC_ACQ_REL);
+			replace_var_key_head(list, target, prefix, rec, next);
+			records[i] = (uint64_t)next;
+		}
+		else if (pre == first)
+		{
+			// an insert may link a record behind first meanwhile, walk again then.
+			next = next_var_key(rec);
+			if (!__sync_bool_compare_and_swap(&(first->next), rec, next))
 			{
-				candidate[count++] = slot->entries[i];
+				--i;
+				continue;
 			}
+			persist(pop, &(first->next), sizeof(VKR *), PERSIST_DELETE);
+		}
+		else
+		{
+			next = next_var_key(rec);
+			__atomic_store_n(&(pre->next), next, __ATOMIC_RELEASE);
+			persist(pop, &(pre->next), sizeof(VKR *), PERSIST_DELETE);
 		}
+		// the readers may still walk through rec.
+		list->epoch->Retire(rec, FreeDeletedVarKey, pop);
+		if (rec != taken)
+		{
+			--i; // the record of key may follow the crashed one.
+			continue;
+		}
+		taken = NULL;
 	}
-	return count;
+	lock->Unlock();
+	LeaveInnerNode(target);
+
+	return old_value;
+#else
+	return Update(list, key, len, MAX_VALUE);
+#endif
 }
 
-int Range_Search(PHAST *list, uint64_t key, int num, uint64_t *buf)
+int Range_Search(PHAST *list, const char *start_key, size_t len, int num, uint64_t *buf)
 {
-	ISN *target = NULL;
-	uint64_t target_maxkey;
-
-	// search the target inner node first.
-	target = SearchList(list->inner_list, key, &target_maxkey);
-
-	// we have assigned a inner node for each head, so the target
-	// cannot be a head.
-	assert(target != NULL && !target->is_head);
-
-	////////////////////////////////////////
-	// 1. get the right slot.
-	//    Because slot is never free, it must be the one even moved to another node.
-	////////////////////////////////////////
-	int child_loc = binary_search(target, key);
-	LSG *lfnode = target->leaves[child_loc];
-	while (true)
+	EpochGuard guard(list->epoch);
+	const uint64_t start_prefix = var_key_prefix(start_key, len);
+	uint64_t prefix = start_prefix;
+	Entry candidate[num + 1 + MAX_ENTRY_NUM];
+	std::vector<VKR *> recs;
+	int ret_count = 0;
+
+	while (ret_count < num)
 	{
-		if (UNLIKELY(__atomic_load_n(&(target->max_key), __ATOMIC_CONSUME) < key))
+		// each prefix holds one key at least, one more entry tells whether
+		// the last prefix is complete.
+		const int want = num - ret_count + 1;
+		int got = GetRangeEntries(list, prefix, want, candidate);
+		if (got == 0)
 		{
-			// target has split and the range has changed.
-			target = __atomic_load_n(&(target->next[0]), __ATOMIC_CONSUME);
-			while (target != NULL && target->is_head)
+			break;
+		}
+		const uint64_t last_prefix = candidate[got - 1].key;
+		int use = got;
+		if (got == want)
+		{
+			// the entries of last_prefix may be cut off, scan it next round.
+			while (use > 0 && candidate[use - 1].key == last_prefix)
+				--use;
+			if (use == 0)
+				use = got;
+		}
+
+		// expand the chains and sort them by the full keys.
+		recs.clear();
+		for (int i = 0; i < use; ++i)
+		{
+			VKR *rec = (VKR *)candidate[i].value;
+			for (; rec != NULL; rec = next_var_key(rec))
 			{
-				// skip head node.
-				target = __atomic_load_n(&(target->next[0]), __ATOMIC_CONSUME);
+				if (candidate[i].key == start_prefix && var_key_compare(rec, start_key, len) < 0)
+					continue;
+				recs.push_back(rec);
 			}
-			if (UNLIKELY(target == NULL || target->is_head))
+		}
+		std::sort(recs.begin(), recs.end(), var_key_less);
+
+		for (size_t i = 0; i < recs.size() && ret_count < num; ++i)
+		{
+			if (i > 0 && var_key_compare(recs[i - 1], recs[i]->key, recs[i]->len) == 0)
+				continue; // the same key inserted under a duplicated prefix entry.
+			const uint64_t value = __atomic_load_n(&(recs[i]->value), __ATOMIC_ACQUIRE);
+			if (value != MAX_VALUE)
 			{
-				// reach the tail of the skiplist || abort.
-				return 0;
+				buf[ret_count++] = value; // skip the deleted keys.
 			}
-
-			child_loc = binary_search(target, key);
-			lfnode = target->leaves[child_loc];
-			continue;
 		}
-		break;
-	}
-
-	if (lfnode == NULL)
-	{
-		// abort!
-		for_debug();
-		assert(false);
-		return 0;
-	}
 
-	////////////////////////////////////////
-	// 2. get values from the slot.
-	////////////////////////////////////////
-	Entry candidate[num + MAX_ENTRY_NUM];
-	int got_count = 0; // no. elements in candidate.
-	int xnum = 0;	   // no. entries got from one slot.
-	uint64_t low_key = key;
-	while (lfnode != NULL && got_count < num)
-	{
-		LSG *lf_next = lfnode->next;
-		xnum = GetRangeFromSlot(lfnode, low_key, &(candidate[got_count]));
-		if (lf_next != __atomic_load_n(&(lfnode->next), __ATOMIC_CONSUME))
+		prefix = candidate[use - 1].key;
+		if (use == got && got < want)
 		{
-			// this lfnode has been split, re-scan this slot to avoid double refs.
-			continue;
+			break; // reach the tail.
 		}
-		else
+		if (use == got)
 		{
-			lfnode = lf_next;
+			if (prefix == MAX_U64_KEY)
+				break;
+			++prefix;
 		}
-
-		// lfnode has been reset as the next, if the scanned one is splitting,
-		// it doesnot matter due to we has skipped it.
-		got_count += xnum;
-		if (got_count > num)
+		else
 		{
-			// we have got the full keys, just break from the while loop.
-			break;
+			prefix = last_prefix;
 		}
-
-		// reset start_key to indicate no compare when get keys from the next slot.
-		low_key = 0;
-		// sort the got keys.
-		insertion_sort_entry(&(candidate[got_count - xnum]), xnum);
-	}
-
-	////////////////////////////////////////
-	// 3. check sort status and keys got from the last scan.
-	////////////////////////////////////////
-	int ret_count = (got_count > num) ? num : got_count;
-	if (got_count > num)
-	{
-		// partition the keys got from the last scan to avoid
-		// sort all keys.
-		quick_select(candidate, num, got_count - xnum, got_count - 1);
-
-		// sort the first part of the keys.
-		insertion_sort_entry(&(candidate[got_count - xnum]), num - (got_count - xnum));
-	}
-
-	// copy value.
-	for (int i = 0; i < ret_count; ++i)
-	{
-		buf[i] = candidate[i].value;
 	}
 	return ret_count;
 }
+#endif
 
-uint64_t Delete(PHAST *list, uint64_t key)
-{
-	return Update(list, key, MAX_U64_KEY);
-}
-
-void print_list_all(PHAST *list, uint64_t key)
+void print_list_all(PHAST *list, KeyType key)
 {
-	int head_idx = key / HASH_KEY;
-	ISN *header = list->inner_list->head[head_idx];
+	PMAP *map = list->inner_list->map;
+	ISN *header = map->head[find_partition(map, key)];
 	print_list_all(header);
 }
 
 void print_list_all(PHAST *list)
 {
-	for (int i = 0; i < HEAD_COUNT; ++i)
+	PMAP *map = list->inner_list->map;
+	for (int i = 0; i < map->nHeads; ++i)
 	{
-		print_list_all(list->inner_list->head[i]);
+		print_list_all(map->head[i]);
 	}
 }
 
@@ -1418,10 +4429,10 @@ void print_list_all(ISN *header)
 	while (node != NULL && !(node->is_head))
 	{
 		fprintf(stderr, "node[%d]: max key: %llu, level: %d, nKeys: %d\n",
-				pos++, node->max_key, node->nLevel, node->nKeys);
+				pos++, (unsigned long long)node->max_key, node->nLevel, node->nKeys);
 		for (int i = 0; i < node->nKeys; ++i)
 		{
-			fprintf(stderr, "%llu, ", node->keys[i]);
+			fprintf(stderr, "%llu, ", (unsigned long long)node->keys[i]);
 		}
 		fprintf(stderr, "\n");
 		node = node->next[0];
@@ -1434,46 +4445,46 @@ void print_inode_and_next(ISN *node)
 	ISN *next = node->next[0];
 
 	fprintf(stderr, "node[%d]: max key: %llu, level: %d, nKeys: %d\n",
-			pos++, node->max_key, node->nLevel, node->nKeys);
+			pos++, (unsigned long long)node->max_key, node->nLevel, node->nKeys);
 	for (int i = 0; i < node->nKeys; ++i)
 	{
-		fprintf(stderr, "%llu, ", node->keys[i]);
+		fprintf(stderr, "%llu, ", (unsigned long long)node->keys[i]);
 	}
 	fprintf(stderr, "\n");
 
 	if (next != NULL && !(next->is_head))
 	{
 		fprintf(stderr, "node[%d]: max key: %llu, level: %d, nKeys: %d\n",
-				pos++, node->max_key, node->nLevel, node->nKeys);
+				pos++, (unsigned long long)node->max_key, node->nLevel, node->nKeys);
 		for (int i = 0; i < node->nKeys; ++i)
 		{
-			fprintf(stderr, "%llu, ", node->keys[i]);
+			fprintf(stderr, "%llu, ", (unsigned long long)node->keys[i]);
 		}
 		fprintf(stderr, "\n");
 	}
 }
 
-void print_lnode_all(LSG *node, uint64_t maxkey, const uint64_t bitmap)
+void print_lnode_all(LSG *node, KeyType maxkey, const uint64_t bitmap)
 {
-	fprintf(stderr, "--> pre_maxkey: %lu, max key: %lu\n", maxkey, node->max_key);
+	fprintf(stderr, "--> pre_maxkey: %lu, max key: %lu\n", (uint64_t)maxkey, (uint64_t)node->max_key);
 	for (int i = 0; i < MAX_ENTRY_NUM; ++i)
 	{
 		if ((bitmap & (0x1ULL << i)))
 		{
-			fprintf(stderr, "\t#%d %lu %lu\n", i, node->entries[i].key, node->entries[i].value);
+			fprintf(stderr, "\t#%d %lu %lu\n", i, (uint64_t)node->entries[i].key, (uint64_t)node->entries[i].value);
 		}
 	}
 }
 
 void print_lnode_all(LSG *node)
 {
-	fprintf(stderr, "--> max key: %lu\n", node->max_key);
+	fprintf(stderr, "--> max key: %lu\n", (uint64_t)node->max_key);
 	const uint64_t bitmap = __atomic_load_n(&(node->commit_bitmap), __ATOMIC_CONSUME);
 	for (int i = 0; i < MAX_ENTRY_NUM; ++i)
 	{
 		if ((bitmap & (0x1ULL << i)))
 		{
-			fprintf(stderr, "\t#%d %lu %lu\n", i, node->entries[i].key, node->entries[i].value);
+			fprintf(stderr, "\t#%d %lu %lu\n", i, (uint64_t)node->entries[i].key, (uint64_t)node->entries[i].value);
 		}
 	}
 }
@@ -1491,7 +4502,7 @@ void print_lnode_and_next(LSG *node)
 void print_list_skeleton(PHAST *list)
 {
 	// for (int i = 0; i < HEAD_COUNT; ++i) {
-	print_list_skeleton(list->inner_list->head[0]);
+	print_list_skeleton(list->inner_list->map->head[0]);
 	// }
 }
 
@@ -1521,6 +4532,22 @@ void print_list_skeleton(ISN *header)
 		printf("Level: %2d has %zu nodes\n", level + 1, level_nodes[level]);
 	}
 }
+void print_partitions(PHAST *list)
+{
+	PMAP *map = list->inner_list->map;
+	fprintf(stderr, "%d partitions\n", map->nHeads);
+	for (int i = 0; i < map->nHeads; ++i)
+	{
+#ifdef USE_ADAPTIVE_PARTITION
+		fprintf(stderr, "partition[%d]: upper bound: %lu, level: %d, inner nodes: %u\n",
+				i, (uint64_t)map->bounds[i], map->head[i]->nLevel, map->head[i]->n_inodes);
+#else
+		fprintf(stderr, "partition[%d]: upper bound: %lu, level: %d\n",
+				i, (uint64_t)map->bounds[i], map->head[i]->nLevel);
+#endif
+	}
+}
+
 /*
 void print_mem_nvm_comsumption(PHAST *list) {
 	uint64_t in_num = 0, hd_num = 0, lb_num = 0;
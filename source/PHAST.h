@@ -1,19 +1,18 @@
 #pragma once
 #include "util.h"
+#include "epoch.h"
+#include "arena.h"
 
-#define USE_PMDK
-#ifdef USE_PMDK
-#include <libpmemobj.h>
+#define USE_PMDK // build the libpmemobj backend of the pools, see PMBackend in pm_pool.h.
+#include "pm_pool.h"
 #define PMEM_PATH "/mnt/pmem/PHAST/mempool"
 #define POOL_SIZE (10737418240ULL) // pool size : 10GB
+#define MAX_POOL_NUM 16            // the max number of pool files of an instance.
 typedef struct SLOT_HEAD_ARRAY SHA;
-typedef struct LeafSkipGroup LSG;
-
-POBJ_LAYOUT_BEGIN(PHAST);
-POBJ_LAYOUT_ROOT(PHAST, SHA);
-POBJ_LAYOUT_TOID(PHAST, LSG)
-POBJ_LAYOUT_END(PHAST);
-#endif
+typedef struct VarKeyRecord VKR;
+typedef struct ValueBlock VBK;
+typedef struct ValueSlab VSB;
+typedef struct LeafChunk LCK;
 
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
@@ -21,87 +20,421 @@ POBJ_LAYOUT_END(PHAST);
 #define CACHE_LINE_SIZE 64
 #define MAX_U64_KEY 0xffffffffffffffffULL // max key in uint64_t
 
-#define HEAD_COUNT 128 // the number of partitions.
-#define HASH_KEY (MAX_U64_KEY / HEAD_COUNT)
+// the key and value types of the index built by this file, the layouts and
+// the search helpers below are templates, each key and value type gets its own.
+#define KEY_BITS 64   // 32, 64 or 128.
+#define VALUE_BITS 64 // 32 or 64.
+#if KEY_BITS == 32
+typedef uint32_t KeyType;
+#elif KEY_BITS == 64
+typedef uint64_t KeyType;
+#elif KEY_BITS == 128
+typedef unsigned __int128 KeyType;
+#else
+#error "KEY_BITS must be 32, 64 or 128"
+#endif
+#if VALUE_BITS == 32
+typedef uint32_t ValueType;
+#elif VALUE_BITS == 64
+typedef uint64_t ValueType;
+#else
+#error "VALUE_BITS must be 32 or 64"
+#endif
+#define MAX_KEY ((KeyType) ~(KeyType)0)       // the upper bound of the last partition.
+#define MAX_VALUE ((ValueType) ~(ValueType)0) // the value of a deleted key.
+
+#define HEAD_COUNT 128 // the initial number of partitions.
+#define HASH_KEY (MAX_KEY / HEAD_COUNT)
+#define MAX_HEAD_COUNT 4096 // the max number of partitions after splits.
+
+#define USE_ADAPTIVE_PARTITION // split hot/oversized partitions and merge cold ones online.
+#ifdef USE_ADAPTIVE_PARTITION
+#define PARTITION_SPLIT_TH 512 // split a partition holding more inner nodes than this.
+#define PARTITION_HOT_TH 64    // split a partition with more inner node splits than this since the last rebalance.
+#define PARTITION_MERGE_RATIO 2 // merge two cold neighbours holding fewer inner nodes in total than the mean partition over this.
+#define PARTITION_REBALANCE_MS 1000 // the period of rebalance_partitions in the background maintenance.
+#endif
 
 #define USE_AGG_KEYS // index cache design.
 #ifdef USE_AGG_KEYS
 #define AGG_UPDATE_LEVEL 1    // if the height of an InnerSkipNode > AGG_UPDATE_LEVEL, put this node into the index cache.
 #define AGG_SLOT_INIT_NUM 8   // the initial number of slots in the index cache
 #define AGG_REDUNDANT_SPACE 4 // redundant space in case overflow.
+#define AGG_GAP_RATIO 2       // slots per node when the index cache is built, the others are gaps.
+// #define USE_AGG_MODEL      // a piecewise linear model predicts the slot of a key in the index cache.
+#ifdef USE_AGG_MODEL
+#define AGG_MODEL_EPSILON 8   // max error of the model over the nodes when it is trained.
+#define AGG_MODEL_RETRAIN 16  // train the model again after this many insertions, each moves a slot by 1 at most.
+#define AGG_MODEL_MIN_NODES 256 // a smaller index is searched without the model.
+#endif
 class AGGIndex;
 #endif
 
 #define SPAN_TH 1 // for deterministic design of inner node
 
-#define MAX_ENTRY_NUM 56                        // 56*1 (fingerprints) + 8 (bitmap) = 64 (cache line size)
-#define GROUP_BITMAP_FULL 0x00ffffffffffffffULL // MAX_ENTRY_NUM capacity. 2^56-1
+#define USE_SIMD_SEARCH // AVX2/AVX-512 lower bound over the inner node keys and agg keys of up to 64 bits, picked at runtime.
+#ifdef USE_SIMD_SEARCH
+#define SIMD_SEARCH_BLOCK 32 // binary search narrows the range to this many keys, then vectors count the rest.
+#endif
+#define USE_SIMD_PROBE // AVX2/AVX-512 compare of all the fingerprints of a leaf group at once, picked at runtime.
+
+#if KEY_BITS == 64 && VALUE_BITS == 64
+#define USE_VAR_KEY // string keys: an 8-byte prefix in the leaves, the full key out of line.
+#endif
+#ifdef USE_VAR_KEY
+#define VAR_KEY_PREFIX_LEN 8 // bytes of the key kept in Entry::key, big-endian to keep the order.
+#define VAR_KEY_LOCK_NUM 64  // lock stripes serializing the deletes of the string keys by prefix.
+#define VKR_DEAD 1ULL        // in VarKeyRecord::next, the record no longer heads its chain.
+#endif
+
+#if VALUE_BITS == 64
+#define USE_VALUE_HEAP // values of any length in a size-class heap in PM.
+#endif
+#ifdef USE_VALUE_HEAP
+#define VALUE_CLASS_NUM 11             // block sizes: 64B, 128B, ..., 64KB.
+#define VALUE_MIN_BLOCK_SIZE 64
+#define VALUE_MAX_BLOCK_SIZE (VALUE_MIN_BLOCK_SIZE << (VALUE_CLASS_NUM - 1))
+#define VALUE_SLAB_SIZE (1ULL << 20)   // a slab is cut into the blocks of one class.
+#define VALUE_BLOCK_USED 0x56414c55U  // state of a block holding a value, 0 if free.
+#endif
+
+#define GROUP_BITMAP_BITS 64                                         // the commit bitmap is persisted by one 8-byte atomic write.
+#define MAX_ENTRY_NUM (CACHE_LINE_SIZE - GROUP_BITMAP_BITS / 8)      // 56*1 (fingerprints) + 8 (bitmap) = 64 (cache line size)
+#define GROUP_BITMAP_FULL ((1ULL << MAX_ENTRY_NUM) - 1)              // MAX_ENTRY_NUM capacity. 2^56-1
+
+#define USE_LEAF_ORDER // the committed slots of each leaf group sorted by key, kept for the scans.
+#ifdef USE_LEAF_ORDER
+#define LEAF_ORDER_GEN (1ULL << MAX_ENTRY_NUM)         // in LSG::order_stamp, bumped when commit bits are cleared.
+#define LEAF_ORDER_GEN_MASK (0x7FULL << MAX_ENTRY_NUM)
+#define LEAF_ORDER_LOCK (1ULL << 63)                   // in LSG::order_stamp, order is being written.
+#endif
 #define MAX_L 32                                // max level of InnerSkipNode
 #define MAX_LEAF_CAPACITY 128                   // the max size of InnerSkipNode
 #define MIN_LEAF_CAPACITY (MAX_LEAF_CAPACITY / 2)
 
+#define ISN_DEAD (1ULL << 63)  // in ISN::version, the node has been merged into its right neighbour.
+#define ISN_LEVEL_BUSY 0x80    // in ISN::nLevel, the node is being linked in a new level or unlinked.
+
+#define USE_INODE_MERGE // merge adjacent sparse inner nodes.
+#ifdef USE_INODE_MERGE
+#define ISN_MERGE_TH (MAX_LEAF_CAPACITY / 2) // merge two neighbours holding at most this many leaf nodes in total.
+#endif
+
+#define USE_TRUE_DELETE // Delete clears the commit bit, the slot is reused by the inserts instead of a split.
+#ifdef USE_TRUE_DELETE
+#define DELETE_RECLAIM_TH (MAX_ENTRY_NUM * 7 / 8) // a full leaf group holding at most this many keys reuses its deleted slots.
+#endif
+
+#define USE_LEAF_MERGE // merge adjacent sparse leaf groups of an inner node, the freed ones are reused.
+#ifdef USE_LEAF_MERGE
+#define LEAF_MERGE_TH (MAX_ENTRY_NUM / 2) // merge two neighbours holding at most this many entries in total.
+#endif
+
+#define USE_LEAF_BATCH_ALLOC // each thread takes the leaf groups from a chunk it reserved in the pool.
+#ifdef USE_LEAF_BATCH_ALLOC
+#define LEAF_ALLOC_BATCH 64 // leaf groups per chunk, at most 64.
+#endif
+
+#define RECOVERY_FILL (MAX_LEAF_CAPACITY * 7 / 8) // leaf nodes per inner node rebuilt by recovery.
+
+#define USE_PERSIST_STATS // count the persists, flushed cache lines and fences of each kind of operation.
+
+#define USE_TOWER_REBALANCE // rebuild the skewed towers of the inner nodes in the background.
+#ifdef USE_TOWER_REBALANCE
+#define TOWER_SKEW_TH 2          // rebuild a head if a level holds this many times more or fewer nodes than ideal.
+#define MAINTAIN_INTERVAL_MS 100 // the period of the background maintenance.
+#endif
+
+#define SEARCH_PREFETCH_DISTANCE 0 // levels below whose next nodes SearchList prefetches, 0 (default) turns prefetching off.
+
+#define USE_ISN_LAYOUT // hot search header, a key block with a summary, cold leaf arrays.
+#ifdef USE_ISN_LAYOUT
+#define ISN_SUMMARY_STRIDE 16 // keys per block of the two-step inner node search.
+#define ISN_SUMMARY_NUM (MAX_LEAF_CAPACITY / ISN_SUMMARY_STRIDE)
+#endif
+
+// #define USE_SEARCH_TRACE // Search reports the inner node lines it reads to search_trace, see micro_bench.
+
 // for unsigned long long only.
 #define firstzero(x) __builtin_ffsll((~(x)))
 // for unsigned long long only.
 #define popcount1(x) __builtin_popcountll(x)
 
-typedef struct alignas(16) Entry
+// BRIEF: the layout constants of keys of type K and values of type V.
+template <typename K, typename V>
+struct LayoutTraits
+{
+    static_assert(sizeof(K) == 4 || sizeof(K) == 8 || sizeof(K) == 16, "the keys are 32, 64 or 128 bits");
+    static_assert(sizeof(V) == 4 || sizeof(V) == 8, "the values are 32 or 64 bits");
+    static constexpr K max_key = (K)~(K)0;
+    // an entry is aligned to its power-of-two size, so it never spans two lines.
+    static constexpr size_t entry_align = (sizeof(K) + sizeof(V) <= 8) ? 8 : ((sizeof(K) + sizeof(V) <= 16) ? 16 : 32);
+};
+
+template <typename K, typename V>
+struct alignas(LayoutTraits<K, V>::entry_align) EntryT
 {
-    uint64_t key = 0;
-    uint64_t value = 0;
-} Entry;
+    K key = 0;
+    V value = 0;
+};
 
-typedef struct LeafSkipGroup
+template <typename K, typename V>
+struct LeafSkipGroupT
 {
     alignas(64) uint64_t commit_bitmap = 0; // control read access to LN.
     uint8_t fingerprints[MAX_ENTRY_NUM];
-    uint64_t max_key = 0;
-    LeafSkipGroup *next;
+    alignas(64) K max_key = 0;
+    LeafSkipGroupT *next;
     bool is_head;
-    uint8_t pad[47];
-    alignas(16) Entry entries[MAX_ENTRY_NUM];
-} LSG;
+    alignas(64) EntryT<K, V> entries[MAX_ENTRY_NUM];
+#ifdef USE_LEAF_ORDER
+    // a cache for the scans, never persisted and reset by the recovery.
+    alignas(64) uint64_t order_stamp = 0; // the slots in order, the generation and LEAF_ORDER_LOCK.
+    uint8_t order[MAX_ENTRY_NUM];         // the slots of order_stamp sorted by key.
+#endif
+};
 
-typedef struct InnerSkipNode
+typedef EntryT<KeyType, ValueType> Entry;
+typedef LeafSkipGroupT<KeyType, ValueType> LSG;
+
+#ifdef USE_VAR_KEY
+// BRIEF: a string key and its value, allocated in the pool of its partition.
+//        the leaf entry holds the key prefix and the first record, the
+//        records sharing the same prefix are chained behind it.
+typedef struct VarKeyRecord
 {
-    uint64_t max_key;
-    RWMutex *locker;
-#ifdef USE_AGG_KEYS // only head has agg_index.
-    AGGIndex *agg_index;
+    VarKeyRecord *next; // the next key with the same prefix, unordered.
+    uint64_t value;
+    uint32_t len;
+    char key[];
+} VKR;
 #endif
+
+template <typename K, typename V>
+struct alignas(64) InnerSkipNodeT
+{
+    // the search reads the first cache line, next[0..] share it.
+    K max_key;
+    uint64_t version; // optimistic lock, odd while the keys or the leaf nodes are being split.
     uint16_t nKeys;
     bool is_head;
-    bool is_split; // indicate LB/LN is split.
     uint8_t nLevel;
+    uint8_t pool_id; // the pool holding the leaves of this node.
     uint8_t pad[3];
-    struct InnerSkipNode *next[MAX_L];
-    uint64_t keys[MAX_LEAF_CAPACITY];
-    LSG *leaves[MAX_LEAF_CAPACITY];
+    InnerSkipNodeT *next[MAX_L];
+#ifdef USE_ISN_LAYOUT
+    alignas(64) K key_summary[ISN_SUMMARY_NUM]; // the last key of each ISN_SUMMARY_STRIDE keys.
+    alignas(64) K keys[MAX_LEAF_CAPACITY];
+    // touched after the leaf node is chosen.
+    alignas(64) LeafSkipGroupT<K, V> *leaves[MAX_LEAF_CAPACITY];
+    alignas(64) uint64_t mem_bitmap[MAX_LEAF_CAPACITY];
+#else
+    K keys[MAX_LEAF_CAPACITY];
+    LeafSkipGroupT<K, V> *leaves[MAX_LEAF_CAPACITY];
     uint64_t mem_bitmap[MAX_LEAF_CAPACITY];
-} ISN;
+#endif
+    InnerSkipNodeT *merged_into; // the node holding the leaf nodes of this one once it is dead.
+#ifdef USE_AGG_KEYS // only head has agg_index.
+    AGGIndex *agg_index;
+#endif
+#ifdef USE_ADAPTIVE_PARTITION // only meaningful in head.
+    uint32_t n_inodes; // the number of inner nodes in this partition.
+    uint32_t n_splits; // inner node splits since the last rebalance.
+#endif
+};
+
+typedef InnerSkipNodeT<KeyType, ValueType> ISN;
+
+#ifdef USE_VALUE_HEAP
+// BRIEF: a value in PM, a block of a slab, or a single object if it is
+//        larger than VALUE_MAX_BLOCK_SIZE. the entry value points to it.
+typedef struct ValueBlock
+{
+    uint32_t state; // VALUE_BLOCK_USED or 0.
+    uint32_t len;
+    char data[];
+} VBK;
+
+// BRIEF: the slabs of a pool are chained from its root.
+typedef struct ValueSlab
+{
+    ValueSlab *next;
+    uint64_t size_class;
+    alignas(64) char blocks[];
+} VSB;
+
+// BRIEF: DRAM state of the value heap of one pool.
+typedef struct ValueHeap
+{
+    PMPool *pop;
+    SHA *root;                                      // holds the slab chain.
+    EXMutex slab_lock;                              // serializes adding slabs.
+    EXMutex class_lock[VALUE_CLASS_NUM];
+    std::vector<VBK *> free_blocks[VALUE_CLASS_NUM];
+} VHP;
+
+// BRIEF: a value read in place, valid until the EpochGuard of the reader ends.
+typedef struct ValueView
+{
+    const char *data;
+    size_t len;
+} ValueView;
+#endif
+
+// the kinds of operation the persists are counted for.
+enum PersistOp
+{
+    PERSIST_INSERT,      // the entry and the commit bit of an insert, the records of a string key.
+    PERSIST_UPDATE,      // the new value.
+    PERSIST_DELETE,      // the cleared commit bit.
+    PERSIST_LEAF_SPLIT,  // the new leaf group, the next pointer, commit bits and max key of the old one.
+    PERSIST_INODE_SPLIT, // the head flag of the first leaf group of the new inner node.
+    PERSIST_MERGE,       // the merges of leaf groups and of inner nodes.
+    PERSIST_PARTITION,   // the root transactions of the partition splits and merges.
+    PERSIST_ALLOC,       // the chains of the free leaf groups, the chunks, the value slabs and the pool allocator.
+    PERSIST_VALUE,       // the blocks of the value heap.
+    PERSIST_CREATE,      // the pool headers, the roots and the first leaf groups of a new instance.
+    PERSIST_RECOVERY,    // the rolled back transactions, the repairs and the free chain rebuilt by the recovery.
+    PERSIST_OP_NUM,
+};
+
+static const char *const PERSIST_OP_NAME[] = {"insert", "update", "delete", "leaf split", "inode split", "merge",
+                                              "partition", "alloc", "value", "create", "recovery"};
+
+// BRIEF: the flushes of one kind of operation, as the backend of the pools
+//        reports them to pm_flush_hook: all of them on the file backend, its
+//        allocator and undo log included, the pmemobj_persist calls but not
+//        the flushes inside libpmemobj on pmdk, none on dram.
+typedef struct PersistStats
+{
+    uint64_t persists; // flushes, each ended by a fence.
+    uint64_t lines;    // cache lines flushed.
+    uint64_t bytes;
+    uint64_t fences;
+} PersistStats;
+
+#ifdef USE_LEAF_BATCH_ALLOC
+// BRIEF: LEAF_ALLOC_BATCH leaf groups reserved by a thread at once, chained
+//        from the root of the pool. the recovery frees the ones not linked.
+typedef struct LeafChunk
+{
+    LeafChunk *next;
+    alignas(64) LSG leaves[LEAF_ALLOC_BATCH];
+} LCK;
+
+// BRIEF: the leaf groups of a thread: its recycled ones first, then the rest
+//        of its chunk, then the spare chunk reserved by the maintenance thread.
+typedef struct alignas(64) LeafCursor
+{
+    LSG *recycled; // zeroed when freed, chained by next.
+    LSG *pos;
+    LSG *end;
+    LeafChunk *spare; // NULL once taken, until the maintenance thread reserves another.
+} LeafCursor;
+#endif
+
+// BRIEF: DRAM state of the leaf groups of one pool, the free ones are chained
+//        from its root by LSG::next.
+typedef struct LeafAllocator
+{
+    PMPool *pop;
+    SHA *root;    // holds the free leaf groups and the chunks.
+    EXMutex lock; // serializes the chains.
+#ifdef USE_LEAF_BATCH_ALLOC
+    LSG *recycled; // the freed leaf groups, zeroed and chained by next, taken LEAF_ALLOC_BATCH at a time.
+    LeafCursor cursors[MAX_THREAD_NUM]; // written by its thread only, except the spare.
+#endif
+} LAL;
 
-#define new_node(n) ((ISN *)malloc(sizeof(ISN)))
+// BRIEF: routing table of the partitions. never modified after published,
+//        split/merge installs a new map as a whole.
+typedef struct PartitionMap
+{
+    int nHeads;
+    KeyType *bounds; // inclusive upper key of each partition, ascending.
+    ISN **head;       // head node of each partition.
+} PMAP;
 
 typedef struct InnerSkipList
 {
-    uint8_t level[HEAD_COUNT];
-    ISN *head[HEAD_COUNT];
+    PMAP *map;
+    EXMutex resize_lock;               // serializes partition split/merge.
+    EpochManager *epoch;               // the instance's, frees the replaced maps, nodes and indexes.
+    Arena inodes{sizeof(ISN)};         // all inner nodes, the retired ones are reused.
 } ISL;
 
+// BRIEF: configuration of a PHAST instance.
+typedef struct PHASTOptions
+{
+    const char *path = PMEM_PATH;           // pool file, the prefix of "path.i" if n_pools > 1.
+    const char *const *pool_paths = NULL;   // one pool file per device, overrides path.
+    int n_pools = 1;                        // partitions are striped over n_pools pool files.
+    uint64_t pool_size = POOL_SIZE;         // size of each pool, used when the pool is created.
+    int n_heads = HEAD_COUNT;               // the initial number of partitions.
+    PMBackend backend = PM_BACKEND_DEFAULT; // where the pools live, the same one to recover them.
+} PHASTOptions;
+
+// BRIEF: one index instance, owns its pools, roots and partitions.
+//        instances share nothing, each one needs its own pool files.
 typedef struct PHAST
 {
     ISL *inner_list;
     int size;
+    int n_pools;
+    PMPool *pops[MAX_POOL_NUM]; // a partition lives in pops[head->pool_id] only.
+    std::vector<std::string> paths;
+    uint64_t pool_size;
+    EpochManager *epoch; // readers pin it while holding the memory replaced by writers.
+#ifdef USE_TOWER_REBALANCE
+    std::thread *maintainer; // the background maintenance, NULL if not started.
+    volatile bool stop_maintainer;
+#endif
+#ifdef USE_VALUE_HEAP
+    VHP *heaps[MAX_POOL_NUM]; // the values of a partition live in heaps[head->pool_id].
+#endif
+    LAL *leaf_allocs[MAX_POOL_NUM]; // the leaf groups of a partition come from leaf_allocs[head->pool_id].
+#if defined(USE_VAR_KEY) && defined(USE_TRUE_DELETE)
+    EXMutex var_key_locks[VAR_KEY_LOCK_NUM]; // the deletes of the string keys take the stripe of their prefix.
+#endif
 } PHAST;
 
+// BRIEF: root of each pool, lists the partitions living in this pool.
 typedef struct SLOT_HEAD_ARRAY
 {
-    LSG *slot_head_array[HEAD_COUNT];
+    uint64_t pool_id;                     // index of this pool in the instance.
+    uint64_t n_pools;                     // the number of pools of the instance.
+    uint64_t n_heads;                     // the number of partitions in this pool.
+    KeyType bounds[MAX_HEAD_COUNT];       // inclusive upper key of each partition.
+    LSG *slot_head_array[MAX_HEAD_COUNT]; // the first leaf group of each partition.
+#ifdef USE_VALUE_HEAP
+    ValueSlab *value_slabs; // the slabs of the value heap.
+#endif
+    LSG *free_leaves; // the leaf groups freed by the merges and the recovery, chained by next. unused
+                      // with USE_LEAF_BATCH_ALLOC, the recovery finds the free ones in the chunks.
+#ifdef USE_LEAF_BATCH_ALLOC
+    LeafChunk *leaf_chunks; // every chunk of leaf groups reserved in this pool.
+#endif
 } SHA;
 
-ISN *create_inner_node(int level);
+ISN *create_inner_node(ISL *list, int level);
+
+// BRIEF: create a new instance, opt.n_heads equal ranges over the key space.
+PHAST *init_list(const PHASTOptions &opt = PHASTOptions());
+
+// BRIEF: the partition bounds are the opt.n_heads-quantiles of the key sample
+//        instead of equal ranges. persisted in the root for recovery.
+PHAST *init_list_by_sample(const KeyType *sample, size_t sample_num,
+                           const PHASTOptions &opt = PHASTOptions());
 
-PHAST *init_list();
+// BRIEF: same as init_list_by_sample, bucket i holds hist_counts[i] keys
+//        not larger than hist_keys[i].
+// REQUIRES: hist_keys is ascending.
+PHAST *init_list_by_histogram(const KeyType *hist_keys, const uint64_t *hist_counts,
+                              size_t bucket_num, const PHASTOptions &opt = PHASTOptions());
+
+// BRIEF: create a list partitioned by the quantiles of keys, then insert all of them.
+PHAST *bulk_load(const KeyType *keys, const ValueType *values, size_t num,
+                 const PHASTOptions &opt = PHASTOptions());
 
 ////////////////////////////////////
 // main functions
@@ -109,47 +442,169 @@ PHAST *init_list();
 
 // REQUIRES: key and value are not 0.
 // RETURN: true if succeeded. otherwise false.
-bool Insert(PHAST *list, uint64_t key, uint64_t value);
+bool Insert(PHAST *list, KeyType key, ValueType value);
 
 // RETURN: value if succeeded. otherwise 0.
-uint64_t Search(PHAST *list, uint64_t key);
+ValueType Search(PHAST *list, KeyType key);
 
+// BRIEF: free the DRAM index and the instance, close its pool.
 void dram_free(PHAST *list);
 
-PHAST *recovery(int n_thread);
+// BRIEF: open the pools of opt and rebuild the DRAM index, the pools are
+//        scanned in parallel with n_thread threads in total.
+// RETURN: the recovered instance, NULL if failed.
+PHAST *recovery(int n_thread, const PHASTOptions &opt = PHASTOptions());
 
 // RETURN the old value if exist.
-uint64_t Update(PHAST *list, uint64_t key, uint64_t newValue);
+ValueType Update(PHAST *list, KeyType key, ValueType newValue);
 
-// delete key from inode, does not remove it,
-// just reset the value to indicate this entry has been deleted.
-// use MAX uint64_t as the indicator.
-// THUS: only use update function to do this instead of a new function.
+// BRIEF: with USE_TRUE_DELETE the slot of key is freed and reused, otherwise
+//        the value is reset to MAX_VALUE, which marks a deleted key.
 // RETURN the old value if exist.
-uint64_t Delete(PHAST *list, uint64_t key);
+ValueType Delete(PHAST *list, KeyType key);
 
 // lock-free version.
-int Range_Search(PHAST *list, uint64_t start_key, int num, uint64_t *buf);
+int Range_Search(PHAST *list, KeyType start_key, int num, ValueType *buf);
+
+#ifdef USE_VAR_KEY
+// string keys are ordered by memcmp, a shorter key goes first on ties.
+// an instance holds either uint64_t keys or string keys, not both.
+
+// REQUIRES: value is not 0.
+// BRIEF: the value is replaced if key exists.
+// RETURN: true if succeeded. otherwise false.
+bool Insert(PHAST *list, const char *key, size_t len, uint64_t value);
+
+// RETURN: value if succeeded. otherwise 0.
+uint64_t Search(PHAST *list, const char *key, size_t len);
+
+// RETURN the old value if exist.
+uint64_t Update(PHAST *list, const char *key, size_t len, uint64_t newValue);
+
+// BRIEF: with USE_TRUE_DELETE the value of key is taken first, so the
+//        concurrent updates of key fail and the inserts link a new record,
+//        then the record is unlinked and freed, the slot of its prefix too
+//        once no key is left there. otherwise the
+//        value is reset to MAX_VALUE, which marks a deleted key.
+// RETURN the old value if exist.
+uint64_t Delete(PHAST *list, const char *key, size_t len);
+
+// BRIEF: the values of the first num keys not less than start_key, in key order.
+// RETURN: the number of values in buf.
+int Range_Search(PHAST *list, const char *start_key, size_t len, int num, uint64_t *buf);
+
+// RETURN: the order-preserving 8-byte prefix of key, never 0.
+uint64_t var_key_prefix(const char *key, size_t len);
+#endif
+
+#ifdef USE_VALUE_HEAP
+// values of any length are copied into the value heap of the key's pool,
+// the entry value points to the copy.
+// an instance holds either 8-byte values or heap values, not both.
+
+// REQUIRES: key is not 0.
+// RETURN: true if succeeded. otherwise false.
+bool Insert_Value(PHAST *list, KeyType key, const void *value, size_t len);
+
+// REQUIRES: hold EpochGuard(list->epoch) until the view is no longer used.
+// BRIEF: view points to the value in PM, no copy.
+// RETURN: true if found. otherwise false.
+bool Search_Value(PHAST *list, KeyType key, ValueView *view);
+
+// BRIEF: the old value is freed after the readers holding it have left.
+// RETURN: true if key exists.
+bool Update_Value(PHAST *list, KeyType key, const void *value, size_t len);
+
+// BRIEF: same as Delete, and free the value as Update_Value does.
+// RETURN: true if key exists.
+bool Delete_Value(PHAST *list, KeyType key);
+#endif
+
+#ifdef USE_ADAPTIVE_PARTITION
+// BRIEF: split hot or oversized partitions and merge cold neighbours which
+//        are small against the mean partition. a partition is hot by its
+//        inner node splits since the last call, the maintenance thread calls
+//        it every PARTITION_REBALANCE_MS. thread safe, runs concurrently with
+//        the other operations.
+// RETURN: the number of partitions after rebalance.
+int rebalance_partitions(PHAST *list);
+#endif
+
+#ifdef USE_INODE_MERGE
+// BRIEF: merge the adjacent inner nodes holding at most ISN_MERGE_TH leaf
+//        nodes in total. thread safe, runs concurrently with the other operations.
+// RETURN: the number of merges.
+int merge_inner_nodes(PHAST *list);
+#endif
+
+#ifdef USE_LEAF_MERGE
+// BRIEF: merge the adjacent leaf nodes of an inner node holding at most
+//        LEAF_MERGE_TH entries in total, the freed ones are reused by the
+//        splits. thread safe, runs concurrently with the other operations.
+// RETURN: the number of merges.
+int merge_leaf_nodes(PHAST *list);
+#endif
+
+#ifdef USE_TOWER_REBALANCE
+// BRIEF: rebuild the towers of the heads whose level histogram is far from
+//        the geometric one. thread safe, never blocks the readers.
+// RETURN: the number of heads rebuilt.
+int rebalance_towers(PHAST *list);
+
+// BRIEF: run rebalance_towers (and merge_leaf_nodes, merge_inner_nodes) every MAINTAIN_INTERVAL_MS
+//        and rebalance_partitions every PARTITION_REBALANCE_MS in a background
+//        thread until stop_maintenance or dram_free.
+void start_maintenance(PHAST *list);
+
+void stop_maintenance(PHAST *list);
+#endif
+
+// BRIEF: the persists of each kind of operation since the last
+//        clear_persist_stats(), summed over the threads and the instances of
+//        the process. all 0 without USE_PERSIST_STATS.
+void get_persist_stats(PersistStats stats[PERSIST_OP_NUM]);
+
+void clear_persist_stats();
+
+// BRIEF: add the persists of op, or of all kinds if op is PERSIST_OP_NUM, to
+//        counters: the cache lines to CFLUSH_NUM, the bytes to CFLUSH_SIZE and
+//        the fences to MFENCE_NUM.
+void add_persist_stats(CounterSet *counters, PersistOp op = PERSIST_OP_NUM);
 
 ////////////////////////////////////
 
+// RETURN: the index of the partition whose range covers key.
+int find_partition(const PMAP *map, KeyType key);
+
+#ifdef USE_ADAPTIVE_PARTITION
+// REQUIRES: hold list's resize_lock.
+// RETURN: true if partition idx has been split into two.
+bool split_partition(PHAST *list, int idx);
+
+// REQUIRES: hold list's resize_lock.
+// BRIEF: merge partition idx + 1 into partition idx.
+// RETURN: true if succeeded. false if they are in different pools or the
+//         root transaction does not fit in the pool's log.
+bool merge_partitions(PHAST *list, int idx);
+#endif
+
 // BRIEF: search key in skiplist and return the target inner node with
 //        pre_nodes which is previous to the returned node in the search
 //        path for the new inserted nodes's pre nodes, similarly next_nodes.
 // RETURN: header node if the inner_list is empty, otherwise the target node.
-ISN *SearchList(ISL *inner_list, uint64_t key, ISN *pre_nodes[], ISN *next_nodes[]);
+ISN *SearchList(ISL *inner_list, KeyType key, ISN *pre_nodes[], ISN *next_nodes[]);
 
 // BRIEF: same as previous one, but do not record the pre/next-nodes.
-ISN *SearchList(ISL *inner_list, uint64_t key, uint64_t *target_maxkey, bool lock = false);
+ISN *SearchList(ISL *inner_list, KeyType key, KeyType *target_maxkey, bool lock = false);
 
 // BRIEF: the key is belong to a new inner node, this function is to find
 //        the previous and next node according this key and the level.
-void FindUpdateNodeForLevel(uint64_t key, int level,
+void FindUpdateNodeForLevel(KeyType key, int level,
                             ISN **pre_node, ISN **next_node);
 
 // REQUIRES: hold inode's read lock that make sure no split in accessing.
 // RETURN: 0 if succeeded. +1 if need get the target inode again. -1 if failed.
-int InsertIntoINode(ISN *inode, uint64_t key, uint64_t value,
+int InsertIntoINode(PHAST *list, ISN *inode, KeyType key, ValueType value,
                     ISN *pre_nodes[], ISN *next_nodes[]);
 
 // BRIEF: used to install a new inner node / leaf block.
@@ -159,11 +614,13 @@ void InstallNewInnerNode(ISN *old_in, ISN *new_in,
 // REQUIRES: hold inode's read lock that make sure no split in accessing.
 // BRIEF: thread safe if hold read lock.
 // RETURN: the target value. 0 if not found.
-uint64_t SearchINode(ISN *inode, uint64_t key);
+ValueType SearchINode(ISN *inode, KeyType key);
 
-bool TryToGetWriteLock(ISN *inode, const bool is_split);
+bool TryToGetWriteLock(ISN *inode);
 
-int randomLevel();
+// RETURN: the level of the rank-th (from 1) inner node of a partition in a
+//         balanced list, the times SPAN_TH + 1 divides rank.
+int tower_level(uint64_t rank);
 
 void free_inner_list(PHAST *list);
 
@@ -171,19 +628,24 @@ void nv_free(PHAST *list);
 
 int find_zero_bit(uint64_t x, uint16_t size);
 
-void update_agg_keys(ISN *head, const int head_idx);
+void update_agg_keys(ISL *inner_list, ISN *head);
+
+void insert_agg_key(ISL *inner_list, ISN *head, ISN *node);
+
+void remove_agg_key(ISN *head, ISN *node);
 
-ISN *find_in_agg_keys(ISN *head, const uint64_t key, uint64_t *target_maxkey);
+ISN *find_in_agg_keys(ISN *head, const KeyType key, KeyType *target_maxkey);
 
-void print_list_all(PHAST *list, uint64_t key);
+void print_list_all(PHAST *list, KeyType key);
 void print_list_all(PHAST *list);
 void print_list_all(ISN *header);
 void print_inode_and_next(ISN *node);
 void print_lnode_all(LSG *node);
-void print_lnode_all(LSG *node, uint64_t maxkey, const uint64_t bitmap);
+void print_lnode_all(LSG *node, KeyType maxkey, const uint64_t bitmap);
 void print_lnode_and_next(LSG *node);
 void print_list_skeleton(PHAST *list);
 void print_list_skeleton(ISN *header);
+void print_partitions(PHAST *list);
 void print_mem_nvm_comsumption(PHAST *list);
 
 static void for_debug()
@@ -191,28 +653,106 @@ static void for_debug()
     sleep(1);
 }
 
+// BRIEF: lower bound over the ascending keys[0, n).
+// RETURN: the number of keys less than key, n if key is larger than all.
+template <typename K>
+using KeyLowerBound = int (*)(const K *keys, int n, K key);
+typedef KeyLowerBound<KeyType> LowerBoundFunc;
+template <typename K>
+int lower_bound_scalar(const K *keys, int n, K key);
+#ifdef USE_SIMD_SEARCH
+// REQUIRES: the cpu supports the instruction set, K is 32 or 64 bits.
+template <typename K>
+int lower_bound_avx2(const K *keys, int n, K key);
+template <typename K>
+int lower_bound_avx512(const K *keys, int n, K key);
+#endif
+// RETURN: the fastest kernel over K supported by the cpu.
+template <typename K>
+KeyLowerBound<K> pick_lower_bound();
+// the kernel of each key type, picked at startup.
+template <typename K>
+KeyLowerBound<K> key_lower_bound_of = pick_lower_bound<K>();
+extern LowerBoundFunc &key_lower_bound;
+
+#ifdef USE_SEARCH_TRACE
+// called with each inner node field the walk of Search reads, if not NULL.
+// the keys are read through key_lower_bound, wrap it to see them too.
+extern void (*search_trace)(const void *addr);
+#endif
+
+// RETURN: the fingerprint of key kept in the leaf groups, it depends on the
+//         value of key only, not on the width of K.
+template <typename K>
+uint8_t f_hash(K key);
+
+// BRIEF: the slots of lfnode set in bitmap whose fingerprint is fp.
+// RETURN: a bitmap of the candidate slots.
+template <typename K, typename V>
+using LeafProbe = uint64_t (*)(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap);
+typedef LeafProbe<KeyType, ValueType> ProbeFunc;
+template <typename K, typename V>
+uint64_t probe_scalar(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap);
+#ifdef USE_SIMD_PROBE
+// REQUIRES: the cpu supports the instruction set.
+template <typename K, typename V>
+uint64_t probe_avx2(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap);
+template <typename K, typename V>
+uint64_t probe_avx512(const LeafSkipGroupT<K, V> *lfnode, uint8_t fp, uint64_t bitmap);
+#endif
+// RETURN: the fastest kernel supported by the cpu.
+template <typename K, typename V>
+LeafProbe<K, V> pick_probe();
+// the kernel of each layout, picked at startup.
+template <typename K, typename V>
+LeafProbe<K, V> fp_probe_of = pick_probe<K, V>();
+extern ProbeFunc &fp_probe;
+
 #ifdef USE_AGG_KEYS
-// BRIEF: cannot be modified after construct.
+// BRIEF: the nodes of level AGG_UPDATE_LEVEL of a head in a gapped sorted
+//        array. a gap holds a copy of the slot on its left, (0, NULL) if
+//        none, so the array stays sorted and a lower bound never stops at
+//        a gap. a node is put into a nearby gap, the writers hold lock and
+//        the readers check version instead of locking.
 class AGGIndex
 {
 public:
-    // REQUIRES: num must be larger than the number of expected nodes in this head.
+    // REQUIRES: the slots are at least num.
     AGGIndex(ISN *head, const size_t num)
-        : agg_cap(num),
-          agg_num(0)
+        : agg_num(0),
+          version(0)
     {
         assert(head->is_head);
-        agg_keys.reserve(agg_cap);
-        agg_nodes.reserve(agg_cap);
+        std::vector<KeyType> keys;
+        std::vector<ISN *> nodes;
         ISN *cursor = head->next[AGG_UPDATE_LEVEL];
-
         while (cursor != NULL && !cursor->is_head)
         {
-            agg_keys.push_back(cursor->max_key);
-            agg_nodes.push_back(cursor);
-            agg_num++;
+            keys.push_back(cursor->max_key);
+            nodes.push_back(cursor);
             cursor = cursor->next[AGG_UPDATE_LEVEL];
         }
+
+        // spread the nodes evenly, the slots between them are gaps.
+        agg_num = nodes.size();
+        agg_cap = std::max(num, agg_num * AGG_GAP_RATIO);
+        agg_keys.assign(agg_cap, 0);
+        agg_nodes.assign(agg_cap, NULL);
+        size_t pos = 0;
+        for (size_t i = 0; i < agg_num; ++i)
+        {
+            const size_t end = (i + 1) * agg_cap / agg_num;
+            for (; pos < end; ++pos)
+            {
+                agg_keys[pos] = keys[i];
+                agg_nodes[pos] = nodes[i];
+            }
+        }
+#ifdef USE_AGG_MODEL
+        // never reallocated, the readers may read it while it is trained.
+        segments.resize(agg_cap);
+        Train();
+#endif
     }
 
     ~AGGIndex()
@@ -221,6 +761,7 @@ public:
         agg_nodes.clear();
     }
 
+    // RETURN: the slots of the index rebuilt from this one.
     inline size_t NewSize() const
     {
         return (agg_num + AGG_REDUNDANT_SPACE > agg_cap) ? (agg_cap * 2) : (agg_cap);
@@ -228,91 +769,252 @@ public:
 
     inline size_t Cap() const { return agg_cap; }
 
-    // BRIEF: thread safe.
-    // RETURN: return a inner node according the gaven key.
-    //         NULL if failed.
-    ISN *Find(const uint64_t key, uint64_t *target_maxkey, bool debug_info = false) const
+    // BRIEF: thread safe, never blocks.
+    // RETURN: the last node whose key < key, NULL if none or a writer is
+    //         changing the index, the caller starts from the head then.
+    ISN *Find(const KeyType key, KeyType *target_maxkey, bool debug_info = false) const
     {
-        // binary search.
-        int low = 0, high = agg_num, mid = 0;
-        while (low < high)
+        const uint64_t v = __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+        if (v & 1)
+            return NULL;
+        int mid = key_lower_bound(agg_keys.data(), agg_cap, key);
+        assert(mid <= (int)agg_cap);
+        --mid;
+        if (mid < 0)
+            return NULL;
+        const KeyType found_key = agg_keys[mid];
+        ISN *node = agg_nodes[mid];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&version, __ATOMIC_RELAXED) != v)
+            return NULL;
+        *target_maxkey = found_key;
+        return node;
+    }
+
+#ifdef USE_AGG_MODEL
+    // BRIEF: Find by the model, thread safe, never blocks.
+    ISN *ModelFind(const KeyType key, KeyType *target_maxkey) const
+    {
+        const uint64_t v = __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+        if (v & 1)
+            return NULL;
+        int mid = ModelLowerBound(key);
+        --mid;
+        if (mid < 0)
+            return NULL;
+        const KeyType found_key = agg_keys[mid];
+        ISN *node = agg_nodes[mid];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&version, __ATOMIC_RELAXED) != v)
+            return NULL;
+        *target_maxkey = found_key;
+        return node;
+    }
+#endif
+
+    // REQUIRES: hold lock.
+    // BRIEF: put node into the gap next to its position, shift the slots
+    //        up to the nearest gap if there is none.
+    // RETURN: false if the index is too full, rebuild it.
+    bool Insert(ISN *node)
+    {
+        const KeyType key = node->max_key;
+        if (agg_num + AGG_REDUNDANT_SPACE > agg_cap)
+            return false;
+        int pos = key_lower_bound(agg_keys.data(), agg_cap, key);
+        for (int i = pos; i < (int)agg_cap && agg_keys[i] == key; ++i)
         {
-            if (key <= agg_keys[low])
-            {
-                break;
-            }
-            mid = (low + high) / 2;
-            // if (debug_info) fprintf(stderr, "key: %lu; low: %d; mid: %d; hig: %d; %lu, %lu, %lu\n",
-            //                         key, low, mid, high, agg_keys[low], agg_keys[mid], agg_keys[high]);
-            if (agg_keys[mid] > key)
+            if (agg_nodes[i] == node)
+                return true; // a rebuild has taken it.
+        }
+
+        int to = -1, gap = -1;
+        if (pos > 0 && IsGap(pos - 1))
+        {
+            to = pos - 1;
+        }
+        else
+        {
+            for (int i = pos; i < (int)agg_cap; ++i)
             {
-                high = mid;
+                if (IsGap(i))
+                {
+                    gap = i;
+                    break;
+                }
             }
-            else if (agg_keys[mid] < key)
+            if (gap >= 0)
             {
-                low = mid + 1;
+                to = pos; // shift [pos, gap) to the right.
             }
             else
             {
-                break;
+                for (int i = pos - 2; i >= 0; --i)
+                {
+                    if (IsGap(i))
+                    {
+                        gap = i;
+                        break;
+                    }
+                }
+                if (gap < 0)
+                    return false;
+                to = pos - 1; // shift (gap, pos) to the left.
             }
         }
-        if (low > mid)
+
+        BeginWrite();
+        if (gap > to)
         {
-            mid = low;
+            memmove(&agg_keys[to + 1], &agg_keys[to], sizeof(KeyType) * (gap - to));
+            memmove(&agg_nodes[to + 1], &agg_nodes[to], sizeof(ISN *) * (gap - to));
         }
-        assert(mid <= agg_num);
-        --mid;
-        if (mid < 0)
-            return NULL;
-        *target_maxkey = agg_keys[mid];
-        // if (agg_nodes[mid] == NULL) {
-        //     for_debug();
-        //     if (debug_info) exit(1);
-        //     fprintf(stderr, "%lu; %lu; %lu; %lu; %lu; %lu\n", key, agg_num, mid, agg_keys[mid-1], agg_keys[mid], agg_keys[mid+1]);
-        //     fprintf(stderr, "%p; %p; %p\n", agg_nodes[mid-1], agg_nodes[mid], agg_nodes[mid+1]);
-        //     for (size_t x = 0; x < agg_keys.size(); ++x) {
-        //         fprintf(stderr, "%d: %lu\n", x, agg_keys[x]);
-        //     }
-        //     fprintf(stderr, "\n");
-        //     this->Find(key, target_maxkey, true);
-        //     exit(1);
-        // }
-        return agg_nodes[mid];
+        else if (gap >= 0)
+        {
+            memmove(&agg_keys[gap], &agg_keys[gap + 1], sizeof(KeyType) * (to - gap));
+            memmove(&agg_nodes[gap], &agg_nodes[gap + 1], sizeof(ISN *) * (to - gap));
+        }
+        agg_keys[to] = key;
+        agg_nodes[to] = node;
+        ++agg_num;
+#ifdef USE_AGG_MODEL
+        if (++model_drift > AGG_MODEL_RETRAIN)
+            Train();
+#endif
+        EndWrite();
+        return true;
     }
 
-    // seq search.
-    ISN *SeqFind(const uint64_t key, uint64_t *target_maxkey, bool debug_info = false) const
+    // REQUIRES: hold lock, node has been unlinked from AGG_UPDATE_LEVEL.
+    // BRIEF: turn the slots of node into gaps.
+    void Remove(ISN *node)
     {
-        const size_t max = agg_num;
-        size_t i = 0;
-        if (max == 0)
-            return NULL;
-        for (i = 0; i < max; ++i)
+        // the key of node is not less than its max key.
+        int pos = key_lower_bound(agg_keys.data(), agg_cap, node->max_key);
+        ISN *left = (pos > 0) ? agg_nodes[pos - 1] : NULL; // before the change.
+        BeginWrite();
+        for (int i = pos; i < (int)agg_cap; ++i)
         {
-            if (key <= agg_keys[i])
+            ISN *cur = agg_nodes[i];
+            if (cur == node)
             {
-                break;
+                if (left != node)
+                    --agg_num; // the copies of node are gaps.
+                agg_keys[i] = (i > 0) ? agg_keys[i - 1] : 0;
+                agg_nodes[i] = (i > 0) ? agg_nodes[i - 1] : NULL;
             }
+            left = cur;
         }
+        EndWrite();
+    }
 
-        assert(i <= max);
-        if (i == 0)
+private:
+    inline bool IsGap(int i) const
+    {
+        return agg_nodes[i] == NULL || (i > 0 && agg_nodes[i] == agg_nodes[i - 1]);
+    }
+
+#ifdef USE_AGG_MODEL
+    // BRIEF: fit the slots of the nodes by the fewest segments within
+    //        AGG_MODEL_EPSILON, a segment is closed when no line through its
+    //        first point can cover the next one (shrinking cone).
+    void Train()
+    {
+        n_segments = 0;
+        model_drift = 0;
+        if (agg_num < AGG_MODEL_MIN_NODES)
+            return;
+        int i = 0;
+        while (i < (int)agg_cap && agg_nodes[i] == NULL)
+            ++i; // the gaps in front.
+        if (i == (int)agg_cap)
+            return;
+        Segment seg = {agg_keys[i], 0, i};
+        double lo = 0, hi = HUGE_VAL;
+        for (int j = i + 1; j < (int)agg_cap; ++j)
         {
-            return NULL;
+            if (IsGap(j) || agg_keys[j] == seg.first)
+                continue;
+            const double dx = (double)(agg_keys[j] - seg.first);
+            const double dy = j - seg.pos;
+            const double s_lo = (dy - AGG_MODEL_EPSILON) / dx, s_hi = (dy + AGG_MODEL_EPSILON) / dx;
+            if (s_lo > hi || s_hi < lo)
+            {
+                seg.slope = (hi == HUGE_VAL) ? lo : (lo + hi) / 2;
+                segments[n_segments++] = seg;
+                seg = {agg_keys[j], 0, j};
+                lo = 0;
+                hi = HUGE_VAL;
+                continue;
+            }
+            lo = std::max(lo, s_lo);
+            hi = std::min(hi, s_hi);
         }
-        else
+        seg.slope = (hi == HUGE_VAL) ? lo : (lo + hi) / 2;
+        segments[n_segments++] = seg;
+    }
+
+    // RETURN: the first slot whose key >= key, agg_cap if none. the slots
+    //         around the predicted one are searched, all if they miss.
+    int ModelLowerBound(const KeyType key) const
+    {
+        const int n = __atomic_load_n(&n_segments, __ATOMIC_RELAXED);
+        if (n == 0)
+            return key_lower_bound(agg_keys.data(), agg_cap, key);
+        int s = 0, e = n;
+        while (e - s > 1)
+        {
+            const int m = (s + e) / 2;
+            if (segments[m].first <= key)
+                s = m;
+            else
+                e = m;
+        }
+        const Segment &seg = segments[s];
+        int pred = seg.pos;
+        if (key > seg.first)
         {
-            --i;
+            const double p = seg.pos + seg.slope * (double)(key - seg.first);
+            pred = (p < (double)agg_cap) ? (int)p : (int)agg_cap;
         }
-        *target_maxkey = agg_keys[i];
-        return agg_nodes[i];
+        const int err = AGG_MODEL_EPSILON + model_drift + 1;
+        const int lo = std::max(pred - err, 0), hi = std::min(pred + err + 1, (int)agg_cap);
+        if ((lo == 0 || agg_keys[lo - 1] < key) && (hi == (int)agg_cap || agg_keys[hi] >= key))
+        {
+            return lo + key_lower_bound(agg_keys.data() + lo, hi - lo, key);
+        }
+        return key_lower_bound(agg_keys.data(), agg_cap, key);
+    }
+#endif
+
+    inline void BeginWrite()
+    {
+        __atomic_store_n(&version, version + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    inline void EndWrite()
+    {
+        __atomic_store_n(&version, version + 1, __ATOMIC_RELEASE);
     }
 
 public:
-    const size_t agg_cap;           // capacity of this array.
-    size_t agg_num;                 // number of keys in the array.
-    std::vector<uint64_t> agg_keys; // agg keys
+    size_t agg_cap;                 // capacity of this array.
+    size_t agg_num;                 // number of nodes in the array, the other slots are gaps.
+    uint64_t version;               // odd while a writer is changing the array.
+    EXMutex lock;                   // serializes the writers, and the rebuild that replaces this index.
+    std::vector<KeyType> agg_keys;  // agg keys
     std::vector<ISN *> agg_nodes;   // corresponding inner nodes
+#ifdef USE_AGG_MODEL
+    struct Segment
+    {
+        KeyType first; // the key of the first node in the segment.
+        double slope;  // slots per key.
+        int pos;       // the slot of the first node.
+    };
+    std::vector<Segment> segments; // ascending by first, sized agg_cap.
+    int n_segments = 0;
+    int model_drift = 0;           // insertions since the model was trained.
+#endif
 };
 #endif
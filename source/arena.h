@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "port_posix.h"
+#include "epoch.h" // thread_slot_id()
+
+#define ARENA_CHUNK_SIZE (2ULL << 20) // one huge page.
+
+// BRIEF: fixed size objects carved from 2MB chunks, backed by huge pages
+//        if the system allows. each thread carves from its own chunk, a
+//        freed object is reused by the next Alloc, all chunks are released
+//        with the arena.
+class Arena {
+  public:
+	// REQUIRES: obj_size <= ARENA_CHUNK_SIZE.
+	explicit Arena(size_t obj_size) : obj_size_((obj_size + 63) / 64 * 64), free_(NULL) {
+		for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+			cursors_[i].pos = NULL;
+			cursors_[i].end = NULL;
+		}
+	}
+
+	// No copying allowed
+	Arena(const Arena&) = delete;
+	void operator=(const Arena&) = delete;
+
+	~Arena() {
+		for (size_t i = 0; i < chunks_.size(); ++i) {
+			munmap(chunks_[i], ARENA_CHUNK_SIZE);
+		}
+	}
+
+	// RETURN: a 64-byte aligned object filled by 0, NULL if out of memory.
+	void *Alloc() {
+		if (__atomic_load_n(&free_, __ATOMIC_RELAXED) != NULL) {
+			lock_.Lock();
+			void *obj = free_;
+			if (obj != NULL) {
+				free_ = *(void **)obj;
+			}
+			lock_.Unlock();
+			if (obj != NULL) {
+				memset(obj, 0, obj_size_);
+				return obj;
+			}
+		}
+		Cursor &c = cursors_[thread_slot_id()];
+		if ((size_t)(c.end - c.pos) < obj_size_) {
+			char *chunk = NewChunk();
+			if (chunk == NULL) {
+				return NULL;
+			}
+			c.pos = chunk;
+			c.end = chunk + ARENA_CHUNK_SIZE;
+		}
+		void *obj = c.pos;
+		c.pos += obj_size_;
+		return obj;
+	}
+
+	// REQUIRES: obj is from Alloc and no thread can reach it.
+	void Free(void *obj) {
+		lock_.Lock();
+		*(void **)obj = free_;
+		free_ = obj;
+		lock_.Unlock();
+	}
+
+	// RETURN: the bytes of the chunks.
+	size_t Bytes() {
+		lock_.Lock();
+		size_t bytes = chunks_.size() * ARENA_CHUNK_SIZE;
+		lock_.Unlock();
+		return bytes;
+	}
+
+  private:
+	char *NewChunk() {
+		void *chunk = mmap(NULL, ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (chunk == MAP_FAILED) {
+			// no reserved huge pages, align the chunk for transparent huge pages.
+			char *raw = (char *)mmap(NULL, 2 * ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+									 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (raw == (char *)MAP_FAILED) {
+				return NULL;
+			}
+			char *aligned = (char *)(((uintptr_t)raw + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+			if (aligned > raw) {
+				munmap(raw, aligned - raw);
+			}
+			if (aligned + ARENA_CHUNK_SIZE < raw + 2 * ARENA_CHUNK_SIZE) {
+				munmap(aligned + ARENA_CHUNK_SIZE, raw + ARENA_CHUNK_SIZE - aligned);
+			}
+			madvise(aligned, ARENA_CHUNK_SIZE, MADV_HUGEPAGE);
+			chunk = aligned;
+		}
+		lock_.Lock();
+		chunks_.push_back(chunk);
+		lock_.Unlock();
+		return (char *)chunk;
+	}
+
+	struct alignas(64) Cursor {
+		char *pos;
+		char *end;
+	};
+
+	const size_t obj_size_;
+	Cursor cursors_[MAX_THREAD_NUM];
+	EXMutex lock_;                 // guards chunks_ and free_.
+	std::vector<void *> chunks_;
+	void *free_;                   // the freed objects, linked by their first word.
+};
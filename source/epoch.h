@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+#include <deque>
+#include <vector>
+
+#include "port_posix.h"
+
+#define MAX_THREAD_NUM 256   // the max number of threads using an instance at the same time.
+#define EPOCH_RECLAIM_TH 64  // try to reclaim after this many objects are retired.
+
+// RETURN: a small id of the calling thread, reused after the thread exits.
+int thread_slot_id();
+
+// BRIEF: epoch based reclamation. a reader pins the current epoch while it
+//        may hold pointers to shared objects, an unlinked object is freed
+//        once every reader pinned before its retire has left.
+class EpochManager {
+  public:
+	typedef void (*FreeFunc)(void *arg, void *ptr);
+
+	EpochManager() : global_epoch_(1), n_new_retired_(0) {
+		for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+			slots_[i].local_epoch = 0;
+			slots_[i].nest = 0;
+		}
+	}
+
+	// No copying allowed
+	EpochManager(const EpochManager&) = delete;
+	void operator=(const EpochManager&) = delete;
+
+	// REQUIRES: no reader is left.
+	~EpochManager() {
+		for (auto &r : retired_) {
+			r.func(r.arg, r.ptr);
+		}
+	}
+
+	// BRIEF: pin the current epoch, can be nested.
+	void Enter() {
+		Slot &s = slots_[thread_slot_id()];
+		if (s.nest++ == 0) {
+			// seq_cst pairs with the scan in TryReclaim.
+			__atomic_store_n(&s.local_epoch, __atomic_load_n(&global_epoch_, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		}
+	}
+
+	void Exit() {
+		Slot &s = slots_[thread_slot_id()];
+		assert(s.nest > 0);
+		if (--s.nest == 0) {
+			__atomic_store_n(&s.local_epoch, 0, __ATOMIC_RELEASE);
+		}
+	}
+
+	// REQUIRES: ptr is unreachable for the readers coming later.
+	// BRIEF: func(arg, ptr) is called when no reader can hold ptr. the
+	//        objects of all the threads are freed in the order of retire.
+	void Retire(void *ptr, FreeFunc func, void *arg) {
+		retired_lock_.Lock();
+		retired_.push_back({__atomic_load_n(&global_epoch_, __ATOMIC_SEQ_CST), ptr, func, arg});
+		bool reclaim = ++n_new_retired_ >= EPOCH_RECLAIM_TH;
+		retired_lock_.Unlock();
+		if (reclaim) {
+			TryReclaim();
+		}
+	}
+
+	// BRIEF: free the retired objects that no reader can hold, whichever
+	//        thread retired them. skipped if another thread is reclaiming.
+	void TryReclaim() {
+		if (!reclaim_lock_.TryLock()) {
+			return;
+		}
+		__atomic_add_fetch(&global_epoch_, 1, __ATOMIC_SEQ_CST);
+		uint64_t min_epoch = __atomic_load_n(&global_epoch_, __ATOMIC_SEQ_CST);
+		for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+			uint64_t e = __atomic_load_n(&slots_[i].local_epoch, __ATOMIC_SEQ_CST);
+			if (e != 0 && e < min_epoch) {
+				min_epoch = e;
+			}
+		}
+
+		// the epochs grow along the list, the freeable ones are a prefix.
+		std::vector<Retired> expired;
+		retired_lock_.Lock();
+		while (!retired_.empty() && retired_.front().epoch < min_epoch) {
+			expired.push_back(retired_.front());
+			retired_.pop_front();
+		}
+		n_new_retired_ = 0;
+		retired_lock_.Unlock();
+
+		// called out of retired_lock_, a func may retire again.
+		for (auto &r : expired) {
+			r.func(r.arg, r.ptr);
+		}
+		reclaim_lock_.Unlock();
+	}
+
+  private:
+	struct Retired {
+		uint64_t epoch;
+		void *ptr;
+		FreeFunc func;
+		void *arg;
+	};
+
+	struct alignas(64) Slot {
+		uint64_t local_epoch;  // 0 if not pinned.
+		int nest;
+	};
+
+	alignas(64) uint64_t global_epoch_;
+	Slot slots_[MAX_THREAD_NUM];
+	EXMutex retired_lock_;  // protects retired_ and n_new_retired_.
+	std::deque<Retired> retired_;
+	size_t n_new_retired_;
+	EXMutex reclaim_lock_;  // one reclaimer at a time, keeps the free order.
+};
+
+// BRIEF: pin the epoch of em in a scope.
+class EpochGuard {
+  public:
+	explicit EpochGuard(EpochManager *em) : em_(em) { em_->Enter(); }
+	~EpochGuard() { em_->Exit(); }
+
+	// No copying allowed
+	EpochGuard(const EpochGuard&) = delete;
+	void operator=(const EpochGuard&) = delete;
+
+  private:
+	EpochManager *em_;
+};
@@ -0,0 +1,590 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include <vector>
+#ifdef USE_PMDK
+#include <libpmemobj.h>
+#endif
+
+#include "port_posix.h"
+
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC 0x80000
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// BRIEF: where the pools of an instance live, picked by PHASTOptions::backend.
+enum PMBackend {
+	PM_BACKEND_PMDK, // a libpmemobj pool, needs USE_PMDK.
+	PM_BACKEND_FILE, // a file mapped at a fixed address with its own allocator, see MappedPool::PersistMode out of DAX.
+	PM_BACKEND_DRAM, // anonymous memory, persist is a no-op and nothing survives the process.
+};
+
+static const char *const PM_BACKEND_NAME[] = {"pmdk", "file", "dram"};
+
+#ifdef USE_PMDK
+#define PM_BACKEND_DEFAULT PM_BACKEND_PMDK
+#else
+#define PM_BACKEND_DEFAULT PM_BACKEND_FILE
+#endif
+
+// BRIEF: if set, the pools call it for each flush they issue, i.e. the cache
+//        lines of [addr, addr + len) written back and a fence. a backend
+//        reports only the flushes it issues itself: the file pool all of them,
+//        its allocator and undo log included, the pmdk pool its
+//        pmemobj_persist calls but not the ones inside libpmemobj, and the
+//        DRAM pool none. set by PHAST.cc under USE_PERSIST_STATS.
+extern void (*pm_flush_hook)(const void *addr, size_t len);
+
+// BRIEF: the allocation, root and persistence of one pool. the objects hold
+//        absolute pointers to each other, so a pool is always mapped at the
+//        same address.
+class PMPool {
+  public:
+	virtual ~PMPool() {}
+
+	// No copying allowed
+	PMPool(const PMPool&) = delete;
+	void operator=(const PMPool&) = delete;
+
+	// RETURN: the root object of size bytes, filled by 0 when the pool is created.
+	virtual void *Root(size_t size) = 0;
+
+	// RETURN: a 64-byte aligned object filled by 0 and persisted, NULL if the pool is full.
+	virtual void *ZAlloc(size_t size) = 0;
+
+	// RETURN: a 64-byte aligned object, NULL if the pool is full.
+	virtual void *Alloc(size_t size) = 0;
+
+	// REQUIRES: obj is from Alloc or ZAlloc of this pool.
+	virtual void Free(void *obj) = 0;
+
+	// BRIEF: [addr, addr + len) is durable when it returns.
+	virtual void Persist(const void *addr, size_t len) = 0;
+
+	// BRIEF: the ranges added between TxBegin and TxEnd are changed atomically,
+	//        a crash before TxEnd returns rolls them back. one transaction at a
+	//        time, a range is added before it is changed.
+	virtual void TxBegin() = 0;
+	// RETURN: false if the range can't be logged, the transaction is then ended by TxAbort.
+	virtual bool TxAdd(const void *addr, size_t len) = 0;
+	virtual void TxEnd() = 0;
+	// BRIEF: roll the added ranges back and end the transaction.
+	virtual void TxAbort() = 0;
+
+	PMBackend backend() const { return backend_; }
+
+  protected:
+	explicit PMPool(PMBackend backend) : backend_(backend) {}
+
+	// BRIEF: report a flush to pm_flush_hook.
+	static void Flushed(const void *addr, size_t len) {
+		if (pm_flush_hook != NULL) {
+			pm_flush_hook(addr, len);
+		}
+	}
+
+  private:
+	const PMBackend backend_;
+};
+
+#ifdef USE_PMDK
+class PMDKPool : public PMPool {
+  public:
+	~PMDKPool() override { pmemobj_close(pop_); }
+
+	// BRIEF: create the pool at path if create and it does not exist, otherwise open it.
+	// RETURN: NULL on failure.
+	static PMPool *Open(const char *path, uint64_t size, bool create) {
+		PMEMobjpool *pop = NULL;
+
+		/* force-disable SDS feature during pool creation*/
+		int sds_write_value = 0;
+		pmemobj_ctl_set(NULL, "sds.at_create", &sds_write_value);
+
+		struct stat buffer;
+		if (create && stat(path, &buffer) != 0) {
+			fprintf(stderr, "create new one.\n");
+			if ((pop = pmemobj_create(path, "PHAST", size, 0666)) == NULL) {
+				perror("failed to create pool.\n");
+				return NULL;
+			}
+		} else {
+			fprintf(stderr, "open existing one.\n");
+			if ((pop = pmemobj_open(path, "PHAST")) == NULL) {
+				perror("failed to open pool.\n");
+				return NULL;
+			}
+		}
+		return new PMDKPool(pop);
+	}
+
+	void *Root(size_t size) override {
+		return pmemobj_direct(pmemobj_root(pop_, size));
+	}
+
+	void *ZAlloc(size_t size) override {
+		PMEMoid oid;
+		if (pmemobj_zalloc(pop_, &oid, size, 0) != 0) {
+			return NULL;
+		}
+		return pmemobj_direct(oid);
+	}
+
+	void *Alloc(size_t size) override {
+		PMEMoid oid;
+		if (pmemobj_alloc(pop_, &oid, size, 0, NULL, NULL) != 0) {
+			return NULL;
+		}
+		return pmemobj_direct(oid);
+	}
+
+	void Free(void *obj) override {
+		PMEMoid oid = pmemobj_oid(obj);
+		pmemobj_free(&oid);
+	}
+
+	void Persist(const void *addr, size_t len) override {
+		pmemobj_persist(pop_, addr, len);
+		Flushed(addr, len);
+	}
+
+	void TxBegin() override {
+		pmemobj_tx_begin(pop_, NULL, TX_PARAM_NONE);
+	}
+
+	bool TxAdd(const void *addr, size_t len) override {
+		return pmemobj_tx_add_range_direct(addr, len) == 0;
+	}
+
+	void TxEnd() override {
+		// a failed TxAdd has aborted the transaction already.
+		if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+			pmemobj_tx_commit();
+		}
+		pmemobj_tx_end();
+	}
+
+	void TxAbort() override {
+		// a failed TxAdd has aborted the transaction already.
+		if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+			pmemobj_tx_abort(ECANCELED);
+		}
+		pmemobj_tx_end();
+	}
+
+  private:
+	explicit PMDKPool(PMEMobjpool *pop) : PMPool(PM_BACKEND_PMDK), pop_(pop) {}
+
+	PMEMobjpool *pop_;
+};
+#endif
+
+#define FILE_POOL_MAGIC 0x314d505453414850ULL // "PHASTPM1", written last when the pool is created.
+#define FILE_POOL_BASE 0x600000000000ULL      // the first address tried for a new pool.
+#define FILE_POOL_HEADER_SIZE 4096
+#define FILE_POOL_LOG_SIZE (1ULL << 20)       // the undo log of the transactions, follows the header.
+#define FILE_POOL_CLASS_NUM 256               // 64B steps up to 1KB, then 8 classes per power of 2.
+#define FILE_POOL_OBJ_HEADER 64               // before each object, keeps the objects 64-byte aligned.
+
+// BRIEF: a pool mapped from a file at the address it was created at. the
+//        objects come from size classes, each with a free list chained
+//        through the object headers, and from the never used space above
+//        top, which is zero. an object taken but not linked by the caller
+//        before a crash is leaked. if the file is on DAX, the persists flush
+//        the cache lines, otherwise PMEM_IS_PMEM_FORCE picks how, see PersistMode.
+class MappedPool : public PMPool {
+  public:
+	~MappedPool() override {
+		munmap(base_, size_);
+		if (fd_ >= 0) {
+			close(fd_);
+		}
+	}
+
+	// BRIEF: create the pool at path with size bytes if create and it does
+	//        not exist, otherwise open it and roll back its transaction.
+	// RETURN: NULL on failure.
+	static PMPool *Open(const char *path, uint64_t size, bool create) {
+		struct stat buffer;
+		if (create && stat(path, &buffer) != 0) {
+			fprintf(stderr, "create new one.\n");
+			return Create(path, size);
+		}
+
+		fprintf(stderr, "open existing one.\n");
+		int fd = open(path, O_RDWR);
+		if (fd < 0) {
+			perror("failed to open pool.\n");
+			return NULL;
+		}
+		Header header;
+		if (pread(fd, &header, sizeof(Header), 0) != sizeof(Header) || header.magic != FILE_POOL_MAGIC) {
+			fprintf(stderr, "%s is not a pool.\n", path);
+			close(fd);
+			return NULL;
+		}
+		bool is_pmem = false;
+		char *base = Map(fd, (char *)header.base, header.size, &is_pmem);
+		if (base == NULL) {
+			fprintf(stderr, "failed to map pool %s at %p.\n", path, (void *)header.base);
+			close(fd);
+			return NULL;
+		}
+		if (!PersistMode(path, &is_pmem)) {
+			munmap(base, header.size);
+			close(fd);
+			return NULL;
+		}
+		MappedPool *pool = new MappedPool(PM_BACKEND_FILE, fd, base, header.size, is_pmem);
+		pool->Rollback();
+		return pool;
+	}
+
+	void *Root(size_t size) override {
+		lock_.Lock();
+		if (header_->root == 0) {
+			const size_t cs = (size + 63) / 64 * 64;
+			if (header_->top + cs > size_) {
+				lock_.Unlock();
+				return NULL;
+			}
+			const uint64_t root = header_->top;
+			header_->top += cs;
+			Persist(&(header_->top), sizeof(uint64_t));
+			header_->root = root;
+			Persist(&(header_->root), sizeof(uint64_t));
+		}
+		lock_.Unlock();
+		return base_ + header_->root;
+	}
+
+	void *ZAlloc(size_t size) override {
+		bool fresh = false;
+		char *obj = Take(size, &fresh);
+		if (obj != NULL && !fresh) {
+			memset(obj, 0, size);
+			Persist(obj, size);
+		}
+		return obj;
+	}
+
+	void *Alloc(size_t size) override {
+		bool fresh = false;
+		return Take(size, &fresh);
+	}
+
+	void Free(void *obj) override {
+		ObjHeader *h = (ObjHeader *)((char *)obj - FILE_POOL_OBJ_HEADER);
+		uint64_t *head = &(header_->free_lists[h->size_class]);
+		lock_.Lock();
+		h->next = *head;
+		Persist(&(h->next), sizeof(uint64_t));
+		*head = (char *)h - base_;
+		Persist(head, sizeof(uint64_t));
+		lock_.Unlock();
+	}
+
+	void Persist(const void *addr, size_t len) override {
+		if (is_pmem_) {
+			for (uintptr_t line = (uintptr_t)addr & ~63ULL; line < (uintptr_t)addr + len; line += 64) {
+#if defined(__CLWB__)
+				_mm_clwb((void *)line);
+#elif defined(__CLFLUSHOPT__)
+				_mm_clflushopt((void *)line);
+#else
+				_mm_clflush((void *)line);
+#endif
+			}
+			_mm_sfence();
+			Flushed(addr, len);
+		} else {
+			const uintptr_t page = (uintptr_t)addr & ~4095ULL;
+			msync((void *)page, (uintptr_t)addr + len - page, MS_SYNC);
+			Flushed((void *)page, (uintptr_t)addr + len - page);
+		}
+	}
+
+	void TxBegin() override {
+		tx_lock_.Lock();
+		log_used_ = 0;
+		tx_ranges_.clear();
+	}
+
+	bool TxAdd(const void *addr, size_t len) override {
+		const size_t entry_size = sizeof(LogEntry) + (len + 7) / 8 * 8;
+		if (log_used_ + entry_size > FILE_POOL_LOG_SIZE) {
+			return false;
+		}
+		LogEntry *entry = (LogEntry *)(log_ + log_used_);
+		entry->off = (const char *)addr - base_;
+		entry->len = len;
+		memcpy(entry + 1, addr, len);
+		Persist(entry, sizeof(LogEntry) + len);
+		header_->log_num++;
+		Persist(&(header_->log_num), sizeof(uint64_t));
+		log_used_ += entry_size;
+		tx_ranges_.push_back({addr, len});
+		return true;
+	}
+
+	void TxEnd() override {
+		for (auto &range : tx_ranges_) {
+			Persist(range.first, range.second);
+		}
+		header_->log_num = 0;
+		Persist(&(header_->log_num), sizeof(uint64_t));
+		tx_lock_.Unlock();
+	}
+
+	void TxAbort() override {
+		Rollback();
+		tx_lock_.Unlock();
+	}
+
+  protected:
+	MappedPool(PMBackend backend, int fd, char *base, uint64_t size, bool is_pmem)
+		: PMPool(backend), fd_(fd), base_(base), size_(size), is_pmem_(is_pmem),
+		  header_((Header *)base), log_(base + FILE_POOL_HEADER_SIZE), log_used_(0) {}
+
+	struct Header {
+		uint64_t magic;
+		uint64_t base;     // the address the pool is mapped at.
+		uint64_t size;
+		uint64_t root;     // offset of the root object, 0 until Root is called.
+		uint64_t top;      // offset of the space never allocated.
+		uint64_t log_num;  // entries in the undo log, 0 out of a transaction.
+		uint64_t free_lists[FILE_POOL_CLASS_NUM]; // offset of the first free object of each class, 0 if none.
+	};
+	static_assert(sizeof(Header) <= FILE_POOL_HEADER_SIZE, "the header of a pool takes a page");
+
+	// BRIEF: initialize the header of a new pool mapped at base.
+	void Format() {
+		memset(header_, 0, sizeof(Header));
+		header_->base = (uint64_t)base_;
+		header_->size = size_;
+		header_->top = FILE_POOL_HEADER_SIZE + FILE_POOL_LOG_SIZE;
+		Persist(header_, sizeof(Header));
+		header_->magic = FILE_POOL_MAGIC;
+		Persist(&(header_->magic), sizeof(uint64_t));
+	}
+
+  private:
+	struct ObjHeader {
+		uint64_t size_class;
+		uint64_t next; // offset of the next free object of the class, when free.
+	};
+
+	struct LogEntry {
+		uint64_t off; // offset of the range, its old bytes follow.
+		uint64_t len;
+	};
+
+	static PMPool *Create(const char *path, uint64_t size) {
+		int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if (fd < 0) {
+			perror("failed to create pool.\n");
+			return NULL;
+		}
+		errno = posix_fallocate(fd, 0, size);
+		if (errno != 0) {
+			perror("failed to create pool.\n");
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+		// the first free range of the address space from FILE_POOL_BASE.
+		const uint64_t stride = (size + (1ULL << 30) - 1) & ~((1ULL << 30) - 1);
+		char *base = NULL;
+		bool is_pmem = false;
+		for (int i = 0; i < 1024 && base == NULL; ++i) {
+			base = Map(fd, (char *)(FILE_POOL_BASE + i * stride), size, &is_pmem);
+		}
+		if (base == NULL) {
+			fprintf(stderr, "failed to map pool %s.\n", path);
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+		if (!PersistMode(path, &is_pmem)) {
+			munmap(base, size);
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+		MappedPool *pool = new MappedPool(PM_BACKEND_FILE, fd, base, size, is_pmem);
+		pool->Format();
+		return pool;
+	}
+
+	// RETURN: fd mapped at addr, NULL if the range is taken. is_pmem is set if
+	//         the mapping is synchronous, i.e. the file is on DAX.
+	static char *Map(int fd, char *addr, uint64_t size, bool *is_pmem) {
+		void *p = mmap(addr, size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED_VALIDATE | MAP_SYNC | MAP_FIXED_NOREPLACE, fd, 0);
+		*is_pmem = (p != MAP_FAILED);
+		if (p == MAP_FAILED && (errno == EOPNOTSUPP || errno == EINVAL)) {
+			p = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+		}
+		if (p == MAP_FAILED) {
+			return NULL;
+		}
+		if (p != addr) {
+			// the kernel takes MAP_FIXED_NOREPLACE as a hint before 4.17.
+			munmap(p, size);
+			return NULL;
+		}
+		return (char *)p;
+	}
+
+	// BRIEF: as in libpmem, PMEM_IS_PMEM_FORCE=1 flushes the cache lines of
+	//        any file: the data survives the process but not the machine.
+	//        PMEM_IS_PMEM_FORCE=0 msyncs the pages on each persist, which
+	//        survives both but takes ms per persist.
+	// RETURN: false if the file is not on DAX and neither is asked for.
+	static bool PersistMode(const char *path, bool *is_pmem) {
+		const char *force = getenv("PMEM_IS_PMEM_FORCE");
+		if (force != NULL) {
+			*is_pmem = (atoi(force) != 0);
+			return true;
+		}
+		if (!*is_pmem) {
+			fprintf(stderr, "pool %s is not on DAX, set PMEM_IS_PMEM_FORCE=1 to flush the cache lines "
+					"or PMEM_IS_PMEM_FORCE=0 to msync the pages on each persist.\n", path);
+			return false;
+		}
+		return true;
+	}
+
+	// RETURN: the class of an object of size bytes, its size with the header in class_size.
+	static int SizeClass(size_t size, size_t *class_size) {
+		size = (size + FILE_POOL_OBJ_HEADER + 63) / 64 * 64;
+		if (size <= 1024) {
+			*class_size = size;
+			return size / 64 - 1;
+		}
+		const int k = 63 - __builtin_clzll(size - 1); // 2^k < size <= 2^(k+1).
+		const size_t step = 1ULL << (k - 3);           // 8 classes over (2^k, 2^(k+1)].
+		*class_size = (size + step - 1) / step * step;
+		return 16 + (k - 10) * 8 + (int)(*class_size / step) - 9;
+	}
+
+	// RETURN: an object of size bytes, fresh if it comes from above top.
+	char *Take(size_t size, bool *fresh) {
+		size_t cs = 0;
+		const int c = SizeClass(size, &cs);
+		if (c >= FILE_POOL_CLASS_NUM) {
+			return NULL;
+		}
+		lock_.Lock();
+		char *block = NULL;
+		const uint64_t off = header_->free_lists[c];
+		if (off != 0) {
+			block = base_ + off;
+			header_->free_lists[c] = ((ObjHeader *)block)->next;
+			Persist(&(header_->free_lists[c]), sizeof(uint64_t));
+			*fresh = false;
+		} else {
+			if (header_->top + cs > size_) {
+				lock_.Unlock();
+				return NULL;
+			}
+			block = base_ + header_->top;
+			header_->top += cs;
+			Persist(&(header_->top), sizeof(uint64_t));
+			*fresh = true;
+		}
+		lock_.Unlock();
+		ObjHeader *h = (ObjHeader *)block;
+		h->size_class = c;
+		Persist(&(h->size_class), sizeof(uint64_t));
+		return block + FILE_POOL_OBJ_HEADER;
+	}
+
+	// BRIEF: restore the ranges of the transaction interrupted by a crash.
+	void Rollback() {
+		std::vector<LogEntry *> entries;
+		char *pos = log_;
+		for (uint64_t i = 0; i < header_->log_num; ++i) {
+			LogEntry *entry = (LogEntry *)pos;
+			entries.push_back(entry);
+			pos += sizeof(LogEntry) + (entry->len + 7) / 8 * 8;
+		}
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+			memcpy(base_ + (*it)->off, *it + 1, (*it)->len);
+			Persist(base_ + (*it)->off, (*it)->len);
+		}
+		header_->log_num = 0;
+		Persist(&(header_->log_num), sizeof(uint64_t));
+	}
+
+	const int fd_;          // -1 if anonymous.
+	char *const base_;
+	const uint64_t size_;
+	const bool is_pmem_;
+	Header *const header_;
+	char *const log_;
+	EXMutex lock_;          // guards top and the free lists.
+	EXMutex tx_lock_;       // one transaction at a time.
+	size_t log_used_;
+	std::vector<std::pair<const void *, size_t>> tx_ranges_;
+};
+
+// BRIEF: a MappedPool in anonymous memory reserved but not committed up
+//        front, the persists do nothing. the transactions still keep their
+//        undo log for TxAbort.
+class DRAMPool : public MappedPool {
+  public:
+	// RETURN: NULL on failure, a DRAM pool can't be opened again.
+	static PMPool *Open(const char *path, uint64_t size, bool create) {
+		if (!create) {
+			fprintf(stderr, "pool %s is in DRAM, nothing to recover.\n", path);
+			return NULL;
+		}
+		void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED) {
+			perror("failed to create pool.\n");
+			return NULL;
+		}
+		DRAMPool *pool = new DRAMPool((char *)base, size);
+		pool->Format();
+		return pool;
+	}
+
+	void Persist(const void *, size_t) override {}
+
+  private:
+	DRAMPool(char *base, uint64_t size) : MappedPool(PM_BACKEND_DRAM, -1, base, size, false) {}
+};
+
+// RETURN: the pool of backend at path, created with size bytes if create and
+//         it does not exist, NULL on failure.
+inline PMPool *open_pm_pool(PMBackend backend, const char *path, uint64_t size, bool create) {
+	switch (backend) {
+#ifdef USE_PMDK
+	case PM_BACKEND_PMDK:
+		return PMDKPool::Open(path, size, create);
+#endif
+	case PM_BACKEND_FILE:
+		return MappedPool::Open(path, size, create);
+	case PM_BACKEND_DRAM:
+		return DRAMPool::Open(path, size, create);
+	default:
+		fprintf(stderr, "backend %d is not built.\n", (int)backend);
+		return NULL;
+	}
+}
@@ -90,6 +90,16 @@ class EXMutex {
 #endif
 	}
 
+	bool TryLock() {
+		if (pthread_mutex_trylock(&lock_) != 0) {
+			return false;
+		}
+#ifndef NDEBUG
+		locked_ = true;
+#endif
+		return true;
+	}
+
 	void Unlock() {
 		pthread_mutex_unlock(&lock_);
 #ifndef NDEBUG
@@ -38,6 +38,8 @@ class Counter {
 
 	void Clear() { num_ = 0; }
 
+	uint64_t Get() const { return num_; }
+
 	void Add(uint64_t t) {
 #ifndef THREAD_SAFE_TIMER
 		num_ += t;
@@ -402,6 +404,10 @@ class CounterSet {
 		counter_set_[(size_t)pos]->Add(t);
 	}
 
+	uint64_t Get(size_t pos) const {
+		return counter_set_[(size_t)pos]->Get();
+	}
+
 	void PrintResult() {
 		for (size_t i = 0; i < counter_set_.size(); ++i) {
 			counter_set_[i]->PrintResult();
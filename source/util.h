@@ -12,9 +12,11 @@
 #include <assert.h>
 #include <vector>
 #include <future>
+#include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <random>
+#include <math.h>
 
 
 #include "timer.h"
@@ -0,0 +1,784 @@
+#include "PHAST.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+// microbenchmarks of the hot routines.
+
+#define LOOKUP_NUM (1 << 22) // lookups per kernel and array size.
+#define ARRAY_NUM 64         // arrays per size, to leave the l1 cache.
+
+#define BENCH_LOWER_BOUND true
+#define BENCH_SEARCH true // Search on an instance, build with and without USE_ISN_LAYOUT or prefetching to compare, with USE_SEARCH_TRACE for the modelled misses.
+#define SEARCH_KEY_NUM (4000000)
+#define BENCH_AGG_MODEL true // AGGIndex::Find against the model, build with USE_AGG_MODEL.
+#define BENCH_PROBE true     // fingerprint probe of a leaf group, hit and miss.
+#define GROUP_NUM (1 << 16)  // leaf groups probed, to leave the l1 cache.
+#define BENCH_DELETE true    // a sliding window of keys, build with and without USE_TRUE_DELETE to compare.
+#define DELETE_WINDOW (1000000) // live keys, each insert past it deletes the oldest key.
+#define DELETE_ROUNDS 4         // the window is replaced this many times.
+#define BENCH_BACKEND true   // the same operations on each backend of the pools.
+#define BACKEND_KEY_NUM (2000000)
+#define BENCH_PERSIST true   // persists, flushed cache lines and fences per operation, build with USE_PERSIST_STATS.
+#define PERSIST_KEY_NUM (1000000)
+#define VAL(k) ((ValueType)(k) | 1) // the value of key k.
+
+#if BENCH_LOWER_BOUND
+// BRIEF: cycles per lookup of kernel over sorted arrays of n keys.
+//        returns 0 if a result differs from the scalar kernel.
+template <typename K>
+static double bench_lower_bound(KeyLowerBound<K> kernel, int n, std::mt19937_64 &eng)
+{
+    const int size = n + 1;
+    K *arrays = (K *)malloc(sizeof(K) * size * ARRAY_NUM);
+    for (int a = 0; a < ARRAY_NUM; ++a)
+    {
+        K *keys = arrays + a * size;
+        K step = LayoutTraits<K, ValueType>::max_key / size;
+        for (int i = 0; i < n; ++i)
+        {
+            keys[i] = step * (i + 1) - (K)(eng() % (step / 2 + 1));
+        }
+    }
+
+    K *targets = (K *)malloc(sizeof(K) * LOOKUP_NUM);
+    int *which = (int *)malloc(sizeof(int) * LOOKUP_NUM);
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+    {
+        which[i] = eng() % ARRAY_NUM;
+        K *keys = arrays + which[i] * size;
+        // half of the lookups hit a key exactly.
+        targets[i] = (i & 1) ? keys[eng() % n] : (K)eng();
+    }
+
+    for (int i = 0; i < LOOKUP_NUM / 16; ++i)
+    {
+        const K *keys = arrays + which[i] * size;
+        if (kernel(keys, n, targets[i]) != lower_bound_scalar(keys, n, targets[i]))
+        {
+            free(arrays);
+            free(targets);
+            free(which);
+            return 0;
+        }
+    }
+
+    uint64_t sum = 0;
+    uint64_t start = __rdtsc();
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+    {
+        sum += kernel(arrays + which[i] * size, n, targets[i]);
+    }
+    uint64_t cycles = __rdtsc() - start;
+    if (sum == 0)
+        fprintf(stderr, " ");
+
+    free(arrays);
+    free(targets);
+    free(which);
+    return (double)cycles / LOOKUP_NUM;
+}
+
+// BRIEF: the kernels over keys of type K, each key size in one binary.
+template <typename K>
+void lower_bound_test()
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+    fprintf(stderr, "lower bound over %d-bit keys, cycles per lookup\n", (int)sizeof(K) * 8);
+    std::mt19937_64 eng(1);
+    const int sizes[] = {16, 64, MAX_LEAF_CAPACITY, 512, 4096};
+
+    struct Kernel
+    {
+        const char *name;
+        KeyLowerBound<K> func;
+        bool supported;
+    };
+    std::vector<Kernel> kernels = {{"scalar", lower_bound_scalar<K>, true}};
+#ifdef USE_SIMD_SEARCH
+    if constexpr (sizeof(K) <= 8)
+    {
+        kernels.push_back({"avx2", lower_bound_avx2<K>, (bool)__builtin_cpu_supports("avx2")});
+        kernels.push_back({"avx512", lower_bound_avx512<K>, (bool)__builtin_cpu_supports("avx512f")});
+    }
+#endif
+
+    fprintf(stderr, "%8s", "n");
+    for (auto &k : kernels)
+        fprintf(stderr, "%10s", k.name);
+    fprintf(stderr, "\n");
+    for (int n : sizes)
+    {
+        fprintf(stderr, "%8d", n);
+        for (auto &k : kernels)
+        {
+            if (!k.supported)
+            {
+                fprintf(stderr, "%10s", "-");
+                continue;
+            }
+            double c = bench_lower_bound<K>(k.func, n, eng);
+            if (c == 0)
+                fprintf(stderr, "%10s", "WRONG");
+            else
+                fprintf(stderr, "%10.1f", c);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+#endif
+
+#if BENCH_SEARCH
+// RETURN: a counter of this thread, -1 if perf events are not available.
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+
+#ifdef USE_SEARCH_TRACE
+// BRIEF: a set associative LRU cache of 64-byte lines, counts the misses
+//        without perf events.
+class CacheModel
+{
+  public:
+    CacheModel(size_t size, int ways)
+        : misses(0), ways_(ways), sets_(size / 64 / ways), tags_(sets_ * ways, 0) {}
+
+    void Access(const void *addr)
+    {
+        const uint64_t line = (uint64_t)addr / 64 + 1; // 0 is an empty way.
+        uint64_t *set = &tags_[(line % sets_) * ways_];
+        int i = 0;
+        while (i < ways_ && set[i] != line)
+            ++i;
+        if (i == ways_)
+        {
+            ++misses;
+            --i; // evict the least recently used one.
+        }
+        memmove(set + 1, set, sizeof(uint64_t) * i);
+        set[0] = line;
+    }
+
+    uint64_t misses;
+
+  private:
+    const int ways_;
+    const size_t sets_;
+    std::vector<uint64_t> tags_;
+};
+
+static CacheModel *trace_l1d, *trace_llc;
+static std::vector<uint64_t> trace_lines; // the lines read by the current Search.
+static LowerBoundFunc traced_kernel;
+
+static void trace_line(const void *addr)
+{
+    trace_l1d->Access(addr);
+    trace_llc->Access(addr);
+    const uint64_t line = (uint64_t)addr / 64;
+    if (std::find(trace_lines.begin(), trace_lines.end(), line) == trace_lines.end())
+        trace_lines.push_back(line);
+}
+
+// BRIEF: the lines a binary search reads, the result comes from the kernel.
+static int traced_lower_bound(const KeyType *keys, int n, KeyType key)
+{
+    int low = 0, high = n;
+    while (low < high)
+    {
+        const int mid = (low + high) / 2;
+        trace_line(&keys[mid]);
+        if (keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return traced_kernel(keys, n, key);
+}
+
+static size_t cache_size(int name, size_t def)
+{
+    const long v = sysconf(name);
+    return (v > 0) ? v : def;
+}
+
+// BRIEF: replay the lookups through models of the L1D and the LLC of this
+//        machine, fed with the inner node and index lines Search reads.
+//        the first half warms the models up. other data never evicts the
+//        lines in the models, so the misses are a lower bound.
+static void model_search_misses(PHAST *list, const std::vector<KeyType> &keys)
+{
+    CacheModel l1d(cache_size(_SC_LEVEL1_DCACHE_SIZE, 48 << 10), cache_size(_SC_LEVEL1_DCACHE_ASSOC, 12));
+    CacheModel llc(cache_size(_SC_LEVEL3_CACHE_SIZE, 32 << 20), cache_size(_SC_LEVEL3_CACHE_ASSOC, 16));
+    trace_l1d = &l1d;
+    trace_llc = &llc;
+    traced_kernel = key_lower_bound;
+    key_lower_bound = traced_lower_bound;
+    search_trace = trace_line;
+
+    const size_t half = keys.size() / 2;
+    uint64_t lines = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (i == half)
+        {
+            l1d.misses = 0;
+            llc.misses = 0;
+        }
+        trace_lines.clear();
+        Search(list, keys[i]);
+        if (i >= half)
+            lines += trace_lines.size();
+    }
+
+    search_trace = NULL;
+    key_lower_bound = traced_kernel;
+    const size_t n = keys.size() - half;
+    fprintf(stderr, "modelled per Search: %.2f inner node and index lines, %.2f L1D misses, %.2f LLC misses\n",
+            (double)lines / n, (double)l1d.misses / n, (double)llc.misses / n);
+}
+#endif
+
+// BRIEF: the median and tail of the cycles per operation.
+static void print_percentiles(const char *op, std::vector<uint32_t> &cycles)
+{
+    std::sort(cycles.begin(), cycles.end());
+    const size_t n = cycles.size();
+    fprintf(stderr, "%s cycles: p50 %u, p99 %u, p99.9 %u\n", op,
+            cycles[n / 2], cycles[n * 99 / 100], cycles[n * 999 / 1000]);
+}
+
+void search_test(const PHASTOptions &opt)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+#ifdef USE_ISN_LAYOUT
+    fprintf(stderr, "Search with the hot header layout, %lu bytes per inner node\n", sizeof(ISN));
+#else
+    fprintf(stderr, "Search with the flat layout, %lu bytes per inner node\n", sizeof(ISN));
+#endif
+    PHAST *list = init_list(opt);
+    if (list == NULL)
+        return;
+
+    fprintf(stderr, "prefetch distance %d\n", SEARCH_PREFETCH_DISTANCE);
+
+    std::mt19937_64 eng(2);
+    std::vector<KeyType> keys(SEARCH_KEY_NUM);
+    std::vector<uint32_t> cycles(SEARCH_KEY_NUM);
+    for (auto &k : keys)
+        k = (KeyType)eng() | 1;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t start = __rdtsc();
+        Insert(list, keys[i], VAL(keys[i]));
+        cycles[i] = __rdtsc() - start;
+    }
+    print_percentiles("Insert", cycles);
+    std::shuffle(keys.begin(), keys.end(), eng);
+
+    struct
+    {
+        const char *name;
+        int fd;
+    } counters[] = {
+        {"L1D read misses", open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))},
+        {"LLC misses", open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)},
+        {"dTLB read misses", open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))},
+    };
+    for (auto &c : counters)
+        if (c.fd >= 0)
+            ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    uint64_t wrong = 0;
+    uint64_t t1 = NowNanos();
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t start = __rdtsc();
+        wrong += (Search(list, keys[i]) != VAL(keys[i]));
+        cycles[i] = __rdtsc() - start;
+    }
+    uint64_t elapsed = ElapsedNanos(t1);
+
+    fprintf(stderr, "%.1f ns per Search, %lu wrong\n", (double)elapsed / keys.size(), wrong);
+    print_percentiles("Search", cycles);
+    for (auto &c : counters)
+    {
+        if (c.fd < 0)
+        {
+            fprintf(stderr, "%s: not available\n", c.name);
+            continue;
+        }
+        ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+        fprintf(stderr, "%s per Search: %.2f\n", c.name, (double)read_counter(c.fd) / keys.size());
+        close(c.fd);
+    }
+#ifdef USE_SEARCH_TRACE
+    model_search_misses(list, keys);
+#else
+    fprintf(stderr, "build with USE_SEARCH_TRACE to model the misses without perf events\n");
+#endif
+    dram_free(list);
+}
+#endif
+
+#if BENCH_AGG_MODEL
+#ifdef USE_AGG_MODEL
+// BRIEF: cycles per lookup of Find and ModelFind over an index of n nodes,
+//        half of them built in, the others inserted one by one.
+static void bench_agg_model(int n, bool clustered, std::mt19937_64 &eng)
+{
+    std::vector<KeyType> keys(n);
+    for (int i = 0; i < n; ++i)
+    {
+        // clustered keys fall into 16 narrow ranges.
+        keys[i] = clustered ? (MAX_KEY / 16) * (eng() % 16) + (KeyType)(eng() % (1 << 20)) + 1
+                            : (KeyType)eng() % MAX_KEY + 1;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    ISN *head = (ISN *)calloc(1, sizeof(ISN));
+    head->is_head = true;
+    std::vector<ISN *> nodes(n);
+    ISN *tail = head;
+    for (int i = 0; i < n; ++i)
+    {
+        nodes[i] = (ISN *)calloc(1, sizeof(ISN));
+        nodes[i]->max_key = keys[i];
+        if (i % 2 == 0)
+        {
+            tail->next[AGG_UPDATE_LEVEL] = nodes[i];
+            tail = nodes[i];
+        }
+    }
+    AGGIndex *idx = new AGGIndex(head, n * AGG_GAP_RATIO);
+    for (int i = 1; i < n; i += 2)
+    {
+        if (!idx->Insert(nodes[i]))
+            break;
+    }
+
+    KeyType *targets = (KeyType *)malloc(sizeof(KeyType) * LOOKUP_NUM);
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+    {
+        targets[i] = (i & 1) ? keys[eng() % n] : keys[eng() % n] + 1;
+    }
+
+    KeyType max_key;
+    uint64_t wrong = 0, sum = 0;
+    for (int i = 0; i < LOOKUP_NUM / 16; ++i)
+    {
+        KeyType k1 = 0, k2 = 0;
+        wrong += (idx->Find(targets[i], &k1) != idx->ModelFind(targets[i], &k2)) || k1 != k2;
+    }
+    uint64_t start = __rdtsc();
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+        sum += (uintptr_t)idx->Find(targets[i], &max_key);
+    const double find = (double)(__rdtsc() - start) / LOOKUP_NUM;
+    start = __rdtsc();
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+        sum += (uintptr_t)idx->ModelFind(targets[i], &max_key);
+    const double model = (double)(__rdtsc() - start) / LOOKUP_NUM;
+    if (sum == 0)
+        fprintf(stderr, " ");
+
+    fprintf(stderr, "%8d %10s %9d %9.1f %9.1f %8.2fx %s\n", n, clustered ? "clustered" : "uniform",
+            idx->n_segments, find, model, find / model, wrong ? "WRONG" : "");
+
+    delete idx;
+    for (auto node : nodes)
+        free(node);
+    free(head);
+    free(targets);
+}
+#endif
+
+void agg_model_test()
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+#ifndef USE_AGG_MODEL
+    fprintf(stderr, "USE_AGG_MODEL is off, the index cache model is not built\n");
+#else
+    fprintf(stderr, "index cache lookup, cycles per lookup\n");
+    fprintf(stderr, "%8s %10s %9s %9s %9s %9s\n", "nodes", "keys", "segments", "Find", "ModelFind", "gain");
+    std::mt19937_64 eng(3);
+    for (int n : {1 << 6, 1 << 10, 1 << 14})
+    {
+        bench_agg_model(n, false, eng);
+        bench_agg_model(n, true, eng);
+    }
+#endif
+}
+#endif
+
+#if BENCH_PROBE
+// BRIEF: cycles per lookup of a key in full leaf groups, by the candidates of
+//        kernel. a hit looks up a key of the group, a miss an absent one.
+//        returns 0 if a result differs from the scalar kernel.
+template <typename K, typename V>
+static double bench_probe(LeafProbe<K, V> kernel, bool hit, LeafSkipGroupT<K, V> *groups, std::mt19937_64 &eng)
+{
+    K *targets = (K *)malloc(sizeof(K) * LOOKUP_NUM);
+    int *which = (int *)malloc(sizeof(int) * LOOKUP_NUM);
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+    {
+        which[i] = eng() % GROUP_NUM;
+        // the committed slots are the even ones, the keys of the groups are odd.
+        targets[i] = hit ? groups[which[i]].entries[eng() % (MAX_ENTRY_NUM / 2) * 2].key : ((K)eng() & ~(K)1);
+    }
+
+    auto lookup = [&](LeafProbe<K, V> probe, int i) -> V
+    {
+        const LeafSkipGroupT<K, V> *lfnode = &groups[which[i]];
+        for (uint64_t match = probe(lfnode, f_hash(targets[i]), lfnode->commit_bitmap); match; match &= match - 1)
+        {
+            const int slot = __builtin_ctzll(match);
+            if (lfnode->entries[slot].key == targets[i])
+                return lfnode->entries[slot].value;
+        }
+        return 0;
+    };
+
+    for (int i = 0; i < LOOKUP_NUM / 16; ++i)
+    {
+        const LeafSkipGroupT<K, V> *lfnode = &groups[which[i]];
+        const uint8_t fp = f_hash(targets[i]);
+        if (kernel(lfnode, fp, lfnode->commit_bitmap) != probe_scalar(lfnode, fp, lfnode->commit_bitmap))
+        {
+            free(targets);
+            free(which);
+            return 0;
+        }
+    }
+
+    uint64_t sum = 0;
+    uint64_t start = __rdtsc();
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+    {
+        sum += lookup(kernel, i);
+    }
+    uint64_t cycles = __rdtsc() - start;
+    if (sum == 1)
+        fprintf(stderr, " ");
+
+    free(targets);
+    free(which);
+    return (double)cycles / LOOKUP_NUM;
+}
+
+// BRIEF: the probe and the key compare in the leaf groups of keys of type K
+//        and values of type V, each layout in one binary.
+template <typename K, typename V>
+void probe_test()
+{
+    typedef LeafSkipGroupT<K, V> Leaf;
+    fprintf(stderr, "/////////////////////////////////////////\n");
+    fprintf(stderr, "leaf group probe of %d slots, %d-bit keys and %d-bit values in %d-byte groups, cycles per lookup\n",
+            MAX_ENTRY_NUM, (int)sizeof(K) * 8, (int)sizeof(V) * 8, (int)sizeof(Leaf));
+    std::mt19937_64 eng(4);
+    Leaf *groups = (Leaf *)aligned_alloc(64, sizeof(Leaf) * GROUP_NUM);
+    for (int g = 0; g < GROUP_NUM; ++g)
+    {
+        // every other slot is committed.
+        memset((void *)&groups[g], 0, sizeof(Leaf));
+        groups[g].commit_bitmap = 0x5555555555555555ULL & GROUP_BITMAP_FULL;
+        for (int i = 0; i < MAX_ENTRY_NUM; ++i)
+        {
+            groups[g].entries[i].key = (K)eng() | 1;
+            groups[g].entries[i].value = (V)groups[g].entries[i].key | 1;
+            groups[g].fingerprints[i] = f_hash(groups[g].entries[i].key);
+        }
+    }
+
+    struct
+    {
+        const char *name;
+        LeafProbe<K, V> func;
+        bool supported;
+    } kernels[] = {
+        {"scalar", probe_scalar<K, V>, true},
+#ifdef USE_SIMD_PROBE
+        {"avx2", probe_avx2<K, V>, (bool)__builtin_cpu_supports("avx2")},
+        {"avx512", probe_avx512<K, V>, (bool)__builtin_cpu_supports("avx512bw")},
+#endif
+    };
+
+    fprintf(stderr, "%8s", "");
+    for (auto &k : kernels)
+        fprintf(stderr, "%10s", k.name);
+    fprintf(stderr, "\n");
+    for (bool hit : {true, false})
+    {
+        fprintf(stderr, "%8s", hit ? "hit" : "miss");
+        for (auto &k : kernels)
+        {
+            if (!k.supported)
+            {
+                fprintf(stderr, "%10s", "-");
+                continue;
+            }
+            double c = bench_probe<K, V>(k.func, hit, groups, eng);
+            if (c == 0)
+                fprintf(stderr, "%10s", "WRONG");
+            else
+                fprintf(stderr, "%10.1f", c);
+        }
+        fprintf(stderr, "\n");
+    }
+    free(groups);
+}
+#endif
+
+#if BENCH_DELETE
+// BRIEF: the leaf groups linked in list, and the free ones.
+static void count_leaf_groups(PHAST *list, uint64_t *linked, uint64_t *free_groups, uint64_t *keys)
+{
+    *linked = *free_groups = *keys = 0;
+    PMAP *map = list->inner_list->map;
+    for (int i = 0; i < map->nHeads; ++i)
+    {
+        for (ISN *inode = map->head[i]->next[0]; inode != NULL && !inode->is_head; inode = inode->next[0])
+        {
+            *linked += inode->nKeys;
+            for (int j = 0; j < inode->nKeys; ++j)
+                *keys += popcount1(inode->leaves[j]->commit_bitmap);
+        }
+    }
+    for (int p = 0; p < list->n_pools; ++p)
+        for (LSG *leaf = list->leaf_allocs[p]->root->free_leaves; leaf != NULL; leaf = leaf->next)
+            ++*free_groups;
+}
+
+void delete_test(const PHASTOptions &opt)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+#ifdef USE_TRUE_DELETE
+    fprintf(stderr, "Delete frees the slot\n");
+#else
+    fprintf(stderr, "Delete leaves a tombstone\n");
+#endif
+    PHAST *list = init_list(opt);
+    if (list == NULL)
+        return;
+
+    std::mt19937_64 eng(3);
+    const size_t num = (size_t)DELETE_WINDOW * (DELETE_ROUNDS + 1);
+    std::vector<KeyType> keys(num);
+    for (auto &k : keys)
+        k = (KeyType)eng() | 1;
+    for (size_t i = 0; i < DELETE_WINDOW; ++i)
+        Insert(list, keys[i], VAL(keys[i]));
+
+    uint64_t linked, free_groups, live;
+    count_leaf_groups(list, &linked, &free_groups, &live);
+    const uint64_t groups_before = linked + free_groups;
+    uint64_t t1 = NowNanos();
+    for (size_t i = DELETE_WINDOW; i < num; ++i)
+    {
+        Insert(list, keys[i], VAL(keys[i]));
+        Delete(list, keys[i - DELETE_WINDOW]);
+    }
+    uint64_t elapsed = ElapsedNanos(t1);
+
+    uint64_t wrong = 0;
+    for (size_t i = num - DELETE_WINDOW; i < num; ++i)
+        wrong += (Search(list, keys[i]) != VAL(keys[i]));
+    for (size_t i = 0; i < num - DELETE_WINDOW; i += 97)
+        wrong += (Search(list, keys[i]) != 0 && Search(list, keys[i]) != MAX_VALUE);
+
+    count_leaf_groups(list, &linked, &free_groups, &live);
+    fprintf(stderr, "%.1f ns per insert + delete, %lu wrong\n", (double)elapsed / (num - DELETE_WINDOW), wrong);
+    fprintf(stderr, "leaf splits %lu, leaf groups %lu (%lu free), %.1f MB in PM, %lu keys in the leaves\n",
+            linked + free_groups - groups_before, linked, free_groups,
+            (double)(linked + free_groups) * sizeof(LSG) / (1 << 20), live);
+    dram_free(list);
+}
+#endif
+
+#if BENCH_BACKEND
+// BRIEF: ns per Insert, Search, Update and Delete and us per scan of 100 keys
+//        on a new instance in each backend. out of DAX, the file backend
+//        needs PMEM_IS_PMEM_FORCE, see README.
+void backend_test(const PHASTOptions &opt)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+    fprintf(stderr, "backend   insert(ns)  search(ns)  update(ns)  scan100(us)  delete(ns)\n");
+    const PMBackend backends[] = {
+#ifdef USE_PMDK
+        PM_BACKEND_PMDK,
+#endif
+        PM_BACKEND_FILE, PM_BACKEND_DRAM};
+
+    std::mt19937_64 eng(4);
+    std::vector<KeyType> keys(BACKEND_KEY_NUM);
+    for (auto &k : keys)
+        k = (KeyType)eng() | 1;
+    ValueType buf[100];
+    for (PMBackend backend : backends)
+    {
+        PHASTOptions o = opt;
+        std::string path = std::string(opt.path) + "." + PM_BACKEND_NAME[backend];
+        o.path = path.c_str();
+        o.backend = backend;
+        unlink(o.path);
+        PHAST *list = init_list(o);
+        if (list == NULL)
+            continue;
+
+        double ns[5];
+        uint64_t wrong = 0;
+        uint64_t t1 = NowNanos();
+        for (size_t i = 0; i < keys.size(); ++i)
+            Insert(list, keys[i], VAL(keys[i]));
+        ns[0] = (double)ElapsedNanos(t1) / keys.size();
+        t1 = NowNanos();
+        for (size_t i = 0; i < keys.size(); ++i)
+            wrong += (Search(list, keys[i]) != VAL(keys[i]));
+        ns[1] = (double)ElapsedNanos(t1) / keys.size();
+        t1 = NowNanos();
+        for (size_t i = 0; i < keys.size(); ++i)
+            Update(list, keys[i], VAL(keys[i]) + 2);
+        ns[2] = (double)ElapsedNanos(t1) / keys.size();
+        t1 = NowNanos();
+        for (size_t i = 0; i < keys.size() / 10; ++i)
+            wrong += (Range_Search(list, keys[i], 100, buf) != 100 && keys[i] < MAX_KEY / 2);
+        ns[3] = (double)ElapsedNanos(t1) / (keys.size() / 10) / 1000;
+        t1 = NowNanos();
+        for (size_t i = 0; i < keys.size(); ++i)
+            Delete(list, keys[i]);
+        ns[4] = (double)ElapsedNanos(t1) / keys.size();
+
+        fprintf(stderr, "%-8s  %10.1f  %10.1f  %10.1f  %11.2f  %10.1f  %lu wrong\n", PM_BACKEND_NAME[backend],
+                ns[0], ns[1], ns[2], ns[3], ns[4], wrong);
+        dram_free(list);
+        unlink(o.path);
+    }
+}
+#endif
+
+#if BENCH_PERSIST
+// BRIEF: print the persists counted since the last call by kind, per call
+//        of phase, and move them to counters.
+static void print_persist_stats(const char *phase, uint64_t calls, CounterSet *counters)
+{
+    PersistStats stats[PERSIST_OP_NUM];
+    get_persist_stats(stats);
+    for (int op = 0; op < PERSIST_OP_NUM; ++op)
+    {
+        if (stats[op].persists == 0)
+            continue;
+        fprintf(stderr, "%-10s %-12s %10.2f %10.2f %10.1f %10.2f\n", phase, PERSIST_OP_NAME[op],
+                (double)stats[op].persists / calls, (double)stats[op].lines / calls,
+                (double)stats[op].bytes / calls, (double)stats[op].fences / calls);
+    }
+    add_persist_stats(counters);
+    clear_persist_stats();
+}
+
+void persist_test(const PHASTOptions &opt)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+#ifndef USE_PERSIST_STATS
+    fprintf(stderr, "the persists are not counted, build with USE_PERSIST_STATS\n");
+#endif
+    unlink(opt.path);
+    clear_persist_stats();
+    CounterSet counters;
+    PHAST *list = init_list(opt);
+    if (list == NULL)
+        return;
+    fprintf(stderr, "phase      kind           persists      lines      bytes     fences  (per call)\n");
+    print_persist_stats("create", 1, &counters);
+
+    std::mt19937_64 eng(5);
+    std::vector<KeyType> keys(PERSIST_KEY_NUM);
+    for (auto &k : keys)
+        k = (KeyType)eng() | 1;
+    for (size_t i = 0; i < keys.size(); ++i)
+        Insert(list, keys[i], VAL(keys[i]));
+    print_persist_stats("insert", keys.size(), &counters);
+    for (size_t i = 0; i < keys.size(); ++i)
+        Update(list, keys[i], VAL(keys[i]) + 2);
+    print_persist_stats("update", keys.size(), &counters);
+    for (size_t i = 0; i < keys.size(); i += 2)
+        Delete(list, keys[i]);
+    print_persist_stats("delete", keys.size() / 2, &counters);
+#ifdef USE_LEAF_MERGE
+    const int merges = merge_leaf_nodes(list);
+    print_persist_stats("merge", std::max(merges, 1), &counters);
+#endif
+#ifdef USE_ADAPTIVE_PARTITION
+    const int heads = list->inner_list->map->nHeads;
+    const int changed = std::abs(rebalance_partitions(list) - heads);
+    print_persist_stats("rebalance", std::max(changed, 1), &counters);
+#endif
+    dram_free(list);
+    clear_persist_stats();
+
+    list = recovery(4, opt);
+    if (list != NULL)
+    {
+        print_persist_stats("recovery", 1, &counters);
+        dram_free(list);
+    }
+    fprintf(stderr, "CFLUSH_NUM %lu, CFLUSH_SIZE %lu, MFENCE_NUM %lu in total\n",
+            counters.Get(CFLUSH_NUM), counters.Get(CFLUSH_SIZE), counters.Get(MFENCE_NUM));
+    unlink(opt.path);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#if BENCH_LOWER_BOUND
+    lower_bound_test<uint32_t>();
+    lower_bound_test<uint64_t>();
+    lower_bound_test<unsigned __int128>();
+#endif
+#if BENCH_PROBE
+    probe_test<uint32_t, uint32_t>();
+    probe_test<uint64_t, uint64_t>();
+    probe_test<unsigned __int128, uint64_t>();
+#endif
+#if BENCH_AGG_MODEL
+    agg_model_test();
+#endif
+#if BENCH_SEARCH || BENCH_DELETE || BENCH_BACKEND || BENCH_PERSIST
+    PHASTOptions opt;
+    std::string path = std::string(PMEM_PATH) + ".micro";
+    opt.path = path.c_str();
+#endif
+#if BENCH_SEARCH
+    search_test(opt);
+#endif
+#if BENCH_DELETE
+    std::string delete_path = path + ".delete";
+    opt.path = delete_path.c_str();
+    delete_test(opt);
+#endif
+#if BENCH_BACKEND
+    opt.path = path.c_str();
+    backend_test(opt);
+#endif
+#if BENCH_PERSIST
+    std::string persist_path = path + ".persist";
+    opt.path = persist_path.c_str();
+    persist_test(opt);
+#endif
+    return 0;
+}
@@ -11,6 +11,10 @@
 #define CHECK_AFTER_OPS
 
 #define SEQ_KEYS_ORDER false
+#define VAL(k) ((ValueType)(k) | 1) // the value of key k.
+#define SAMPLE_PARTITION false // set partition bounds by the quantiles of the keys.
+#define TEST_VAR_KEY true      // wether to test string keys on another instance.
+#define TEST_REBALANCE true    // wether to rebalance the partitions during the inserts on another instance.
 
 void clear_cache()
 {
@@ -24,14 +28,11 @@ void clear_cache()
     delete[] garbage;
 }
 
-void preformace_test(int n_threads, int num = 0)
+void preformace_test(int n_threads, const PHASTOptions &opt, int num = 0)
 {
     fprintf(stderr, "/////////////////////////////////////////\n");
     // fprintf(stderr, "the number of Agglevel is %d\n",AGG_UPDATE_LEVEL);
     fprintf(stderr, "PHAST(partition) : n_thread is: %d\n", n_threads);
-    PHAST *list = init_list();
-    assert(list != NULL);
-
     if (num == 0)
     {
         num = (INSERT_NUM + SEARCH_NUM);
@@ -46,7 +47,7 @@ void preformace_test(int n_threads, int num = 0)
     //////////////////////////
     // generate keys.
     /////////////////////////
-    uint64_t *keys = (uint64_t *)malloc(num * sizeof(uint64_t));
+    KeyType *keys = (KeyType *)malloc(num * sizeof(KeyType));
     std::random_device rd;
     std::mt19937_64 eng(rd());
 #if 0
@@ -65,13 +66,19 @@ void preformace_test(int n_threads, int num = 0)
         }
     }
 #else
-    uint64_t step = MAX_U64_KEY / num;
+    KeyType step = MAX_KEY / num;
     for (uint64_t i = 0; i < num; i++)
         keys[i] = i * step + 1;
     if (!SEQ_KEYS_ORDER)
         std::shuffle(keys, keys + num, eng);
 #endif
 
+    PHAST *list = SAMPLE_PARTITION ? init_list_by_sample(keys, num / 100 + 1, opt) : init_list(opt);
+    assert(list != NULL);
+#ifdef USE_TOWER_REBALANCE
+    start_maintenance(list);
+#endif
+
     ///////////////////////////
     //-----Warm up-----
     ///////////////////////////
@@ -79,7 +86,7 @@ void preformace_test(int n_threads, int num = 0)
     fprintf(stderr, "single thread start warm up!\n");
     for (uint64_t i = 0; i < num / 2; ++i)
     {
-        Insert(list, keys[i], keys[i]);
+        Insert(list, keys[i], VAL(keys[i]));
     }
 
     // fprintf(stderr, "single thread finish warm up! %llu ns.\n", ElapsedNanos(t1));
@@ -114,14 +121,14 @@ void preformace_test(int n_threads, int num = 0)
                     size_t i = __sync_add_and_fetch(&seq_cursor, 1);
                     while (i < num)
                     {
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                         i = __sync_add_and_fetch(&seq_cursor, 1);
                     }
                 }
                 else
                 {
                     for (int i = from + num / 2; i < to + num / 2; ++i)
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                 }
             },
             from, to, tid);
@@ -131,6 +138,9 @@ void preformace_test(int n_threads, int num = 0)
         if (f.valid())
             f.get();
     fprintf(stderr, "%d threads insert time cost is %llu ns.\n", n_threads, ElapsedNanos(t1));
+#ifdef USE_ADAPTIVE_PARTITION
+    fprintf(stderr, "%d partitions after rebalance\n", rebalance_partitions(list));
+#endif
 
 
     /////////////////////////////
@@ -157,7 +167,7 @@ void preformace_test(int n_threads, int num = 0)
             {
                 for (int i = from + num / 2; i < to + num / 2; ++i)
                 {
-                    if (Search(list, keys[i]) != keys[i])
+                    if (Search(list, keys[i]) != VAL(keys[i]))
                     {
                         __sync_fetch_and_add(&chk_num, 1);
                     }
@@ -214,15 +224,15 @@ void preformace_test(int n_threads, int num = 0)
                 {
                     int sidx = i - half_num_data;
                     int jid = i % 4;
-                    uint64_t res = 0;
+                    ValueType res = 0;
                     switch (jid)
                     {
                     case 0:
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                         for (int j = 0; j < 4; j++)
                         {
                             res = Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
-                            if (res != keys[(sidx + j + jid * 8) % half_num_data])
+                            if (res != VAL(keys[(sidx + j + jid * 8) % half_num_data]))
                             {
                                 __sync_fetch_and_add(&chk_num, 1);
                             }
@@ -236,7 +246,7 @@ void preformace_test(int n_threads, int num = 0)
                         for (int j = 0; j < 3; j++)
                         {
                             res = Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
-                            if (res != keys[(sidx + j + jid * 8) % half_num_data])
+                            if (res != VAL(keys[(sidx + j + jid * 8) % half_num_data]))
                             {
                                 __sync_fetch_and_add(&chk_num, 1);
                             }
@@ -245,9 +255,9 @@ void preformace_test(int n_threads, int num = 0)
                                 __sync_fetch_and_add(&chk_num_not_find, 1);
                             }
                         }
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                         res = Search(list, keys[(sidx + 3 + jid * 8) % half_num_data]);
-                        if (res != keys[(sidx + 3 + jid * 8) % half_num_data])
+                        if (res != VAL(keys[(sidx + 3 + jid * 8) % half_num_data]))
                         {
                             __sync_fetch_and_add(&chk_num, 1);
                         }
@@ -260,7 +270,7 @@ void preformace_test(int n_threads, int num = 0)
                         for (int j = 0; j < 2; j++)
                         {
                             res = Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
-                            if (res != keys[(sidx + j + jid * 8) % half_num_data])
+                            if (res != VAL(keys[(sidx + j + jid * 8) % half_num_data]))
                             {
                                 __sync_fetch_and_add(&chk_num, 1);
                             }
@@ -269,12 +279,12 @@ void preformace_test(int n_threads, int num = 0)
                                 __sync_fetch_and_add(&chk_num_not_find, 1);
                             }
                         }
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                         for (int j = 2; j < 4; j++)
                         {
                             res = Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
                             if (res !=
-                                keys[(sidx + j + jid * 8) % half_num_data])
+                                VAL(keys[(sidx + j + jid * 8) % half_num_data]))
                             {
                                 __sync_fetch_and_add(&chk_num, 1);
                             }
@@ -289,7 +299,7 @@ void preformace_test(int n_threads, int num = 0)
                         {
                             res = Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
                             if (res !=
-                                keys[(sidx + j + jid * 8) % half_num_data])
+                                VAL(keys[(sidx + j + jid * 8) % half_num_data]))
                             {
                                 __sync_fetch_and_add(&chk_num, 1);
                             }
@@ -298,7 +308,7 @@ void preformace_test(int n_threads, int num = 0)
                                 __sync_fetch_and_add(&chk_num_not_find, 1);
                             }
                         }
-                        Insert(list, keys[i], keys[i]);
+                        Insert(list, keys[i], VAL(keys[i]));
                         break;
                     default:
                         break;
@@ -320,7 +330,7 @@ void preformace_test(int n_threads, int num = 0)
                         switch (jid)
                         {
                         case 0:
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             for (int j = 0; j < 4; j++)
                             {
                                 Search(list, keys[(i - j - jid * 8)]);
@@ -331,7 +341,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(i - j - jid * 8)]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             Search(list, keys[(i - 3 - jid * 8)]);
                             break;
                         case 2:
@@ -339,7 +349,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(i - j - jid * 8)]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             for (int j = 2; j < 4; j++)
                             {
                                 Search(list, keys[(i - j - jid * 8)]);
@@ -350,7 +360,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(i - j - jid * 8)]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             break;
                         default:
                             break;
@@ -368,7 +378,7 @@ void preformace_test(int n_threads, int num = 0)
                         switch (jid)
                         {
                         case 0:
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             for (int j = 0; j < 4; j++)
                             {
                                 Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
@@ -379,7 +389,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             Search(list, keys[(sidx + 3 + jid * 8) % half_num_data]);
                             break;
                         case 2:
@@ -387,7 +397,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             for (int j = 2; j < 4; j++)
                             {
                                 Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
@@ -398,7 +408,7 @@ void preformace_test(int n_threads, int num = 0)
                             {
                                 Search(list, keys[(sidx + j + jid * 8) % half_num_data]);
                             }
-                            Insert(list, keys[i], keys[i]);
+                            Insert(list, keys[i], VAL(keys[i]));
                             break;
                         default:
                             break;
@@ -442,7 +452,7 @@ void preformace_test(int n_threads, int num = 0)
             std::launch::async,
             [&list, &keys, &num](uint64_t from, uint64_t to, int tid)
             {
-                uint64_t scan_buf[51];
+                ValueType scan_buf[51];
                 for (uint64_t i = from + num / 2; i < to + num / 2; ++i)
                 {
                     Range_Search(list, keys[i], 50, scan_buf);
@@ -475,7 +485,7 @@ void preformace_test(int n_threads, int num = 0)
             {
                 for (uint64_t i = from + num / 2; i < to + num / 2; ++i)
                 {
-                    Update(list, keys[i], keys[i] + 1);
+                    Update(list, keys[i], VAL(keys[i]) + 1);
                 }
             },
             from, to, tid);
@@ -530,7 +540,7 @@ void preformace_test(int n_threads, int num = 0)
         dram_free(list);
         clear_cache();
         t1 = NowNanos();
-        list = recovery(n_threads);
+        list = recovery(n_threads, opt);
         fprintf(stderr, "%d threads recovery time cost is %llu ns.\n", n_threads, ElapsedNanos(t1));
     }
     /////////////////////////////
@@ -557,7 +567,7 @@ void preformace_test(int n_threads, int num = 0)
             {
                 for (int i = from + num / 2; i < to + num / 2; ++i)
                 {
-                    if (Search(list, keys[i]) != keys[i])
+                    if (Search(list, keys[i]) != VAL(keys[i]))
                     {
                         __sync_fetch_and_add(&chk_num, 1);
                     }
@@ -586,19 +596,218 @@ void preformace_test(int n_threads, int num = 0)
 #endif
 
 #endif
-    delete list;
+    dram_free(list);
     free(keys);
 }
 
+#if TEST_VAR_KEY && defined(USE_VAR_KEY)
+void var_key_test(int n_threads, PHASTOptions opt, int num = INSERT_NUM)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+    fprintf(stderr, "PHAST(string keys) : n_thread is: %d\n", n_threads);
+    std::string path = std::string(opt.path) + ".str";
+    opt.path = path.c_str();
+
+    // keys of 3 to 25 bytes, many of them share the first 8 bytes, the dot keeps them unique.
+    std::vector<std::string> keys(num);
+    std::mt19937_64 eng(num);
+    for (int i = 0; i < num; ++i)
+    {
+        char buf[48];
+        int len = snprintf(buf, sizeof(buf), "%lx.%d", eng() >> (eng() % 64), i);
+        keys[i] = std::string(buf, len);
+    }
+    PHAST *list = init_list(opt);
+    std::vector<std::future<void>> futures;
+    int data_per_thread = num / n_threads;
+
+    uint64_t t1 = NowNanos();
+    for (int tid = 0; tid < n_threads; tid++)
+    {
+        int from = data_per_thread * tid;
+        int to = (tid == n_threads - 1) ? num : from + data_per_thread;
+        futures.push_back(std::async(
+            std::launch::async,
+            [&list, &keys](int from, int to)
+            {
+                for (int i = from; i < to; ++i)
+                    Insert(list, keys[i].data(), keys[i].size(), i + 1);
+            },
+            from, to));
+    }
+    for (auto &&f : futures)
+        f.get();
+    futures.clear();
+    fprintf(stderr, "%d threads insert time cost is %llu ns.\n", n_threads, ElapsedNanos(t1));
+
+    uint64_t chk_num = 0;
+    t1 = NowNanos();
+    for (int tid = 0; tid < n_threads; tid++)
+    {
+        int from = data_per_thread * tid;
+        int to = (tid == n_threads - 1) ? num : from + data_per_thread;
+        futures.push_back(std::async(
+            std::launch::async,
+            [&list, &keys, &chk_num](int from, int to)
+            {
+                for (int i = from; i < to; ++i)
+                    if (Search(list, keys[i].data(), keys[i].size()) != (uint64_t)i + 1)
+                        __sync_fetch_and_add(&chk_num, 1);
+            },
+            from, to));
+    }
+    for (auto &&f : futures)
+        f.get();
+    futures.clear();
+    fprintf(stderr, "%d threads search time cost is %llu ns.\n", n_threads, ElapsedNanos(t1));
+    fprintf(stderr, "%llu/%d wrong search results\n", chk_num, num);
+
+    // the scans must follow the byte order of the keys.
+    std::vector<int> order(num);
+    for (int i = 0; i < num; ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&keys](int a, int b) { return keys[a] < keys[b]; });
+    std::vector<int> rank(num);
+    for (int i = 0; i < num; ++i)
+        rank[order[i]] = i;
+    chk_num = 0;
+    uint64_t scan_buf[50];
+    t1 = NowNanos();
+    for (int i = 0; i < num / 10; ++i)
+    {
+        const std::string &k = keys[i];
+        int got = Range_Search(list, k.data(), k.size(), 50, scan_buf);
+        for (int j = 0; j < got; ++j)
+        {
+            if (scan_buf[j] != (uint64_t)order[rank[i] + j] + 1)
+            {
+                chk_num++;
+                break;
+            }
+        }
+    }
+    fprintf(stderr, "scan time cost is %llu ns, %llu wrong scan results\n", ElapsedNanos(t1), chk_num);
+
+    // the deleted keys are not found, the scans skip them, the start key included.
+    chk_num = 0;
+    for (int i = 0; i < num; i += 7)
+        if (Delete(list, keys[i].data(), keys[i].size()) != (uint64_t)i + 1)
+            chk_num++;
+    for (int i = 0; i < num; ++i)
+        if (Search(list, keys[i].data(), keys[i].size()) != ((i % 7 == 0) ? 0 : (uint64_t)i + 1))
+            chk_num++;
+    fprintf(stderr, "%llu wrong delete results\n", chk_num);
+    chk_num = 0;
+    for (int i = 0; i < num / 10; ++i)
+    {
+        const std::string &k = keys[i];
+        int got = Range_Search(list, k.data(), k.size(), 50, scan_buf);
+        int r = rank[i];
+        for (int j = 0; j < got; ++j, ++r)
+        {
+            while (r < num && order[r] % 7 == 0)
+                ++r;
+            if (r == num || scan_buf[j] != (uint64_t)order[r] + 1)
+            {
+                chk_num++;
+                break;
+            }
+        }
+    }
+    fprintf(stderr, "%llu wrong scan results after deletes\n", chk_num);
+    dram_free(list);
+}
+#endif
+
+#if TEST_REBALANCE && defined(USE_ADAPTIVE_PARTITION)
+void rebalance_test(int n_threads, PHASTOptions opt, int num = INSERT_NUM)
+{
+    fprintf(stderr, "/////////////////////////////////////////\n");
+    fprintf(stderr, "PHAST(rebalance during inserts) : n_thread is: %d\n", n_threads);
+    std::string path = std::string(opt.path) + ".rb";
+    opt.path = path.c_str();
+    PHAST *list = init_list(opt);
+    KeyType step = MAX_KEY / num;
+
+    std::atomic<bool> stop(false);
+    int rounds = 0;
+    std::thread rebalancer(
+        [&list, &stop, &rounds]()
+        {
+            while (!stop)
+            {
+                rebalance_partitions(list);
+                ++rounds;
+            }
+        });
+    std::vector<std::future<void>> futures;
+    uint64_t t1 = NowNanos();
+    for (int tid = 0; tid < n_threads; tid++)
+    {
+        futures.push_back(std::async(
+            std::launch::async,
+            [&list, &num, &step, &n_threads](int tid)
+            {
+                for (int i = tid; i < num; i += n_threads)
+                    Insert(list, i * step + 1, VAL(i * step + 1));
+            },
+            tid));
+    }
+    for (auto &&f : futures)
+        f.get();
+    stop = true;
+    rebalancer.join();
+    fprintf(stderr, "%d threads insert time cost is %llu ns, %d rebalances.\n", n_threads, ElapsedNanos(t1), rounds);
+
+    uint64_t chk_num = 0;
+    for (int i = 0; i < num; ++i)
+        if (Search(list, i * step + 1) != VAL(i * step + 1))
+            chk_num++;
+    fprintf(stderr, "%llu/%d wrong search results\n", chk_num, num);
+
+    // the counters of the merged heads have been folded once no insert holds them.
+    // an insert may count on the stale neighbour of a split partition, so only
+    // the total is exact, it wraps like the counters.
+    list->epoch->TryReclaim();
+    PMAP *map = list->inner_list->map;
+    uint32_t counted = 0, n_inodes = 0;
+    for (int i = 0; i < map->nHeads; ++i)
+        counted += map->head[i]->n_inodes;
+    for (ISN *node = map->head[0]; node != NULL; node = node->next[0])
+        if (!node->is_head)
+            n_inodes++;
+    fprintf(stderr, "%d partitions, %u inner nodes, %u counted by the heads\n", map->nHeads, n_inodes, counted);
+    dram_free(list);
+}
+#endif
+
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    if (argc < 2 || argc > 4)
     {
         fprintf(stderr, "The parameter numThread is required!\n");
         return 0;
     }
 
     int num_thread = atoi(argv[1]);
-    preformace_test(num_thread);
+    PHASTOptions opt;
+    if (argc >= 3)
+    {
+        opt.n_pools = atoi(argv[2]); // stripe the partitions over PMEM_PATH.0, PMEM_PATH.1, ...
+    }
+    if (argc == 4)
+    {
+        // pmdk, file or dram.
+        for (int b = PM_BACKEND_PMDK; b <= PM_BACKEND_DRAM; ++b)
+            if (strcmp(argv[3], PM_BACKEND_NAME[b]) == 0)
+                opt.backend = (PMBackend)b;
+    }
+    preformace_test(num_thread, opt);
+#if TEST_VAR_KEY && defined(USE_VAR_KEY)
+    var_key_test(num_thread, opt);
+#endif
+#if TEST_REBALANCE && defined(USE_ADAPTIVE_PARTITION)
+    rebalance_test(num_thread, opt);
+#endif
     return 0;
 }